@@ -9,11 +9,23 @@
 #include "RootWriter/RootWriter.h"
 #include "TMath.h"
 #include "TArrow.h"
+#include "TROOT.h"
+#include "TProfile2D.h"
+#include "HealPix.h"
+#include <queue>
+#include <set>
+#include <chrono>
+#include <sstream>
+#include <cstring>
 
 DECLARE_ALGORITHM(FhtAna);
 
-std::ostream& operator << (std::ostream& s, const TVector3& v){
-	s << "(" << v.x() <<  "," << v.y() << "," << v.z() << ")";
+// Set while a thread segments a sweep configuration, see SweepConfig()
+static thread_local bool t_quiet = false;
+#define LogSegDebug if (t_quiet) {} else LogDebug
+
+std::ostream& operator << (std::ostream& s, const Vec3& v){
+	s << "(" << v.x <<  "," << v.y << "," << v.z << ")";
 	return s;
 }
 
@@ -21,9 +33,47 @@ FhtAna::FhtAna(const std::string& name)
 : AlgBase(name),
 m_iEvt(0),
 m_buf(0),
-m_usedPmtNum(0)
+m_usedPmtNum(0),
+m_c1(NULL),
+m_nPmtMap(NULL),
+m_mapType(_MAPDOUBLE),
+m_refRun(false),
+m_nChecked(0),
+m_nLabelDiff(0),
+m_nCenterDiff(0),
+m_maxCenterDiff(0),
+m_maxDirDiff(0),
+m_maxInciDiff(0),
+m_maxTiDiff(0),
+m_veto(NULL),
+m_recTree(NULL),
+m_noSim(false),
+m_validAttached(false),
+m_snapThis(false),
+m_batch(false),
+m_shard(NULL),
+m_mapTree(NULL),
+m_hPreFilter(NULL),
+m_hStatus(NULL),
+m_hFast(NULL),
+m_nCommit(0),
+m_nTrack(0),
+m_cacheParams(0),
+m_degraded(0),
+m_nDegraded(0),
+m_sweepDone(false),
+m_sweepTree(NULL),
+m_fastOnly(false),
+m_fastTime(0),
+m_maxFastTime(0),
+m_nFast(0),
+m_nOverBudget(0)
 {
 	declProp("ChargeCut", m_qcut = 0);
+	declProp("MinTotalPE", m_minTotPE = 100);
+	declProp("MinFiredPmt", m_minFiredPmt = 10);
+	declProp("NEarlyHits", m_nEarlyHits = 10);
+	declProp("MaxEarlySpread", m_maxEarlySpread = 200);
 	declProp("Use3inchPmt", m_3inchusedflag = false);
 	declProp("Use20inchPmt", m_20inchusedflag = true);
 	declProp("Pmt3inchTimeReso", m_3inchRes = 1);
@@ -32,12 +82,124 @@ m_usedPmtNum(0)
 	declProp("FilePath", outPath = "");
 	declProp("FileName", m_name = "");
 	declProp("FileNumber", m_turn = 0);
+	declProp("SkyGrid", m_skyGrid = "ThetaPhi");
+	declProp("HealPixNside", m_nside = 32);
+	declProp("PmtGraphK", m_graphK = 8);
+	declProp("PmtGraphRadius", m_graphRadius = 0);
+	declProp("PmtGraphMinSize", m_graphMinSize = 4);
+	declProp("MapPrecision", m_mapPrecision = "Double");
+	declProp("PrecisionCheck", m_precisionCheck = false);
+	declProp("Pipelined", m_pipelined = false);
+	declProp("QueueDepth", m_queueDepth = 4);
+	declProp("VetoMode", m_vetoMode = "Full");
+	declProp("FastBudget", m_fastBudget = 500);
+	declProp("RecTree", m_treePath = "FhtAna/rec");
+	declProp("Validation", m_validation = false);
+	declProp("Snapshot", m_snapMaps);
+	declProp("SnapshotEvents", m_snapEvents);
+	declProp("SnapshotEvery", m_snapEvery = 0);
+	declProp("SnapshotFile", m_snapFile = "");
+	declProp("Shard", m_shardFile = "");
+	declProp("CachePath", m_cachePath = "");
+	declProp("Segmentation", m_segParams = "");
+	declProp("Sweep", m_sweepParams);
+	declProp("SweepThreads", m_sweepThreads = 0);
+	declProp("SweepTree", m_sweepPath = "FhtAna/sweep");
+	declProp("TimeBudget", m_timeBudget = 0);
+	declProp("Outputs", m_outputs = {"Track", "InputPdf", "MapDump", "Truth"});
 }
 
 bool FhtAna::initialize() {
 	LogDebug << "Initializing" << std::endl;
 	if(not initGeomSvc())
 		return false;
+	if (not initPmtIndex())
+		return false;
+	if (not initSkyGraph())
+		return false;
+	if (not initBinTables())
+		return false;
+	if (m_mapPrecision == "Double")
+		m_mapType = _MAPDOUBLE;
+	else if (m_mapPrecision == "Float")
+		m_mapType = _MAPFLOAT;
+	else if (m_mapPrecision == "UInt16")
+		m_mapType = _MAPUINT16;
+	else {
+		LogError << "Unknown MapPrecision: " << m_mapPrecision << std::endl;
+		return false;
+	}
+	if (m_queueDepth < 1) {
+		LogError << "QueueDepth has to be positive: " << m_queueDepth << std::endl;
+		return false;
+	}
+	// Only the theta/phi grid has maps to compare
+	if (m_mapType == _MAPDOUBLE || m_skyGrid != "ThetaPhi")
+		m_precisionCheck = false;
+	if (m_vetoMode == "Fast")
+		m_fastOnly = true;
+	else if (m_vetoMode != "Full") {
+		LogError << "Unknown VetoMode: " << m_vetoMode << std::endl;
+		return false;
+	}
+	// The fast answer needs no reconstruction to overlap with
+	if (m_fastOnly)
+		m_pipelined = false;
+	SniperPtr<MuonVetoSvc> vetoSvc(getParent(), "MuonVetoSvc");
+	if (vetoSvc.valid()) {
+		m_veto = vetoSvc.data();
+		// Pipelined, the fitted answer of an event comes up to
+		// 2 * QueueDepth + 3 events after its fast one and has to find
+		// its slot still there
+		if (m_pipelined && m_veto->Depth() <= 2 * m_queueDepth + 3) {
+			LogError << "MuonVetoSvc Depth " << m_veto->Depth() << " has to be over 2 * QueueDepth + 3: "
+					 << 2 * m_queueDepth + 3 << std::endl;
+			return false;
+		}
+	}
+	else
+		LogDebug << "No MuonVetoSvc, the veto answers are not published" << std::endl;
+	// A batch job keeps no per-event files, the track goes to the shard
+	m_batch = !m_shardFile.empty();
+	if (m_batch)
+		m_outputs.assign(1, "Track");
+	if (m_validation && std::find(m_outputs.begin(), m_outputs.end(), "Truth") == m_outputs.end())
+		m_outputs.push_back("Truth");
+	if (!m_segParams.empty() && !ParseSegParams(m_segParams, m_seg.p))
+		return false;
+	// The graph chain has no watershed nor area cut
+	if (!m_segParams.empty() && m_skyGrid != "ThetaPhi")
+		LogInfo << "Segmentation on the " << m_skyGrid << " grid takes hFrac, lFrac"
+				<< (m_skyGrid == "HealPix" ? " and minLabel" : ", PmtGraphMinSize for minLabel") << std::endl;
+	if (m_fastOnly && !m_sweepParams.empty()) {
+		LogInfo << "VetoMode Fast runs no segmentation, no sweep" << std::endl;
+		m_sweepParams.clear();
+	}
+	if (!m_sweepParams.empty()) {
+		if (m_skyGrid != "ThetaPhi") {
+			LogError << "Sweep needs the ThetaPhi sky grid" << std::endl;
+			return false;
+		}
+		if (std::find(m_outputs.begin(), m_outputs.end(), "Sweep") == m_outputs.end())
+			m_outputs.push_back("Sweep");
+	}
+	// The budget would make the paths compared differ
+	if (m_timeBudget > 0 && (m_precisionCheck || !m_sweepParams.empty())) {
+		LogInfo << "PrecisionCheck and Sweep compare full reconstructions, no time budget" << std::endl;
+		m_timeBudget = 0;
+	}
+	if (not initPipeline())
+		return false;
+	if (not initShard())
+		return false;
+	if (not initSweep())
+		return false;
+	if (not initCache())
+		return false;
+	if (m_validation && not initValidation())
+		return false;
+	if (not initSnapshot())
+		return false;
 	SniperDataPtr<JM::NavBuffer> navBuf(getParent(), "/Event");
 	if (navBuf.invalid()) {
 		LogError << "Cannot get the NavBuffer @ /Event" << std::endl;
@@ -45,6 +207,24 @@ bool FhtAna::initialize() {
 	}
 	m_buf = navBuf.data();
 	m_path = outPath;
+	for (int i = 0; i < _PFNRESULT; i ++)
+		m_nPreFilter[i] = 0;
+	for (int i = 0; i < nDegradeFlag; i ++)
+		m_nDegradeFlag[i] = 0;
+	m_hitTimes.reserve(m_wpgeom->getPmtNum());
+	m_wantTruth = std::find(m_outputs.begin(), m_outputs.end(), "Truth") != m_outputs.end();
+	if (not initRecTree())
+		return false;
+	if (m_pipelined) {
+		// The worker books ROOT objects while the event loop reads input.
+		// The output ring has room for every event in flight, so the
+		// worker never waits on the commit.
+		ROOT::EnableThreadSafety();
+		m_inQueue.reset(new SpscQueue<EventRecord*>(m_queueDepth));
+		m_outQueue.reset(new SpscQueue<EventRecord*>(m_queueDepth + 2));
+		m_worker = std::thread(&FhtAna::Worker, this);
+		LogInfo << "Pipelined reconstruction, queue depth: " << m_queueDepth << std::endl;
+	}
     return true;
 }
 
@@ -52,630 +232,1311 @@ bool FhtAna::execute() {
 	LogDebug << "executing: " << m_iEvt ++ << std::endl;
 	if (m_iEvt < 2)
 		return true;
-	TH2D* FhtDis = new TH2D("FhtDistribution", "FhtDistribution", 100, 0, PI, 500, 0, 500);
-	TH2D* FhtPhi = new TH2D("FhtVPhi", "FhtVPhi", 200, -PI, PI, 500, 0, 500);
-	TH2D* Fht2D = new TH2D("FhtDistribution2D", "", 100, 0, PI, 200, -PI, PI);
-	TH2D* Q2D = new TH2D("ChargeDistribution2D", "", 100, 0, PI, 200, -PI, PI);
-	TH2D* nPMT = new TH2D("nPMT", "", 100, 0, PI, 200, - PI, PI);
-
-	TH1F* FhtDiff = new TH1F("FhtDiff", "", 2000, -100, 100);
-
-	JM::SimEvent* simevent = 0;
-	JM::EvtNavigator* nav =m_buf->curEvt();
-	std::vector<std::string>& paths = nav->getPath();
-	JM::SimHeader* simheader = 0;
-	for (size_t i = 0; i < paths.size(); ++i) {
-		const std::string& path = paths[i];
-		if (path == "/Event/SimOrig") {
-			simheader = static_cast<JM::SimHeader*>(nav->getHeader("/Event/SimOrig"));
-			LogDebug << "SimHeader (/Event/SimOrig): " << simheader << endl;
-			if (simheader)
-				break;
-		}
+	EventRecord* rec;
+	if (m_freeRecords.empty())
+		rec = new EventRecord;
+	else {
+		rec = m_freeRecords.back();
+		m_freeRecords.pop_back();
+	}
+	std::chrono::steady_clock::time_point t0 = std::chrono::steady_clock::now();
+	rec->id = m_iEvt;
+	rec->track = false;
+	rec->error.clear();
+	rec->centers.clear();
+	rec->maps.clear();
+	rec->sweep.clear();
+	rec->degraded = 0;
+	rec->stageTime.assign(m_pipe.nStages(), 0);
+	// Reject noise and low-charge triggers before any map is booked
+	rec->pf = LoadHits(*rec) ? PreFilter(*rec) : _PFNOCALIB;
+	m_nPreFilter[rec->pf] ++;
+	FastVeto(*rec);
+	if (m_veto)
+		m_veto->Publish(rec->veto);
+	double us = std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - t0).count();
+	m_nFast ++;
+	m_fastTime += us;
+	if (us > m_maxFastTime)
+		m_maxFastTime = us;
+	if (us > m_fastBudget)
+		m_nOverBudget ++;
+	rec->fastTime = us;
+
+	rec->truth = SimTruth();
+	if (rec->pf == _PFPASS && m_wantTruth && !m_noSim && !m_fastOnly)
+		LoadTruth(rec->truth);
+	if (!m_pipelined) {
+		if (!m_fastOnly)
+			Reconstruct(*rec);
+		Commit(rec);
+		return true;
 	}
+	// Event N + 1 is read while the worker reconstructs event N
+	m_inQueue->Push(rec, [this]() { CommitDone(); });
+	CommitDone();
+	return true;
+}
+
+void FhtAna::Reconstruct(EventRecord& rec) {
+	if (rec.pf != _PFPASS)
+		return;
+	// The budget counts from here, the wait in the input queue is not the
+	// reconstruction's
+	m_degraded = 0;
+	if (m_timeBudget > 0)
+		m_deadline = std::chrono::steady_clock::now() + std::chrono::microseconds((long)(m_timeBudget * 1000));
+	m_evtId = rec.id;
+	m_hitPid.swap(rec.hitPid);
+	m_hitQ.swap(rec.hitQ);
+	m_hitFht.swap(rec.hitFht);
+	m_truth = rec.truth;
+	m_trackDone = false;
+	m_sweepDone = false;
+	m_snapThis = (m_snap.IsOpen() || m_mapTree) && ((m_snapEvery > 0 && rec.id % m_snapEvery == 0) ||
+				 std::find(m_snapEvents.begin(), m_snapEvents.end(), rec.id) != m_snapEvents.end());
 	if (initPmt())
 		LogDebug << "Initializing PMT success" << std::endl;
 	else {
 		LogError << "Initializing PMT fails" << std::endl;
-		return true;
+		rec.error = "PMT initialization";
+		return;
+	}
+	// Snapshot events run in full to leave their maps
+	uint64_t key = 0;
+	bool cached = false;
+	if (m_cache.IsOpen() && !m_snapThis) {
+		key = EventKey();
+		cached = LoadCenters(key);
+		for (size_t i = 0; cached && i < m_cacheSkip.size(); i ++)
+			m_pipe.Skip(m_cacheSkip[i]);
+	}
+	if (!m_precisionCheck || RunReference()) {
+		if (!m_pipe.Run())
+			rec.error = m_pipe.Error();
+		else if (m_precisionCheck)
+			ComparePrecision();
+		else if (m_cache.IsOpen() && !m_snapThis && !cached && !m_degraded)
+			StoreCenters(key);
+	}
+	m_pipe.Clear();
+	CloseEventFiles();
+	rec.track = m_trackDone;
+	rec.centers = m_centers;
+	rec.inci = m_rInci;
+	rec.dir = m_rDir;
+	rec.dis = m_rDis;
+	rec.ang = m_rAng;
+	rec.ti = m_rTi;
+	rec.degraded = m_degraded;
+	for (int i = 0; i < m_pipe.nStages(); i ++)
+		rec.stageTime[i] = m_pipe.StageTime(i);
+	rec.maps.swap(m_snapBuf);
+	if (m_sweep.empty())
+		return;
+	// An event the sweep did not run on gives its track to every
+	// configuration
+	rec.sweep.resize(m_sweep.size());
+	for (size_t i = 0; i < m_sweep.size(); i ++) {
+		SegResult& r = rec.sweep[i];
+		if (m_sweepDone)
+			r = m_sweep[i].res;
+		else {
+			r.track = m_trackDone;
+			r.centers = m_centers;
+			r.inci = m_rInci;
+			r.dir = m_rDir;
+			r.dis = m_rDis;
+			r.ang = m_rAng;
+			r.ti = m_rTi;
+		}
 	}
-	double InciTheta, InciPhi;
-	if (freshPmtData(FhtDis, FhtPhi, Fht2D, Q2D, nPMT, InciTheta, InciPhi))
-		LogDebug << "Freshing PMT data success" << std::endl;
+}
+
+void FhtAna::Commit(EventRecord* rec) {
+	// Records arrive in event order in both modes, the single worker takes
+	// and hands back the events first in first out
+	if (rec->pf != _PFPASS)
+		LogDebug << "No Track (pre-filter: " << rec->pf << ")" << endl;
+	else if (!rec->error.empty())
+		LogDebug << "Stage " << rec->error << " stopped the reconstruction" << endl;
+	else if (rec->track) {
+		LogDebug << "PreRec Inci.Theta: " << rec->inci.Theta() << "\tPhi: " << rec->inci.Phi() << endl;
+		LogDebug << "PreRec Dir.Theta: " << rec->dir.Theta() << "\tPhi: " << rec->dir.Phi() << endl;
+	}
+	// The fitted track replaces the fast answer, which stays when the
+	// centroids give no track
+	int nCenter = rec->centers.size();
+	if (m_veto && rec->track && nCenter > 0 && nCenter <= 4) {
+		MuonVeto v = rec->veto;
+		v.level = _VETOFULL;
+		v.muon = true;
+		v.inci = rec->inci;
+		v.dir = rec->dir;
+		v.ti = rec->ti;
+		v.quality = nCenter;
+		v.degraded = rec->degraded;
+		m_veto->Publish(v);
+	}
+	if (m_recTree)
+		FillRecTree(*rec);
+	if (m_sweepTree)
+		FillSweepTree(*rec);
+	// Maps of the worker are written here, so only the event loop writes
+	// to the output files
+	for (size_t i = 0; i < rec->maps.size(); i ++)
+		WriteMap(rec->maps[i]);
+	m_nCommit ++;
+	if (rec->degraded) {
+		m_nDegraded ++;
+		for (int i = 0; i < nDegradeFlag; i ++)
+			if (rec->degraded & (1 << i))
+				m_nDegradeFlag[i] ++;
+	}
+	if (m_shard)
+		m_hPreFilter->Fill(rec->pf);
+	LogDebug << "Executed: " << rec->id << endl;
+	m_freeRecords.push_back(rec);
+}
+
+bool FhtAna::initRecTree() {
+	if (m_batch) {
+		m_shard->cd();
+		m_recTree = new TTree("rec", "FhtAna reconstruction");
+	}
+	else if (m_treePath.empty())
+		return true;
 	else {
-		LogError << "Freshing PMT data fails" << std::endl;
-		delete FhtDis;
-		delete FhtPhi;
-		delete Fht2D;
-		delete Q2D;
+		SniperPtr<RootWriter> rw(getParent(), "RootWriter");
+		if (rw.invalid()) {
+			LogInfo << "No RootWriter, the reconstruction tree is not written" << std::endl;
+			return true;
+		}
+		m_recTree = rw->bookTree(m_treePath, "FhtAna reconstruction");
+	}
+	if (!m_recTree) {
+		LogError << "Cannot book the reconstruction tree: " << m_treePath << std::endl;
+		return false;
+	}
+	// Plain numbers only, floats where double precision means nothing, so
+	// every branch is a flat column
+	RecRow& r = m_row;
+	m_recTree->Branch("evt", &r.evt, "evt/I");
+	m_recTree->Branch("pf", &r.pf, "pf/I");
+	m_recTree->Branch("status", &r.status, "status/I");
+	m_recTree->Branch("vetoLevel", &r.vetoLevel, "vetoLevel/I");
+	m_recTree->Branch("inci", r.inci, "inci[3]/F");
+	m_recTree->Branch("dir", r.dir, "dir[3]/F");
+	m_recTree->Branch("dis", &r.dis, "dis/F");
+	m_recTree->Branch("ang", &r.ang, "ang/F");
+	m_recTree->Branch("ti", &r.ti, "ti/F");
+	m_recTree->Branch("nCenter", &r.nCenter, "nCenter/I");
+	m_recTree->Branch("cTheta", r.cTheta, "cTheta[nCenter]/F");
+	m_recTree->Branch("cPhi", r.cPhi, "cPhi[nCenter]/F");
+	m_recTree->Branch("cR", r.cR, "cR[nCenter]/F");
+	m_recTree->Branch("cQ", r.cQ, "cQ[nCenter]/F");
+	m_recTree->Branch("tFast", &r.tFast, "tFast/F");
+	m_recTree->Branch("tTotal", &r.tTotal, "tTotal/F");
+	m_recTree->Branch("degraded", &r.degraded, "degraded/I");
+	// One column per declared stage, ms, 0 when it did not run
+	r.tStage.assign(m_pipe.nStages(), 0);
+	for (int i = 0; i < m_pipe.nStages(); i ++) {
+		TString name = "t" + m_pipe.StageName(i);
+		m_recTree->Branch(name, &r.tStage[i], name + "/F");
+	}
+	if (m_wantTruth) {
+		m_recTree->Branch("trFound", &r.trFound, "trFound/I");
+		m_recTree->Branch("trNTrk", &r.trNTrk, "trNTrk/I");
+		m_recTree->Branch("trInci", r.trInci, "trInci[3]/F");
+		m_recTree->Branch("trDir", r.trDir, "trDir[3]/F");
+		m_recTree->Branch("trEdep", &r.trEdep, "trEdep/F");
+		m_recTree->Branch("trQEdep", &r.trQEdep, "trQEdep/F");
+	}
+	// A row is a few hundred bytes, 64 kB baskets hold some hundred
+	// events per branch, compress better and take fewer reads
+	m_recTree->SetBasketSize("*", 64000);
+	LogDebug << "Reconstruction tree booked: " << m_treePath << std::endl;
+	return true;
+}
+
+void FhtAna::FillRecTree(const EventRecord& rec) {
+	RecRow& r = m_row;
+	r.evt = rec.id;
+	r.pf = rec.pf;
+	int nCenter = rec.centers.size();
+	if (rec.pf != _PFPASS)
+		r.status = _RECPREFILTER;
+	else if (m_fastOnly)
+		r.status = _RECFAST;
+	else if (!rec.error.empty())
+		r.status = _RECSTOPPED;
+	else if (!rec.track || nCenter == 0 || nCenter > 4)
+		r.status = _RECNOTRACK;
+	else
+		r.status = _RECTRACK;
+	r.vetoLevel = rec.veto.level;
+	// The fast answer stands in where no track was fitted
+	bool fitted = r.status == _RECTRACK;
+	const Vec3& inci = fitted ? rec.inci : rec.veto.inci;
+	const Vec3& dir = fitted ? rec.dir : rec.veto.dir;
+	r.inci[0] = inci.X();
+	r.inci[1] = inci.Y();
+	r.inci[2] = inci.Z();
+	r.dir[0] = dir.X();
+	r.dir[1] = dir.Y();
+	r.dir[2] = dir.Z();
+	r.dis = fitted ? rec.dis : 0;
+	r.ang = fitted ? rec.ang : 0;
+	r.ti = fitted ? rec.ti : rec.veto.ti;
+	r.nCenter = nCenter < RecRow::maxCenter ? nCenter : RecRow::maxCenter;
+	for (int i = 0; i < r.nCenter; i ++) {
+		r.cTheta[i] = rec.centers[i].u.Theta();
+		r.cPhi[i] = rec.centers[i].u.Phi();
+		r.cR[i] = rec.centers[i].r;
+		r.cQ[i] = rec.centers[i].q;
+	}
+	r.tFast = rec.fastTime;
+	r.degraded = rec.degraded;
+	r.tTotal = 0;
+	for (size_t i = 0; i < r.tStage.size(); i ++) {
+		r.tStage[i] = rec.stageTime[i];
+		r.tTotal += rec.stageTime[i];
+	}
+	if (m_wantTruth) {
+		r.trFound = rec.truth.found;
+		r.trNTrk = rec.truth.nTrk;
+		Vec3 u = rec.truth.dir.Unit();
+		r.trInci[0] = rec.truth.inci.X();
+		r.trInci[1] = rec.truth.inci.Y();
+		r.trInci[2] = rec.truth.inci.Z();
+		r.trDir[0] = u.X();
+		r.trDir[1] = u.Y();
+		r.trDir[2] = u.Z();
+		r.trEdep = rec.truth.edep;
+		r.trQEdep = rec.truth.qedep;
+	}
+	m_recTree->Fill();
+	if (m_shard) {
+		m_hStatus->Fill(r.status);
+		m_hFast->Fill(r.tFast);
+		for (size_t i = 0; i < r.tStage.size(); i ++)
+			if (r.tStage[i] > 0)
+				m_hStage[i]->Fill(r.tStage[i]);
+		m_nTrack += r.status == _RECTRACK;
+	}
+}
+
+bool FhtAna::ParseSegParams(const std::string& str, SegParams& p) {
+	// "[tag] key=value ...", the keys not given are left as they are
+	std::istringstream in(str);
+	std::string tok;
+	while (in >> tok) {
+		size_t eq = tok.find('=');
+		if (eq == std::string::npos) {
+			p.tag = tok;
+			continue;
+		}
+		std::string key = tok.substr(0, eq);
+		double v = atof(tok.c_str() + eq + 1);
+		if (key == "hFrac")
+			p.hFrac = v;
+		else if (key == "lFrac")
+			p.lFrac = v;
+		else if (key == "areaCut")
+			p.areaCut = v;
+		else if (key == "maxArea")
+			p.maxArea = v;
+		else if (key == "minLabel")
+			p.minLabel = v;
+		else if (key == "minSplit")
+			p.minSplit = v;
+		else if (key == "minConnect")
+			p.minConnect = v;
+		else if (key == "minCombine")
+			p.minCombine = v;
+		else {
+			LogError << "Unknown segmentation parameter " << key << " in: " << str << std::endl;
+			return false;
+		}
+	}
+	return true;
+}
+
+bool FhtAna::initSweep() {
+	if (m_sweepParams.empty())
 		return true;
+	// Each configuration starts from the Segmentation property
+	m_sweep.resize(m_sweepParams.size());
+	for (size_t i = 0; i < m_sweep.size(); i ++) {
+		SegState& s = m_sweep[i];
+		s.p = m_seg.p;
+		s.p.tag = "cfg" + std::to_string(i);
+		if (!ParseSegParams(m_sweepParams[i], s.p))
+			return false;
+		for (int k = 0; k < 5; k ++) {
+			TString name = TString::Format("sweep%d_%d", (int)i, k);
+			s.maps.push_back(new TH2D(name, "", Grid::nx, Grid::ThetaMin(), Grid::ThetaMax(), Grid::ny, Grid::PhiMin(), Grid::PhiMax()));
+			s.maps.back()->SetDirectory(0);
+		}
+	}
+	if (m_sweepThreads <= 0)
+		m_sweepThreads = std::thread::hardware_concurrency();
+	if (m_sweepThreads <= 0)
+		m_sweepThreads = 1;
+	m_sweepThreads = std::min(m_sweepThreads, (int)m_sweep.size());
+	m_sweepPool.Start(m_sweepThreads);
+
+	if (m_batch) {
+		m_shard->cd();
+		m_sweepTree = new TTree("sweep", "FhtAna segmentation sweep");
 	}
+	else if (!m_sweepPath.empty()) {
+		SniperPtr<RootWriter> rw(getParent(), "RootWriter");
+		if (rw.valid())
+			m_sweepTree = rw->bookTree(m_sweepPath, "FhtAna segmentation sweep");
+	}
+	if (!m_sweepTree) {
+		LogError << "Cannot book the sweep tree: " << m_sweepPath << std::endl;
+		return false;
+	}
+	// The parameters ride along with every row, so merged jobs of other
+	// grids stay readable
+	SweepRow& r = m_sweepRow;
+	m_sweepTree->Branch("evt", &r.evt, "evt/I");
+	m_sweepTree->Branch("cfg", &r.cfg, "cfg/I");
+	m_sweepTree->Branch("tag", r.tag, "tag/C");
+	m_sweepTree->Branch("hFrac", &r.hFrac, "hFrac/F");
+	m_sweepTree->Branch("lFrac", &r.lFrac, "lFrac/F");
+	m_sweepTree->Branch("areaCut", &r.areaCut, "areaCut/F");
+	m_sweepTree->Branch("maxArea", &r.maxArea, "maxArea/I");
+	m_sweepTree->Branch("minLabel", &r.minLabel, "minLabel/I");
+	m_sweepTree->Branch("minSplit", &r.minSplit, "minSplit/I");
+	m_sweepTree->Branch("minConnect", &r.minConnect, "minConnect/I");
+	m_sweepTree->Branch("minCombine", &r.minCombine, "minCombine/I");
+	m_sweepTree->Branch("status", &r.status, "status/I");
+	m_sweepTree->Branch("inci", r.inci, "inci[3]/F");
+	m_sweepTree->Branch("dir", r.dir, "dir[3]/F");
+	m_sweepTree->Branch("dis", &r.dis, "dis/F");
+	m_sweepTree->Branch("ang", &r.ang, "ang/F");
+	m_sweepTree->Branch("ti", &r.ti, "ti/F");
+	m_sweepTree->Branch("nCenter", &r.nCenter, "nCenter/I");
+	m_sweepTree->Branch("cTheta", r.cTheta, "cTheta[nCenter]/F");
+	m_sweepTree->Branch("cPhi", r.cPhi, "cPhi[nCenter]/F");
+	m_sweepTree->Branch("cR", r.cR, "cR[nCenter]/F");
+	m_sweepTree->Branch("cQ", r.cQ, "cQ[nCenter]/F");
+	m_sweepTree->SetBasketSize("*", 64000);
+	LogInfo << "Segmentation sweep, configurations: " << m_sweep.size() << "\tthreads: " << m_sweepThreads << std::endl;
+	return true;
+}
 
-	double tmpN = nPMT->GetMaximum();
-	for (int i = 1; i <= 100; i ++)
-		for (int j = 1; j <= 200; j ++)
-			nPMT->SetBinContent(i, j, nPMT->GetBinContent(i, j) / tmpN);
-	
-	// FillContent(nPMT, 100, 200);
+void FhtAna::FillSweepTree(const EventRecord& rec) {
+	SweepRow& r = m_sweepRow;
+	r.evt = rec.id;
+	const SegResult none;
+	for (size_t k = 0; k < m_sweep.size(); k ++) {
+		const SegParams& p = m_sweep[k].p;
+		const SegResult& s = k < rec.sweep.size() ? rec.sweep[k] : none;
+		r.cfg = k;
+		strncpy(r.tag, p.tag.c_str(), sizeof(r.tag) - 1);
+		r.tag[sizeof(r.tag) - 1] = 0;
+		r.hFrac = p.hFrac;
+		r.lFrac = p.lFrac;
+		r.areaCut = p.areaCut;
+		r.maxArea = p.maxArea;
+		r.minLabel = p.minLabel;
+		r.minSplit = p.minSplit;
+		r.minConnect = p.minConnect;
+		r.minCombine = p.minCombine;
+		int nCenter = s.centers.size();
+		if (rec.pf != _PFPASS)
+			r.status = _RECPREFILTER;
+		else if (!rec.error.empty())
+			r.status = _RECSTOPPED;
+		else if (!s.track || nCenter == 0 || nCenter > 4)
+			r.status = _RECNOTRACK;
+		else
+			r.status = _RECTRACK;
+		bool fitted = r.status == _RECTRACK;
+		r.inci[0] = fitted ? s.inci.X() : 0;
+		r.inci[1] = fitted ? s.inci.Y() : 0;
+		r.inci[2] = fitted ? s.inci.Z() : 0;
+		r.dir[0] = fitted ? s.dir.X() : 0;
+		r.dir[1] = fitted ? s.dir.Y() : 0;
+		r.dir[2] = fitted ? s.dir.Z() : 0;
+		r.dis = fitted ? s.dis : 0;
+		r.ang = fitted ? s.ang : 0;
+		r.ti = fitted ? s.ti : 0;
+		r.nCenter = nCenter < RecRow::maxCenter ? nCenter : RecRow::maxCenter;
+		for (int i = 0; i < r.nCenter; i ++) {
+			r.cTheta[i] = s.centers[i].u.Theta();
+			r.cPhi[i] = s.centers[i].u.Phi();
+			r.cR[i] = s.centers[i].r;
+			r.cQ[i] = s.centers[i].q;
+		}
+		m_sweepTree->Fill();
+	}
+}
 
-	TString pdfPath = m_path + "pdf/" + m_name + "_" + m_turn + "_" + m_iEvt + ".pdf";
-	TString txtPath = m_path + m_name + "_" + m_turn + "_" + m_iEvt + ".txt";
-	ofstream of(txtPath);
+bool FhtAna::initCache() {
+	if (m_cachePath.empty())
+		return true;
+	// Everything upstream of the centroids, FindTrk() still needs the
+	// maps and the PMT table of the ingestion
+	if (m_skyGrid == "ThetaPhi") {
+		const char* dense[] = {"Expansion", "Smooth", "CoarseRMS", "RMS", "ChargeSpectrum",
+							   "Threshold", "Label", "Segment", "Centers"};
+		m_cacheSkip.assign(dense, dense + sizeof(dense) / sizeof(dense[0]));
+	}
+	else
+		m_cacheSkip.assign(1, "GraphCenters");
+	for (size_t i = 0; i < m_outputs.size(); i ++) {
+		for (size_t k = 0; k < m_cacheSkip.size(); k ++) {
+			if (m_outputs[i] != "Centers" && m_pipe.Produces(m_cacheSkip[k], m_outputs[i])) {
+				LogInfo << "Output " << m_outputs[i] << " needs the segmentation, no cache" << std::endl;
+				return true;
+			}
+		}
+	}
+	if (m_precisionCheck) {
+		LogInfo << "PrecisionCheck compares the segmentation, no cache" << std::endl;
+		return true;
+	}
+	if (!m_sweep.empty()) {
+		LogInfo << "Sweep segments the maps of every event, no cache" << std::endl;
+		return true;
+	}
+	// Every setting the centroids depend on, a change gives other keys
+	const int version = 4;
+	const SegParams& p = m_seg.p;
+	double num[] = {(double)version, m_qcut, m_LSRadius, (double)Grid::nTheta, (double)Grid::halo,
+					(double)m_nside, (double)m_graphK, m_graphRadius, (double)m_graphMinSize,
+					(double)m_mapType, (double)m_20inchusedflag, (double)m_3inchusedflag,
+					p.hFrac, p.lFrac, p.areaCut, (double)p.maxArea, (double)p.minLabel, (double)p.minSplit,
+					(double)p.minConnect, (double)p.minCombine};
+	m_cacheParams = ResultCache::Hash(num, sizeof(num));
+	m_cacheParams = ResultCache::Hash(m_skyGrid.data(), m_skyGrid.size(), m_cacheParams);
+	if (!m_cache.Open(m_cachePath)) {
+		LogError << "Cannot open the result cache: " << m_cachePath << std::endl;
+		return false;
+	}
+	LogInfo << "Result cache " << m_cachePath << ", records: " << m_cache.nRecords() << std::endl;
+	return true;
+}
+
+uint64_t FhtAna::EventKey() const {
+	uint64_t h = m_cacheParams;
+	h = ResultCache::Hash(&m_hitPid[0], m_hitPid.size() * sizeof(int), h);
+	h = ResultCache::Hash(&m_hitQ[0], m_hitQ.size() * sizeof(double), h);
+	return ResultCache::Hash(&m_hitFht[0], m_hitFht.size() * sizeof(double), h);
+}
 
-	auto c1 = new TCanvas("Fht", "", 800, 800);
+bool FhtAna::LoadCenters(uint64_t key) {
+	// u, r and q of each centroid, the hit count guards the key
+	int n;
+	const double* c = m_cache.Find(key, m_hitPid.size(), n);
+	if (!c || n % 5)
+		return false;
+	m_centers.resize(n / 5);
+	for (size_t i = 0; i < m_centers.size(); i ++, c += 5) {
+		m_centers[i].u = Vec3(c[0], c[1], c[2]);
+		m_centers[i].r = c[3];
+		m_centers[i].q = c[4];
+	}
+	return true;
+}
+
+void FhtAna::StoreCenters(uint64_t key) {
+	m_cacheBuf.clear();
+	for (size_t i = 0; i < m_centers.size(); i ++) {
+		const Centroid& c = m_centers[i];
+		double v[] = {c.u.X(), c.u.Y(), c.u.Z(), c.r, c.q};
+		m_cacheBuf.insert(m_cacheBuf.end(), v, v + 5);
+	}
+	m_cache.Insert(key, m_hitPid.size(), m_cacheBuf);
+}
+
+bool FhtAna::initShard() {
+	if (!m_batch)
+		return true;
+	m_shard = TFile::Open(m_shardFile.c_str(), "RECREATE");
+	if (!m_shard || m_shard->IsZombie()) {
+		LogError << "Cannot open the shard: " << m_shardFile << std::endl;
+		return false;
+	}
+	// Counters and timing, summed by the merge
+	m_hPreFilter = new TH1D("preFilter", "Pre-filter result", _PFNRESULT, 0, _PFNRESULT);
+	m_hStatus = new TH1D("status", "Reconstruction status", _RECFAST + 1, 0, _RECFAST + 1);
+	m_hFast = new TH1F("tFast", "Fast veto decision / us", 1000, 0, 10000);
+	m_hPreFilter->SetDirectory(0);
+	m_hStatus->SetDirectory(0);
+	m_hFast->SetDirectory(0);
+	for (int i = 0; i < m_pipe.nStages(); i ++) {
+		TString name = "t" + m_pipe.StageName(i);
+		m_hStage.push_back(new TH1F(name, name + " / ms", 1000, 0, 1000));
+		m_hStage.back()->SetDirectory(0);
+	}
+	if (!m_snapMaps.empty()) {
+		m_shard->cd();
+		m_mapTree = new TTree("maps", "FhtAna intermediate maps");
+		m_mapTree->Branch("event", &m_mapRow.event, "event/I");
+		m_mapTree->Branch("nx", &m_mapRow.nx, "nx/I");
+		m_mapTree->Branch("ny", &m_mapRow.ny, "ny/I");
+		m_mapTree->Branch("xmin", &m_mapRow.xmin, "xmin/D");
+		m_mapTree->Branch("xmax", &m_mapRow.xmax, "xmax/D");
+		m_mapTree->Branch("ymin", &m_mapRow.ymin, "ymin/D");
+		m_mapTree->Branch("ymax", &m_mapRow.ymax, "ymax/D");
+		m_mapTree->Branch("stage", &m_mapRow.stage);
+		m_mapTree->Branch("name", &m_mapRow.name);
+		m_mapTree->Branch("bins", &m_mapRow.bins);
+	}
+	LogInfo << "Batch mode, shard: " << m_shardFile << std::endl;
+	return true;
+}
+
+void FhtAna::CloseShard() {
+	// One row describing the job, the merged shards keep one per job
+	m_shard->cd();
+	TTree* jobs = new TTree("jobs", "FhtAna jobs");
+	std::string file = m_name;
+	std::string path = outPath;
+	std::string grid = m_skyGrid;
+	std::string precision = m_mapPrecision;
+	int turn = m_turn;
+	long nEvent = m_nCommit;
+	long nTrack = m_nTrack;
+	long nDegraded = m_nDegraded;
+	jobs->Branch("path", &path);
+	jobs->Branch("file", &file);
+	jobs->Branch("fileNumber", &turn, "fileNumber/I");
+	jobs->Branch("skyGrid", &grid);
+	jobs->Branch("mapPrecision", &precision);
+	jobs->Branch("nEvent", &nEvent, "nEvent/L");
+	jobs->Branch("nTrack", &nTrack, "nTrack/L");
+	jobs->Branch("nDegraded", &nDegraded, "nDegraded/L");
+	jobs->Fill();
+	jobs->Write();
+	m_recTree->Write();
+	if (m_sweepTree)
+		m_sweepTree->Write();
+	if (m_mapTree)
+		m_mapTree->Write();
+	m_hPreFilter->Write();
+	m_hStatus->Write();
+	m_hFast->Write();
+	for (size_t i = 0; i < m_hStage.size(); i ++)
+		m_hStage[i]->Write();
+	m_shard->Close();
+	delete m_shard;
+	m_shard = NULL;
+	m_recTree = NULL;
+	m_sweepTree = NULL;
+	m_mapTree = NULL;
+	delete m_hPreFilter;
+	delete m_hStatus;
+	delete m_hFast;
+	for (size_t i = 0; i < m_hStage.size(); i ++)
+		delete m_hStage[i];
+	m_hStage.clear();
+}
+
+void FhtAna::CommitDone() {
+	EventRecord* rec;
+	while (m_outQueue->TryPop(rec) && rec)
+		Commit(rec);
+}
+
+void FhtAna::Worker() {
+	// NULL closes the stream and is passed on
+	while (EventRecord* rec = m_inQueue->Pop()) {
+		Reconstruct(*rec);
+		m_outQueue->Push(rec, []() {});
+	}
+	m_outQueue->Push(NULL, []() {});
+}
+
+bool FhtAna::RunReference() {
+	// The double path of the same event up to the track and with no
+	// output, then the ingestion is undone for the real run
+	int type = m_mapType;
+	m_mapType = _MAPDOUBLE;
+	m_refRun = true;
+	m_refMark.clear();
+	bool ok = m_pipe.Plan({"Track"}) && m_pipe.Run();
+	m_pipe.Clear();
+	m_refRun = false;
+	m_mapType = type;
+	m_refCenters = m_centers;
+	m_refInci = m_rInci;
+	m_refDir = m_rDir;
+	m_refDis = m_rDis;
+	m_refTi = m_rTi;
+	if (!m_pipe.Plan(m_outputs) || !initPmt()) {
+		LogError << "Cannot restore the reconstruction after the double path" << endl;
+		return false;
+	}
+	if (!ok)
+		LogInfo << "Double path stopped, no precision check" << endl;
+	m_lowMark.clear();
+	return ok;
+}
+
+void FhtAna::ComparePrecision() {
+	int nLabel = 0;
+	if (m_refMark.size() == m_lowMark.size()) {
+		for (size_t b = 0; b < m_refMark.size(); b ++)
+			nLabel += (m_refMark[b] != m_lowMark[b]);
+	}
+	else
+		nLabel = Grid::Ext::size;
+	double dCenter = 0;
+	for (size_t i = 0; i < m_centers.size() && i < m_refCenters.size(); i ++)
+		dCenter = std::max(dCenter, m_centers[i].u.Angle(m_refCenters[i].u));
+	double dDir = m_rDir.Angle(m_refDir);
+	double dInci = (m_rInci - m_refInci).Mag();
+	double dTi = fabs(m_rTi - m_refTi);
+	m_nChecked ++;
+	if (nLabel)
+		m_nLabelDiff ++;
+	if (m_centers.size() != m_refCenters.size())
+		m_nCenterDiff ++;
+	m_maxCenterDiff = std::max(m_maxCenterDiff, dCenter);
+	m_maxDirDiff = std::max(m_maxDirDiff, dDir);
+	m_maxInciDiff = std::max(m_maxInciDiff, dInci);
+	m_maxTiDiff = std::max(m_maxTiDiff, dTi);
+	if (nLabel || m_centers.size() != m_refCenters.size())
+		LogInfo << m_mapPrecision << " maps changed the event, label bins: " << nLabel
+				<< "\tcentroids: " << m_centers.size() << " / " << m_refCenters.size() << endl;
+	LogDebug << "Precision check, centroid: " << dCenter << "\tdir: " << dDir << "\tinci: " << dInci
+			 << "\tdis: " << fabs(m_rDis - m_refDis) << "\tti: " << dTi << endl;
+}
+
+bool FhtAna::initPipeline() {
+	// Stages run in declaration order, a stage reading a map has to be
+	// declared before the stage modifying it in place
+	m_pipe.AddStage("Ingest", {}, {"PmtData", "Fht2D", "Q2D"},
+					[this]() { return StageIngest(); });
+	m_pipe.AddStage("FhtProfile", {"PmtData"}, {"FhtProfile"},
+					[this]() { return StageFhtProfile(); });
+	m_pipe.AddStage("InputPdf", {"Q2D"}, {"InputPdf"},
+					[this]() { return StageInputPdf(); });
+	m_pipe.AddStage("Normalize", {"Q2D"}, {"QNorm"},
+					[this]() { return StageNormalize(); });
+	m_pipe.AddStage("MapDump", {"QNorm", "Fht2D"}, {"MapDump"},
+					[this]() { return StageMapDump(); });
+	if (m_skyGrid == "ThetaPhi") {
+		m_pipe.AddStage("Expansion", {"QNorm"}, {"QFilled"},
+						[this]() { return StageExpansion(); });
+		m_pipe.AddStage("Smooth", {"QFilled"}, {"QSmooth"},
+						[this]() { return StageSmooth(); });
+		m_pipe.AddStage("CoarseRMS", {"QSmooth"}, {"CoarseRMS"},
+						[this]() { return StageCoarseRMS(); });
+		m_pipe.AddStage("RMS", {"QSmooth"}, {"exRMS"},
+						[this]() { return StageRMS(); });
+		m_pipe.AddStage("ChargeSpectrum", {"exRMS"}, {"ChargeSpectrum"},
+						[this]() { return StageChargeSpectrum(); });
+		m_pipe.AddStage("Threshold", {"exRMS"}, {"R2HCut", "R2LCut"},
+						[this]() { return StageThreshold(); });
+		m_pipe.AddStage("Label", {"R2HCut", "R2LCut"}, {"cHRMS", "cLRMS"},
+						[this]() { return StageLabel(); });
+		m_pipe.AddStage("Segment", {"R2HCut", "R2LCut", "cHRMS", "cLRMS"}, {"totMark"},
+						[this]() { return StageSegment(); });
+		m_pipe.AddStage("Centers", {"QSmooth", "totMark", "PmtData"}, {"Centers"},
+						[this]() { return StageCenters(); });
+		m_pipe.AddStage("Sweep", {"exRMS", "QSmooth", "Fht2D", "PmtData"}, {"Sweep"},
+						[this]() { return StageSweep(); });
+	}
+	else {
+		m_pipe.AddStage("GraphCenters", {"PmtData"}, {"Centers"},
+						[this]() { return StageGraphCenters(); });
+	}
+	m_pipe.AddStage("Track", {"Centers", "Fht2D"}, {"Track"},
+					[this]() { return StageTrack(); });
+	m_pipe.AddStage("Truth", {"PmtData", "Fht2D"}, {"Truth"},
+					[this]() { return StageTruth(); });
+
+	if (!m_pipe.Plan(m_outputs)) {
+		LogError << "Cannot plan the reconstruction: " << m_pipe.Error() << std::endl;
+		return false;
+	}
+	std::vector<std::string> planned = m_pipe.Planned();
+	for (size_t i = 0; i < planned.size(); i ++)
+		LogDebug << "Planned stage: " << planned[i] << std::endl;
+	return true;
+}
+
+TH2D* FhtAna::NewMap(const char* name) {
+	return m_pipe.Acquire(name, Grid::nTheta, 0, PI, Grid::nPhi, -PI, PI);
+}
+
+TH2D* FhtAna::NewExtMap(const char* name) {
+	return m_pipe.Acquire(name, Grid::nx, Grid::ThetaMin(), Grid::ThetaMax(), Grid::ny, Grid::PhiMin(), Grid::PhiMax());
+}
+
+std::ofstream& FhtAna::EventTxt() {
+	if (m_batch)
+		return m_noFile;
+	if (!m_txt.is_open()) {
+		TString txtPath = m_path + m_name + "_" + m_turn + "_" + m_evtId + ".txt";
+		m_txt.open(txtPath);
+	}
+	return m_txt;
+}
+
+void FhtAna::OpenPdf(const TString& path) {
+	m_pdfPath = path;
+	m_c1 = new TCanvas("Fht", "", 800, 800);
 	gStyle->SetOptStat(0000);
 	gStyle->SetPalette(1);
-	c1->SetRightMargin(0.15);
-	c1->SetBottomMargin(0.15);
-	c1->SetLeftMargin(0.15);
-	c1->SetTopMargin(0.15);
-	c1->Print(pdfPath + "[");
-
-	TH2D* pmt = (TH2D*)nPMT->Clone("npmt");
-	pmt->GetXaxis()->SetTitle("Theta / Radian");
-	pmt->GetYaxis()->SetTitle("Phi / Radian");
-	pmt->GetXaxis()->SetTitleSize(0.05);
-	pmt->GetYaxis()->SetTitleSize(0.05);
-	pmt->GetXaxis()->SetLabelSize(0.05);
-	pmt->GetYaxis()->SetLabelSize(0.05);
-	c1->cd();
-	pmt->Draw("colz");
-	c1->Print(pdfPath);
-
-	TH2D* orig = (TH2D*)Q2D->Clone("ori");
-	orig->GetXaxis()->SetTitle("Theta / Radian");
-	orig->GetYaxis()->SetTitle("Phi / Radian");
-	orig->GetXaxis()->SetTitleSize(0.05);
-	orig->GetYaxis()->SetTitleSize(0.05);
-	orig->GetXaxis()->SetLabelSize(0.05);
-	orig->GetYaxis()->SetLabelSize(0.05);
-	c1->cd();
-	orig->Draw("colz");
-	c1->Print(pdfPath);
-
-	for (int i = 1; i <= 100; i ++)
-		for (int j = 1; j <= 200; j ++)
-			if (nPMT->GetBinContent(i, j))
-				Q2D->SetBinContent(i, j, Q2D->GetBinContent(i, j) / nPMT->GetBinContent(i, j));
-
-	auto exQ2D = new TH2D("ExQ2D", "", 120, -0.1 * PI, 1.1 * PI, 220, -1.1 * PI, 1.1 * PI);
-	MapExtend(exQ2D, Q2D, 100, 200);
-	for (int i = 1; i <= 120; i ++) {
-		for (int j = 1; j <= 220; j ++) {
-			of << exQ2D->GetBinContent(i, j) << "\t";
+	m_c1->SetRightMargin(0.15);
+	m_c1->SetBottomMargin(0.15);
+	m_c1->SetLeftMargin(0.15);
+	m_c1->SetTopMargin(0.15);
+	m_c1->Print(m_pdfPath + "[");
+}
+
+void FhtAna::PrintPage(TH1* h, const char* opt, const char* xTitle, const char* yTitle) {
+	if (m_batch)
+		return;
+	if (!m_c1)
+		OpenPdf(m_path + "pdf/" + m_name + "_" + m_turn + "_" + m_evtId + ".pdf");
+	h->SetTitle("");
+	h->GetXaxis()->SetTitle(xTitle);
+	h->GetYaxis()->SetTitle(yTitle);
+	h->GetXaxis()->SetTitleSize(0.05);
+	h->GetYaxis()->SetTitleSize(0.05);
+	h->GetXaxis()->SetLabelSize(0.05);
+	h->GetYaxis()->SetLabelSize(0.05);
+	m_c1->cd();
+	h->Draw(opt);
+	m_c1->Print(m_pdfPath);
+}
+
+void FhtAna::CloseEventFiles() {
+	if (m_c1) {
+		m_c1->Print(m_pdfPath + "]");
+		delete m_c1;
+		m_c1 = NULL;
+	}
+	if (m_txt.is_open())
+		m_txt.close();
+}
+
+bool FhtAna::StageIngest() {
+	TH2D* Fht2D = NewMap("FhtDistribution2D");
+	TH2D* Q2D = NewMap("ChargeDistribution2D");
+	m_pipe.Put("Fht2D", Fht2D);
+	m_pipe.Put("Q2D", Q2D);
+	Vec3 first;
+	if (freshPmtData(Fht2D, Q2D, first))
+		LogDebug << "Freshing PMT data success" << std::endl;
+	else {
+		LogError << "Freshing PMT data fails" << std::endl;
+		return false;
+	}
+	return true;
+}
+
+bool FhtAna::StageFhtProfile() {
+	TH2D* FhtDis = new TH2D("FhtDistribution", "FhtDistribution", Grid::nTheta, 0, PI, 500, 0, 500);
+	TH2D* FhtPhi = new TH2D("FhtVPhi", "FhtVPhi", Grid::nPhi, -PI, PI, 500, 0, 500);
+	for (unsigned int i = 0; i < totPmtNum; i ++) {
+		if (!m_ptab[i].used)
+			continue;
+		FhtDis->Fill(m_ptab[i].pos.Theta(), m_ptab[i].fht);
+		FhtPhi->Fill(m_ptab[i].pos.Phi(), m_ptab[i].fht);
+	}
+	PrintPage(FhtDis, "colz", "Theta / Radian", "FHT / ns");
+	PrintPage(FhtPhi, "colz", "Phi / Radian", "FHT / ns");
+	delete FhtDis;
+	delete FhtPhi;
+	return true;
+}
+
+bool FhtAna::StageInputPdf() {
+	PrintPage(m_nPmtMap, "colz", "Theta / Radian", "Phi / Radian");
+	PrintPage(m_pipe.Get("Q2D"), "colz", "Theta / Radian", "Phi / Radian");
+	return true;
+}
+
+bool FhtAna::StageNormalize() {
+	// Charge per PMT, relative to the densest bin
+	double* q = m_pipe.Get("Q2D")->GetArray();
+	Eval<Grid::Base>(q, MapRef(q) * MapRef(&m_bins.norm[0]));
+	m_pipe.Move("Q2D", "QNorm");
+	return true;
+}
+
+bool FhtAna::StageMapDump() {
+	std::ofstream& of = EventTxt();
+	TH2D* ex = NewExtMap("ExQ2D");
+	MapExtend(ex, m_pipe.Get("QNorm"));
+	for (int i = 1; i <= Grid::nx; i ++) {
+		for (int j = 1; j <= Grid::ny; j ++) {
+			of << ex->GetBinContent(i, j) << "\t";
 		}
 		of << endl;
 	}
-	auto exFht2D = new TH2D("ExFht2D", "", 120, -0.1 * PI, 1.1 * PI, 220, -1.1 * PI, 1.1 * PI);
-	MapExtend(exFht2D, Fht2D, 100, 200);
-	for (int i = 1; i <= 120; i ++) {
-		for (int j = 1; j <= 220; j ++) {
-			of << exFht2D->GetBinContent(i, j) << "\t";
+	MapExtend(ex, m_pipe.Get("Fht2D"));
+	for (int i = 1; i <= Grid::nx; i ++) {
+		for (int j = 1; j <= Grid::ny; j ++) {
+			of << ex->GetBinContent(i, j) << "\t";
 		}
 		of << endl;
 	}
+	m_pipe.Release(ex);
+	return true;
+}
 
-	/*
-	c1->cd();
-	Q2D->GetXaxis()->SetTitle("Theta / Radian");
-	Q2D->GetYaxis()->SetTitle("Phi / Radian");
-	Q2D->GetXaxis()->SetTitleSize(0.05);
-	Q2D->GetYaxis()->SetTitleSize(0.05);
-	Q2D->GetXaxis()->SetLabelSize(0.05);
-	Q2D->GetYaxis()->SetLabelSize(0.05);
-	Q2D->Draw("colz");
-	c1->Print(pdfPath);
-	*/
+bool FhtAna::StageExpansion() {
+	if (OverBudget()) {
+		CoarseFallback();
+		return true;
+	}
+	TH2D* Q2D = m_pipe.Get("QNorm");
+	if (m_mapType == _MAPDOUBLE)
+		Expansion<Grid::Base>(Q2D, 4);
+	else {
+		// The filled map goes on in m_fq, the TH2D is left as it is
+		NarrowCharge(Q2D->GetArray());
+		MapKernel<Grid::Base>::Expansion(&m_fq[0], 4);
+	}
+	m_pipe.Move("QNorm", "QFilled");
+	return true;
+}
+
+void FhtAna::NarrowCharge(const double* q) {
+	if (m_fq.empty())
+		m_fq.assign(Grid::Base::size, 0);
+	if (m_mapType != _MAPUINT16) {
+		Eval<Grid::Base>(&m_fq[0], MapRef(q));
+		return;
+	}
+	// 16-bit charge on a per-event scale, the peak bin maps to 65535
+	if (m_q16.empty())
+		m_q16.assign(Grid::Base::size, 0);
+	double peak = MapKernel<Grid::Base>::Max(q);
+	float scale = peak > 0 ? peak / 65535 : 1;
+	Eval<Grid::Base>(&m_q16[0], Over(MapRef(q), 0.) / scale + 0.5);
+	Eval<Grid::Base>(&m_fq[0], MapArray<unsigned short>(&m_q16[0]) * scale);
+}
 
+bool FhtAna::StageSmooth() {
 	TString na("ChargeSmoothed");
-	// FillContent(Q2D, 100, 200);
-	for (int i = 0; i < 4; i ++)
-		Expansion(Q2D, 100, 200);
-
-	/*
-	c1->cd();
-	Q2D->GetXaxis()->SetTitle("Theta / Radian");
-	Q2D->GetYaxis()->SetTitle("Phi / Radian");
-	Q2D->GetXaxis()->SetTitleSize(0.05);
-	Q2D->GetYaxis()->SetTitleSize(0.05);
-	Q2D->GetXaxis()->SetLabelSize(0.05);
-	Q2D->GetYaxis()->SetLabelSize(0.05);
-	Q2D->Draw("colz");
-	c1->Print(pdfPath);
-	*/
-
-	TH2D* Q2Smooth = MapSmooth(Q2D, 100, 200, na);
-
-	/*
-	TH2D* step1Q = (TH2D*)Q2Smooth->Clone("Step1Q");
-	step1Q->GetXaxis()->SetTitle("Theta / Radian");
-	step1Q->GetYaxis()->SetTitle("Phi / Radian");
-	step1Q->GetXaxis()->SetTitleSize(0.05);
-	step1Q->GetYaxis()->SetTitleSize(0.05);
-	step1Q->GetXaxis()->SetLabelSize(0.05);
-	step1Q->GetYaxis()->SetLabelSize(0.05);
-	c1->cd();
-	step1Q->Draw("colz");
-	c1->Print(pdfPath);
-	*/
-
-	TH2D* Q2Pool = new TH2D("PoolQSmooth", "", 12, - 0.1 * PI, 1.1 * PI, 22, - 1.1 * PI, 1.1 * PI);
-	Pool(Q2Smooth, Q2Pool, 120, 220, 10);
-
-	TH2D* RMSPool = new TH2D("RMS", "", 10, 0, PI, 20, -PI, PI);
-	RMSMap(Q2Pool, RMSPool, 12, 22, 1, 1, 1.5E6);
-	// TH2D* QPCut = PECut(Q2Pool, 12, 22, 0.6);
-	delete Q2Pool;
-	delete RMSPool;
-
-	TH2D* RMS = new TH2D("RMS", "", 100, 0, PI, 200, - PI, PI);
-	RMSMap(Q2Smooth, RMS, 120, 220, 10, 3, 5E4);
-
-	/*
-	c1->cd();
-	RMS->GetXaxis()->SetTitle("Theta / Radian");
-	RMS->GetYaxis()->SetTitle("Phi / Radian");
-	RMS->GetXaxis()->SetTitleSize(0.05);
-	RMS->GetYaxis()->SetTitleSize(0.05);
-	RMS->GetXaxis()->SetLabelSize(0.05);
-	RMS->GetYaxis()->SetLabelSize(0.05);
-	RMS->Draw("colz");
-	c1->Print(pdfPath);
-	*/
-
-	TH2D* exRMS = new TH2D("exRMS", "", 120, - PI * 0.1, PI * 1.1, 220, - PI * 1.1, PI * 1.1);
-	MapExtend(exRMS, RMS, 100, 200);
-
-	delete RMS;
-
-	/*
-	c1->cd();
-	exRMS->GetXaxis()->SetTitle("Theta / Radian");
-	exRMS->GetYaxis()->SetTitle("Phi / Radian");
-	exRMS->GetXaxis()->SetTitleSize(0.05);
-	exRMS->GetYaxis()->SetTitleSize(0.05);
-	exRMS->GetXaxis()->SetLabelSize(0.05);
-	exRMS->GetYaxis()->SetLabelSize(0.05);
-	exRMS->Draw("colz");
-	c1->Print(pdfPath);
-	*/
-
-	// TH2D* Q2HCut = PECut(Q2Smooth, 120, 220, 0.8);
-	TH2D* R2HCut = PECut(exRMS, 120, 220, 0.8);
-	// TH2D* Q2LCut = PECut(Q2Smooth, 120, 220, 0.35);
-	TH2D* R2LCut = PECut(exRMS, 120, 220, 0.35);
-
-	/*
-	c1->cd();
-	R2LCut->GetXaxis()->SetTitle("Theta / Radian");
-	R2LCut->GetYaxis()->SetTitle("Phi / Radian");
-	R2LCut->GetXaxis()->SetTitleSize(0.05);
-	R2LCut->GetYaxis()->SetTitleSize(0.05);
-	R2LCut->GetXaxis()->SetLabelSize(0.05);
-	R2LCut->GetYaxis()->SetLabelSize(0.05);
-	R2LCut->Draw("colz");
-	c1->Print(pdfPath);
-	*/
-
-	/*
-	c1->cd();
-	R2HCut->GetXaxis()->SetTitle("Theta / Radian");
-	R2HCut->GetYaxis()->SetTitle("Phi / Radian");
-	R2HCut->GetXaxis()->SetTitleSize(0.05);
-	R2HCut->GetYaxis()->SetTitleSize(0.05);
-	R2HCut->GetXaxis()->SetLabelSize(0.05);
-	R2HCut->GetYaxis()->SetLabelSize(0.05);
-	R2HCut->Draw("colz");
-	c1->Print(pdfPath);
-	*/
-
-	// TH2D* cHQ = new TH2D("cHQ", "", 120, - 0.1 * PI, 1.1 * PI, 220, - 1.1 * PI, 1.1 * PI);
-	// MarkConnection(Q2HCut, 120, 220, cHQ, 20);
-	// TH2D* cLQ = new TH2D("cLQ", "", 120, - 0.1 * PI, 1.1 * PI, 220, - 1.1 * PI, 1.1 * PI);
-	// MarkConnection(Q2LCut, 120, 220, cLQ, 20);
-	TH2D* cHRMS = new TH2D("cHRMS", "", 120, - 0.1 * PI, 1.1 * PI, 220, - 1.1 * PI, 1.1 * PI);
-	MarkConnection(R2HCut, 120, 220, cHRMS, 20);
-	TH2D* cLRMS = new TH2D("cLRMS", "", 120, - 0.1 * PI, 1.1 * PI, 220, - 1.1 * PI, 1.1 * PI);
-	MarkConnection(R2LCut, 120, 220, cLRMS, 20);
-
-	/*
-	c1->cd();
-	cLRMS->GetXaxis()->SetTitle("Theta / Radian");
-	cLRMS->GetYaxis()->SetTitle("Phi / Radian");
-	cLRMS->GetXaxis()->SetTitleSize(0.05);
-	cLRMS->GetYaxis()->SetTitleSize(0.05);
-	cLRMS->GetXaxis()->SetLabelSize(0.05);
-	cLRMS->GetYaxis()->SetLabelSize(0.05);
-	cLRMS->Draw("colz");
-	c1->Print(pdfPath);
-	*/
-
-	/*
-	c1->cd();
-	cHRMS->GetXaxis()->SetTitle("Theta / Radian");
-	cHRMS->GetYaxis()->SetTitle("Phi / Radian");
-	cHRMS->GetXaxis()->SetTitleSize(0.05);
-	cHRMS->GetYaxis()->SetTitleSize(0.05);
-	cHRMS->GetXaxis()->SetLabelSize(0.05);
-	cHRMS->GetYaxis()->SetLabelSize(0.05);
-	cHRMS->Draw("colz");
-	c1->Print(pdfPath);
-	*/
-
-	AreaCut(R2HCut, cHRMS, 120, 220, 0.3, false, true);
-
-	/*
-	c1->cd();
-	cHRMS->GetXaxis()->SetTitle("Theta / Radian");
-	cHRMS->GetYaxis()->SetTitle("Phi / Radian");
-	cHRMS->GetXaxis()->SetTitleSize(0.05);
-	cHRMS->GetYaxis()->SetTitleSize(0.05);
-	cHRMS->GetXaxis()->SetLabelSize(0.05);
-	cHRMS->GetYaxis()->SetLabelSize(0.05);
-	cHRMS->Draw("colz");
-	c1->Print(pdfPath);
-	*/
-
-	TH2D* test1 = new TH2D("test1", "", 120, - 0.1 * PI, 1.1 * PI, 220, - 1.1 * PI, 1.1 * PI);
-	if (!UnionCut(cLRMS, cHRMS, R2LCut, 120, 220, 0.75, test1)) {
-		LogInfo << "Error in UnionCut()" << endl;
+	if (m_mapType == _MAPDOUBLE) {
+		m_pipe.Put("QSmooth", MapSmooth(m_pipe.Get("QFilled"), na));
 		return true;
 	}
+	// Smoothed in float, QSmooth gets a widened copy for the centroids
+	if (m_fs.empty())
+		m_fs.assign(Grid::Ext::size, 0);
+	MapGather<MapArray<float> > ex = Gather(MapArray<float>(&m_fq[0]), &m_bins.alias[0]);
+	EvalFrame<Grid::Ext>(&m_fs[0], ex, 2);
+	Eval<Grid::Ext>(&m_fs[0], Box<Grid::Ext, 2>(ex) / 25.f, 2);
+	TH2D* QSmooth = NewExtMap(na);
+	Eval<Grid::Ext>(QSmooth->GetArray(), MapArray<float>(&m_fs[0]));
+	m_pipe.Put("QSmooth", QSmooth);
+	return true;
+}
 
-	/*
-	c1->cd();
-	test1->GetXaxis()->SetTitle("Theta / Radian");
-	test1->GetYaxis()->SetTitle("Phi / Radian");
-	test1->GetXaxis()->SetTitleSize(0.05);
-	test1->GetYaxis()->SetTitleSize(0.05);
-	test1->GetXaxis()->SetLabelSize(0.05);
-	test1->GetYaxis()->SetLabelSize(0.05);
-	test1->Draw("colz");
-	c1->Print(pdfPath);
-	*/
-
-	MarkConnection(R2LCut, 120, 220, cLRMS, 20);
-
-	/*
-	c1->cd();
-	R2LCut->GetXaxis()->SetTitle("Theta / Radian");
-	R2LCut->GetYaxis()->SetTitle("Phi / Radian");
-	R2LCut->GetXaxis()->SetTitleSize(0.05);
-	R2LCut->GetYaxis()->SetTitleSize(0.05);
-	R2LCut->GetXaxis()->SetLabelSize(0.05);
-	R2LCut->GetYaxis()->SetLabelSize(0.05);
-	R2LCut->Draw("colz");
-	c1->Print(pdfPath);
-	*/
-
-	/*
-	c1->cd();
-	cLRMS->GetXaxis()->SetTitle("Theta / Radian");
-	cLRMS->GetYaxis()->SetTitle("Phi / Radian");
-	cLRMS->GetXaxis()->SetTitleSize(0.05);
-	cLRMS->GetYaxis()->SetTitleSize(0.05);
-	cLRMS->GetXaxis()->SetLabelSize(0.05);
-	cLRMS->GetYaxis()->SetLabelSize(0.05);
-	cLRMS->Draw("colz");
-	c1->Print(pdfPath);
-	*/
-
-	// MarkConnection(R2HCut, 120, 220, cHRMS, 20);
-	AreaCut(R2HCut, cHRMS, 120, 220, 0.3, true, false);
-	AreaCut(R2LCut, cLRMS, 120, 220, 0.3, true, true);
-
-	/*
-	c1->cd();
-	cLRMS->GetXaxis()->SetTitle("Theta / Radian");
-	cLRMS->GetYaxis()->SetTitle("Phi / Radian");
-	cLRMS->GetXaxis()->SetTitleSize(0.05);
-	cLRMS->GetYaxis()->SetTitleSize(0.05);
-	cLRMS->GetXaxis()->SetLabelSize(0.05);
-	cLRMS->GetYaxis()->SetLabelSize(0.05);
-	cLRMS->Draw("colz");
-	c1->Print(pdfPath);
-	*/
-
-	/*
-	c1->cd();
-	R2LCut->GetXaxis()->SetTitle("Theta / Radian");
-	R2LCut->GetYaxis()->SetTitle("Phi / Radian");
-	R2LCut->GetXaxis()->SetTitleSize(0.05);
-	R2LCut->GetYaxis()->SetTitleSize(0.05);
-	R2LCut->GetXaxis()->SetLabelSize(0.05);
-	R2LCut->GetYaxis()->SetLabelSize(0.05);
-	R2LCut->Draw("colz");
-	c1->Print(pdfPath);
-	*/
-
-	/*
-	c1->cd();
-	cHRMS->GetXaxis()->SetTitle("Theta / Radian");
-	cHRMS->GetYaxis()->SetTitle("Phi / Radian");
-	cHRMS->GetXaxis()->SetTitleSize(0.05);
-	cHRMS->GetYaxis()->SetTitleSize(0.05);
-	cHRMS->GetXaxis()->SetLabelSize(0.05);
-	cHRMS->GetYaxis()->SetLabelSize(0.05);
-	cHRMS->Draw("colz");
-	c1->Print(pdfPath);
-	*/
-
-	/*
-	c1->cd();
-	R2HCut->GetXaxis()->SetTitle("Theta / Radian");
-	R2HCut->GetYaxis()->SetTitle("Phi / Radian");
-	R2HCut->GetXaxis()->SetTitleSize(0.05);
-	R2HCut->GetYaxis()->SetTitleSize(0.05);
-	R2HCut->GetXaxis()->SetLabelSize(0.05);
-	R2HCut->GetYaxis()->SetLabelSize(0.05);
-	R2HCut->Draw("colz");
-	c1->Print(pdfPath);
-	*/
-
-	TH2D* totMark = Combine(cHRMS, cLRMS, 120, 220);
-
-	/*
-	c1->cd();
-	totMark->GetXaxis()->SetTitle("Theta / Radian");
-	totMark->GetYaxis()->SetTitle("Phi / Radian");
-	totMark->GetXaxis()->SetTitleSize(0.05);
-	totMark->GetYaxis()->SetTitleSize(0.05);
-	totMark->GetXaxis()->SetLabelSize(0.05);
-	totMark->GetYaxis()->SetLabelSize(0.05);
-	totMark->Draw("colz");
-	c1->Print(pdfPath);
-	*/
+bool FhtAna::StageCoarseRMS() {
+	TH2D* Q2Pool = m_pipe.Acquire("PoolQSmooth", Grid::Coarse::nx, Grid::ThetaMin(), Grid::ThetaMax(), Grid::Coarse::ny, Grid::PhiMin(), Grid::PhiMax());
+	Pool(m_pipe.Get("QSmooth"), Q2Pool);
+	TH2D* RMSPool = m_pipe.Acquire("RMSPool", Grid::Coarse::nx - 2, 0, PI, Grid::Coarse::ny - 2, -PI, PI);
+	RMSMap<Grid::Coarse, 1, 1>(Q2Pool, RMSPool);
+	PrintPage(RMSPool, "colz", "Theta / Radian", "Phi / Radian");
+	m_pipe.Release(Q2Pool);
+	m_pipe.Release(RMSPool);
+	return true;
+}
+
+bool FhtAna::StageRMS() {
+	// 7x7 charge sum of the sky bins, then the halo copies them like
+	// MapExtend()
+	TH2D* exRMS = NewExtMap("exRMS");
+	double* rms = exRMS->GetArray();
+	if (m_mapType == _MAPDOUBLE)
+		Eval<Grid::Ext>(rms, Box<Grid::Ext, 3>(MapRef(m_pipe.Get("QSmooth")->GetArray())), Grid::halo);
+	else
+		Eval<Grid::Ext>(rms, Box<Grid::Ext, 3>(MapArray<float>(&m_fs[0])), Grid::halo);
+	EvalFrame<Grid::Ext>(rms, Gather(MapRef(rms), &m_bins.aliasExt[0]), Grid::halo);
+	m_pipe.Put("exRMS", exRMS);
+	return true;
+}
 
+bool FhtAna::StageChargeSpectrum() {
 	auto Q = new TH1D("Charge", "", 500, 0, 5E6);
-	ChooseCut(exRMS, Q, 120, 220);
-
-	delete exRMS;
-	delete cLRMS;
-	delete cHRMS;
-	delete R2HCut;
-	delete R2LCut;
-
-	/*
-	c1->cd();
-	Q->Draw();
-	gPad->SetLogy();
-	c1->Print(pdfPath);
-	gPad->SetLogy(0);
-	*/
-
-	if (Q2Smooth == NULL) {
-		LogDebug << "Lower than the PE threshold, skip" << endl;
-		delete FhtDis;
-		delete FhtPhi;
-		delete Fht2D;
-		delete Q2D;
-		delete Q2Smooth;
+	ChooseCut(m_pipe.Get("exRMS"), Q);
+	PrintPage(Q, "", "Charge", "Count");
+	delete Q;
+	return true;
+}
+
+bool FhtAna::StageThreshold() {
+	if (OverBudget()) {
+		CoarseFallback();
 		return true;
 	}
+	TH2D* R2HCut = NewExtMap("R2HCut");
+	TH2D* R2LCut = NewExtMap("R2LCut");
+	Threshold(m_seg, m_pipe.Get("exRMS")->GetArray(), R2HCut, R2LCut);
+	m_pipe.Put("R2HCut", R2HCut);
+	m_pipe.Put("R2LCut", R2LCut);
+	return true;
+}
 
-	// PECut(Q2Smooth, 120, 220, 0.35);
+bool FhtAna::StageLabel() {
+	TH2D* cHRMS = NewExtMap("cHRMS");
+	TreeLabel(m_seg, m_seg.hLevel, m_pipe.Get("R2HCut"), cHRMS);
+	TH2D* cLRMS = NewExtMap("cLRMS");
+	TreeLabel(m_seg, m_seg.lLevel, m_pipe.Get("R2LCut"), cLRMS);
+	m_pipe.Put("cHRMS", cHRMS);
+	m_pipe.Put("cLRMS", cLRMS);
+	return true;
+}
 
-	// nCorrosion(Q2Smooth, 120, 220, 2);
+bool FhtAna::StageSegment() {
+	TH2D* totMark = NewExtMap("totMark");
+	Segment(m_seg, m_pipe.Get("R2HCut"), m_pipe.Get("R2LCut"), m_pipe.Get("cHRMS"), m_pipe.Get("cLRMS"), totMark, true);
+	m_pipe.Put("totMark", totMark);
+	return true;
+}
 
-	// int nC = MarkConnection(Q2Smooth, 120, 220, conn, 20);
+void FhtAna::Threshold(SegState& s, const double* rms, TH2D* high, TH2D* low) {
+	// One max-tree of the RMS map answers both cuts and the re-threshold
+	// of the large high areas in Segment()
+	double peak = MapKernel<Grid::Ext>::Max(rms);
+	s.hLevel = s.p.hFrac * peak;
+	s.lLevel = s.p.lFrac * peak;
+	LogSegDebug << "Threshold: " << s.hLevel << "\t" << s.lLevel << endl;
+	s.tree.Build(rms, s.lLevel);
+	LogSegDebug << "Max-tree bins: " << s.tree.size() << endl;
+	double* h = high->GetArray();
+	double* l = low->GetArray();
+	for (int k = 0; k < s.tree.size(); k ++) {
+		l[s.tree.Bin(k)] = s.tree.Value(k);
+		if (s.tree.Value(k) > s.hLevel)
+			h[s.tree.Bin(k)] = s.tree.Value(k);
+	}
+}
 
-	// nC = AreaCut(Q2Smooth, conn, 120, 220, 0.5);
+void FhtAna::Segment(SegState& s, TH2D* R2HCut, TH2D* R2LCut, TH2D* cHRMS, TH2D* cLRMS, TH2D* totMark, bool bounded) {
+	// Bounded by the time budget, the refinements stop at the first
+	// overrun and the labels so far are combined as they are
+	bool cut = bounded && OverBudget();
+	if (!cut)
+		TreeAreaCut(s, R2HCut, cHRMS);
+	cut = cut || (bounded && OverBudget());
+	if (!cut) {
+		// Split the low areas holding several high areas
+		int nLine = Watershed(s, cLRMS, cHRMS, R2LCut);
+		LogSegDebug << "Watershed line bins: " << nLine << endl;
+		MarkConnection(R2LCut, Grid::nx, Grid::ny, cLRMS, s.p.minConnect);
+	}
+	cut = cut || (bounded && OverBudget());
+	if (!cut) {
+		AreaCut(R2HCut, cHRMS, Grid::nx, Grid::ny, s.p, true, false);
+		AreaCut(R2LCut, cLRMS, Grid::nx, Grid::ny, s.p, true, true);
+	}
+	if (cut)
+		m_degraded |= _DEGSEGMENT;
+	Combine(cHRMS, cLRMS, totMark, s.p.minCombine);
+}
 
-	long int* mass = new long int[4];
-	// TH2D* testM = new TH2D("testMass", "", 1000, 0, 5000, 1000, -400, 400);
-	mass = GetCenterPos(Q2Smooth, totMark, 120, 220);
-	// mass = GetMassPos(Q2Smooth, totMark, 120, 220, testM);
-	
-	delete totMark;
+bool FhtAna::StageCenters() {
+	TH2D* totMark = m_pipe.Get("totMark");
+	GetCenterPos(m_pipe.Get("QSmooth"), totMark, Grid::nx, Grid::ny, m_centers);
+	if (m_precisionCheck) {
+		std::vector<double>& mark = m_refRun ? m_refMark : m_lowMark;
+		mark.assign(totMark->GetArray(), totMark->GetArray() + Grid::Ext::size);
+	}
+	return true;
+}
 
-	double unit = PI / 100;
-	LogInfo << "==================================================" << endl;
+bool FhtAna::StageGraphCenters() {
+	if (m_skyGrid == "HealPix")
+		ReconGraph(m_skyGraph, m_pmtNode, 4, 2, 3, m_seg.p, m_seg.p.minLabel, m_centers);
+	else
+		ReconGraph(m_skyGraph, m_pmtNode, 0, 1, 1, m_seg.p, m_graphMinSize, m_centers);
+	return true;
+}
 
-	TVector3 rInci, rDir;
-	double rDis, rAng, rTi;
-	FindTrk(rInci, rDir, rDis, rAng, rTi, Fht2D, mass);
-	LogInfo << "PreRec Inci.Theta: " << rInci.Theta() << "\tPhi: " << rInci.Phi() << endl;
-	LogInfo << "PreRec Dir.Theta: " << rDir.Theta() << "\tPhi: " << rDir.Phi() << endl;
+bool FhtAna::StageSweep() {
+	// Every configuration segments the same RMS map, the stages upstream
+	// run once for all of them
+	const double* rms = m_pipe.Get("exRMS")->GetArray();
+	TH2D* qSmooth = m_pipe.Get("QSmooth");
+	TH2D* fht = m_pipe.Get("Fht2D");
+	int n = m_sweep.size();
+	int nThread = m_sweepPool.size();
+	m_sweepPool.Run([&](int t) {
+		for (int k = t; k < n; k += nThread)
+			SweepConfig(m_sweep[k], rms, qSmooth, fht);
+	});
+	m_sweepDone = true;
+	return true;
+}
 
-	LogInfo << "==================================================" << endl;
+void FhtAna::SweepConfig(SegState& s, const double* rms, TH2D* qSmooth, TH2D* fht) {
+	// Threshold to track on the maps of the configuration, the shared maps
+	// and the PMT table are only read. The configurations run side by
+	// side, their debug lines would interleave and are left out.
+	t_quiet = true;
+	for (size_t i = 0; i < s.maps.size(); i ++) {
+		double* a = s.maps[i]->GetArray();
+		std::fill(a, a + Grid::Ext::size, 0.);
+	}
+	TH2D* R2HCut = s.maps[0];
+	TH2D* R2LCut = s.maps[1];
+	TH2D* cHRMS = s.maps[2];
+	TH2D* cLRMS = s.maps[3];
+	TH2D* totMark = s.maps[4];
+	Threshold(s, rms, R2HCut, R2LCut);
+	TreeLabel(s, s.hLevel, R2HCut, cHRMS);
+	TreeLabel(s, s.lLevel, R2LCut, cLRMS);
+	Segment(s, R2HCut, R2LCut, cHRMS, cLRMS, totMark, false);
+	SegResult& r = s.res;
+	r = SegResult();
+	GetCenterPos(qSmooth, totMark, Grid::nx, Grid::ny, r.centers);
+	FindTrk(r.inci, r.dir, r.dis, r.ang, r.ti, fht, r.centers);
+	r.track = true;
+	t_quiet = false;
+}
 
-	TVector3 chargeCenter = GetChargeCenter();
+bool FhtAna::StageTrack() {
+	LogDebug << "==================================================" << endl;
+	if (m_centers.size() > 2 && OverBudget()) {
+		// One hypothesis through the two brightest centroids, the others
+		// stay in the record
+		std::vector<Centroid> two(m_centers);
+		std::partial_sort(two.begin(), two.begin() + 2, two.end(), [](const Centroid& a, const Centroid& b) {
+			return a.q > b.q;
+		});
+		two.resize(2);
+		FindTrk(m_rInci, m_rDir, m_rDis, m_rAng, m_rTi, m_pipe.Get("Fht2D"), two);
+		m_degraded |= _DEGTRACK;
+	}
+	else
+		FindTrk(m_rInci, m_rDir, m_rDis, m_rAng, m_rTi, m_pipe.Get("Fht2D"), m_centers);
+	LogDebug << "==================================================" << endl;
+	m_trackDone = true;
+	return true;
+}
 
-	simevent = dynamic_cast<JM::SimEvent*>(simheader->event());
-	if (not simevent) {
-		LogInfo << "No sim event" << endl;
+bool FhtAna::StageTruth() {
+	if (!m_truth.found) {
+		LogDebug << "No sim event" << endl;
 		return true;
 	}
-	LogInfo << "SimEventGot" << std::endl;
-	nSimTrks = simevent->getTracksVec().size();
-	LogInfo << "Retrieving tracks data" << std::endl;
-	short NumCrossCd = 0;
-	LogInfo << "Number of Trks: " << nSimTrks << endl;
-	double lX = 50000, lY = 50000, lZ = 50000;
-
-	TH2D* exp2D = new TH2D("FhtExp2D", "", 100, 0, PI, 200, -PI, PI);
-	TH2D* pos = new TH2D("pos", "", 500, - 25000, 25000, 500, - 25000, 25000);
-	TH2D* LiDiff = new TH2D("LiDiff", "", 500, 0, 10000, 200, - 100, 100);
-	TH2D* QDiff = new TH2D("QDiff", "", 50, 0, 50, 200, - 100, 100);
-	TH2D* TDiff = new TH2D("TDiff", "", 100, 0, 100, 200, - 100, 100);
-
-	for (short i = 1; i <= 1; i ++) {
-		JM::SimTrack* strk = simevent->findTrackByTrkID(i);
-		LogInfo << "======================================== ID: " << i << endl;
-		// if (lX == strk->getInitX() && lY == strk->getInitY() && lZ == strk->getInitZ())
-		// 	continue;
-		lX = strk->getInitX();
-		lY = strk->getInitY();
-		lZ = strk->getInitZ();
-		TVector3 Inci(strk->getInitX(), strk->getInitY(), strk->getInitZ());
-		TVector3 Dir(strk->getInitPx(), strk->getInitPy(), strk->getInitPz());
-		TVector3 Exit(strk->getExitX(), strk->getExitY(), strk->getExitZ());
-		LogInfo << "Inci Pos: " << Inci << endl;
-		if (IfCrossCd(Inci, Dir, m_LSRadius)) {
-			NumCrossCd ++;
-			TVector3 LSInci = InciOnLS(Inci, Dir, m_LSRadius);
-			// IfCrossCd(LSInci, Dir, m_LSRadius);
-			TVector3 LSExit = Exit;
-			if (Exit.Mag() > m_LSRadius) {
-				TVector3 antiDir = - Dir;
-				LSExit = InciOnLS(Exit, antiDir, m_LSRadius);
-			}
-			TVector3 dir = Dir.Unit();
-			of << LSInci.Theta() << "\t" << LSInci.Phi() << "\t" << dir.Theta() << "\t" << dir.Phi() << endl;
-			LogInfo << "Inci: " << LSInci << endl
-					<< "Exit: " << LSExit << endl
-					<< "Length: " << (LSInci - LSExit).Mag() << endl
-					<< "Edep: " << strk->getEdep() << endl
-					<< "QEdep: " << strk->getQEdep() << endl;
-			LogInfo << "Inci.Theta: " << LSInci.Theta() << "\tPhi: " << LSInci.Phi() << "\tMag: " << LSInci.Mag() << endl;
-			LogInfo << "Exit.Theta: " << LSExit.Theta() << "\tPhi: " << Exit.Phi() << endl;
-			LogInfo << "Dir.Theta: " << dir.Theta() << "\tPhi: " << dir.Phi() << endl;
-
-			int nPMTs = m_ptab.size();
-			Dir = Dir.Unit();
-			for (int i = 0; i < nPMTs; i ++) {
-				if (m_ptab[i].q < 1 || m_ptab[i].fht > 90)
-					continue;
-
-				double nLS = 1.485;
-				double cLight = 299.;
-				double vMuon = 299.;
-				double nW = 1.34;
-				double ti = 0;
-
-				double tan = TMath::Sqrt(nW * nW - 1);
-
-				TVector3 perp = Inci + Dir * (m_ptab[i].pos - Inci) * Dir;
-
-				TVector3 liSource = perp - (m_ptab[i].pos - perp).Mag() / tan * Dir;
-
-				TVector3 liDir = m_ptab[i].pos - liSource;
-
-				double dis = TMath::Sqrt(TMath::Power(m_ptab[i].pos.Mag(), 2) - TMath::Power(m_ptab[i].pos * liDir.Unit(), 2));
-
-				double expFht = ti + (liSource - Inci) * Dir / vMuon + (m_ptab[i].pos - liSource).Mag() * nW / cLight;
-
-				int binx = m_ptab[i].pos.Theta() / PI * 100 + 1;
-				int biny = m_ptab[i].pos.Phi() / PI * 100 + 101;
-				exp2D->SetBinContent(binx, biny, TMath::Abs(expFht - m_ptab[i].fht));
-				FhtDiff->Fill(expFht - m_ptab[i].fht);
-
-				if (ti + (liSource - Inci) * Dir / vMuon < 0)
-					continue;
-				binx = TMath::Sqrt(TMath::Power(liSource.X(), 2) + TMath::Power(liSource.Y(), 2)) / 100 + 251;
-				binx = liSource.X() / 100 + 251;
-				biny = liSource.Z() / 100 + 251;
-				pos->SetBinContent(binx, biny, ti + (liSource - Inci) * Dir / vMuon);
-
-				binx = TMath::Sqrt(TMath::Power(m_ptab[i].pos.X(), 2) + TMath::Power(m_ptab[i].pos.Y(), 2)) / 100 + 251;
-				binx = m_ptab[i].pos.X() / 100 + 251;
-				biny = m_ptab[i].pos.Z() / 100 + 251;
-				pos->SetBinContent(binx, biny, TMath::Abs(expFht - m_ptab[i].fht));
-
-				LiDiff->Fill((m_ptab[i].pos - liSource).Mag(), expFht - m_ptab[i].fht);
-				QDiff->Fill(m_ptab[i].q, expFht - m_ptab[i].fht);
-				TDiff->Fill(m_ptab[i].fht, expFht - m_ptab[i].fht);
-			}
+	nSimTrks = m_truth.nTrk;
+	LogDebug << "Number of Trks: " << nSimTrks << endl;
+	Vec3 Inci = m_truth.inci;
+	Vec3 Dir = m_truth.dir;
+	Vec3 Exit = m_truth.exit;
+	LogDebug << "Inci Pos: " << Inci << endl;
+	if (IfCrossCd(Inci, Dir, m_LSRadius)) {
+		Vec3 LSInci = InciOnLS(Inci, Dir, m_LSRadius);
+		Vec3 LSExit = Exit;
+		if (Exit.Mag() > m_LSRadius) {
+			Vec3 antiDir = - Dir;
+			LSExit = InciOnLS(Exit, antiDir, m_LSRadius);
 		}
+		Vec3 dir = Dir.Unit();
+		EventTxt() << LSInci.Theta() << "\t" << LSInci.Phi() << "\t" << dir.Theta() << "\t" << dir.Phi() << endl;
+		LogDebug << "Inci: " << LSInci << endl
+				<< "Exit: " << LSExit << endl
+				<< "Length: " << (LSInci - LSExit).Mag() << endl
+				<< "Edep: " << m_truth.edep << endl
+				<< "QEdep: " << m_truth.qedep << endl;
+		LogDebug << "Inci.Theta: " << LSInci.Theta() << "\tPhi: " << LSInci.Phi() << "\tMag: " << LSInci.Mag() << endl;
+		LogDebug << "Exit.Theta: " << LSExit.Theta() << "\tPhi: " << Exit.Phi() << endl;
+		LogDebug << "Dir.Theta: " << dir.Theta() << "\tPhi: " << dir.Phi() << endl;
+		if (m_validation)
+			FillValidation(Inci, dir);
+	}
+	PrintPage(m_pipe.Get("Fht2D"), "colz", "Theta / Radian", "Phi / Radian");
+	return true;
+}
+
+void FhtAna::FillValidation(const Vec3& Inci, const Vec3& Dir) {
+	// First hit time expected from the Cherenkov light of the true track.
+	// Only the worker (or the event loop when not pipelined) gets here,
+	// finalize() reads the histograms after it has stopped.
+	double cLight = 299.;
+	double vMuon = 299.;
+	double nW = 1.34;
+	double ti = 0;
+	double tan = TMath::Sqrt(nW * nW - 1);
+	int nPMTs = m_ptab.size();
+	for (int i = 0; i < nPMTs; i ++) {
+		if (m_ptab[i].q < 1 || m_ptab[i].fht > 90)
+			continue;
+		const Vec3& pmt = m_ptab[i].pos;
+		Vec3 perp = Inci + Dir * (pmt - Inci) * Dir;
+		Vec3 liSource = perp - (pmt - perp).Mag() / tan * Dir;
+		double tSource = ti + (liSource - Inci) * Dir / vMuon;
+		double expFht = tSource + (pmt - liSource).Mag() * nW / cLight;
+		double diff = expFht - m_ptab[i].fht;
+
+		m_vExp2D->Fill(pmt.Theta(), pmt.Phi(), TMath::Abs(diff));
+		m_vFhtDiff->Fill(diff);
+		if (tSource < 0)
+			continue;
+		m_vSource->Fill(liSource.X(), liSource.Z(), tSource);
+		m_vPos->Fill(pmt.X(), pmt.Z(), TMath::Abs(diff));
+		m_vLiDiff->Fill((pmt - liSource).Mag(), diff);
+		m_vQDiff->Fill(m_ptab[i].q, diff);
+		m_vTDiff->Fill(m_ptab[i].fht, diff);
 	}
-	c1->cd();
-	FhtDiff->SetTitle("");
-	FhtDiff->GetXaxis()->SetTitleSize(0.05);
-	FhtDiff->GetYaxis()->SetTitleSize(0.05);
-	FhtDiff->GetXaxis()->SetLabelSize(0.05);
-	FhtDiff->GetYaxis()->SetLabelSize(0.05);
-	FhtDiff->GetXaxis()->SetTitle("(exp - truth) / ns");
-	FhtDiff->GetYaxis()->SetTitle("Count");
-	FhtDiff->Draw();
-	c1->Print(pdfPath);
-
-	c1->cd();
-	exp2D->SetTitle("");
-	exp2D->GetXaxis()->SetTitleSize(0.05);
-	exp2D->GetYaxis()->SetTitleSize(0.05);
-	exp2D->GetXaxis()->SetLabelSize(0.05);
-	exp2D->GetYaxis()->SetLabelSize(0.05);
-	exp2D->GetXaxis()->SetTitle("Theta / Radian");
-	exp2D->GetYaxis()->SetTitle("Phi / Radian");
-	exp2D->Draw("colz");
-	c1->Print(pdfPath);
-
-	c1->cd();
-	pos->SetTitle("");
-	pos->GetXaxis()->SetTitleSize(0.05);
-	pos->GetYaxis()->SetTitleSize(0.05);
-	pos->GetXaxis()->SetLabelSize(0.02);
-	pos->GetYaxis()->SetLabelSize(0.05);
-	pos->GetXaxis()->SetTitle("sqrt(x^{2} + y^{2}) / mm");
-	pos->GetYaxis()->SetTitle("z / mm");
-	pos->Draw("colz");
-	c1->Print(pdfPath);
-
-	c1->cd();
-	LiDiff->SetTitle("");
-	LiDiff->GetXaxis()->SetTitleSize(0.05);
-	LiDiff->GetYaxis()->SetTitleSize(0.05);
-	LiDiff->GetXaxis()->SetLabelSize(0.05);
-	LiDiff->GetYaxis()->SetLabelSize(0.05);
-	LiDiff->GetXaxis()->SetTitle("Light route / mm");
-	LiDiff->GetYaxis()->SetTitle("(exp - truth) / ns");
-	LiDiff->Draw("colz");
-	c1->Print(pdfPath);
-
-	c1->cd();
-	TDiff->SetTitle("");
-	TDiff->GetXaxis()->SetTitleSize(0.05);
-	TDiff->GetYaxis()->SetTitleSize(0.05);
-	TDiff->GetXaxis()->SetLabelSize(0.05);
-	TDiff->GetYaxis()->SetLabelSize(0.05);
-	TDiff->GetXaxis()->SetTitle("Light route / mm");
-	TDiff->GetYaxis()->SetTitle("(exp - truth) / ns");
-	TDiff->Draw("colz");
-	c1->Print(pdfPath);
-
-	// c1->cd();
-	// QDiff->SetTitle("");
-	// QDiff->GetXaxis()->SetTitleSize(0.05);
-	// QDiff->GetYaxis()->SetTitleSize(0.05);
-	// QDiff->GetXaxis()->SetLabelSize(0.05);
-	// QDiff->GetYaxis()->SetLabelSize(0.05);
-	// QDiff->GetXaxis()->SetTitle("nPE / p.e.");
-	// QDiff->GetYaxis()->SetTitle("(exp - truth) / ns");
-	// QDiff->Draw("colz");
-	// c1->Print(pdfPath);
-
-	c1->cd();
-	Fht2D->SetTitle("");
-	Fht2D->GetXaxis()->SetTitleSize(0.05);
-	Fht2D->GetYaxis()->SetTitleSize(0.05);
-	Fht2D->GetXaxis()->SetLabelSize(0.05);
-	Fht2D->GetYaxis()->SetLabelSize(0.05);
-	Fht2D->GetXaxis()->SetTitle("Theta / Radian");
-	Fht2D->GetYaxis()->SetTitle("Phi / Radian");
-	Fht2D->Draw("colz");
-	c1->Print(pdfPath);
-
-	// c1->cd();
-	c1->Print(pdfPath + "]");
-
-	of.close();
+}
 
-	delete FhtDis;
-	delete FhtPhi;
-	delete Fht2D;
-	delete Q2D;
-	delete Q2Smooth;
-	delete FhtDiff;
-	delete pos;
-	delete LiDiff;
-	delete QDiff;
-	delete c1;
-	// delete testM;
-	// outFile.close();
-	// PhiOut.close();
-	// label.close();
-	// trks.close();
-	LogDebug << "Executed" << endl;
+bool FhtAna::initSnapshot() {
+	if (m_snapMaps.empty())
+		return true;
+	// In batch mode the maps go to the shard
+	m_path = outPath;
+	if (m_snapFile.empty())
+		m_snapFile = (m_path + m_name + "_" + m_turn + "_snap.bin").Data();
+	if (!m_batch && !m_snap.Open(m_snapFile)) {
+		LogError << "Cannot open the snapshot file: " << m_snapFile << std::endl;
+		return false;
+	}
+	// The PMT density is fixed, it goes in once as event -1
+	if (std::find(m_snapMaps.begin(), m_snapMaps.end(), "nPMT") != m_snapMaps.end()) {
+		MapRecord r;
+		r.event = -1;
+		r.stage = "initialize";
+		r.name = "nPMT";
+		r.nx = Grid::nTheta;
+		r.ny = Grid::nPhi;
+		r.xmin = 0;
+		r.xmax = PI;
+		r.ymin = -PI;
+		r.ymax = PI;
+		r.bins.assign(m_nPmtMap->GetArray(), m_nPmtMap->GetArray() + Grid::Base::size);
+		WriteMap(r);
+	}
+	m_pipe.SetWatch([this](const std::string& stage, const std::string& name, TH2D* h) {
+		Snapshot(stage, name, h);
+	});
+	return true;
+}
+
+void FhtAna::Snapshot(const std::string& stage, const std::string& name, TH2D* h) {
+	// A map is taken after every stage reading or writing it, so the in
+	// place steps of the segmentation each leave a record
+	if (!m_snapThis || m_refRun)
+		return;
+	if (std::find(m_snapMaps.begin(), m_snapMaps.end(), name) == m_snapMaps.end())
+		return;
+	// Kept with the event until it is committed
+	m_snapBuf.push_back(MapRecord());
+	MapRecord& r = m_snapBuf.back();
+	TAxis* x = h->GetXaxis();
+	TAxis* y = h->GetYaxis();
+	r.event = m_evtId;
+	r.stage = stage;
+	r.name = name;
+	r.nx = x->GetNbins();
+	r.ny = y->GetNbins();
+	r.xmin = x->GetXmin();
+	r.xmax = x->GetXmax();
+	r.ymin = y->GetXmin();
+	r.ymax = y->GetXmax();
+	r.bins.assign(h->GetArray(), h->GetArray() + (r.nx + 2) * (r.ny + 2));
+}
+
+void FhtAna::WriteMap(MapRecord& r) {
+	if (!m_mapTree) {
+		m_snap.Write(r);
+		return;
+	}
+	std::swap(m_mapRow, r);
+	m_mapTree->Fill();
+	std::swap(m_mapRow, r);
+}
+
+bool FhtAna::initValidation() {
+	// Booked once for the job, the per-event PMT loop only fills them
+	m_vFhtDiff = new TH1F("FhtDiff", "", 2000, -100, 100);
+	m_vExp2D = new TProfile2D("FhtExp2D", "", Grid::nTheta, 0, PI, Grid::nPhi, -PI, PI);
+	m_vSource = new TProfile2D("LightSource", "", 500, - 25000, 25000, 500, - 25000, 25000);
+	m_vPos = new TProfile2D("PmtDiff", "", 500, - 25000, 25000, 500, - 25000, 25000);
+	m_vLiDiff = new TH2D("LiDiff", "", 500, 0, 10000, 200, - 100, 100);
+	m_vQDiff = new TH2D("QDiff", "", 50, 0, 50, 200, - 100, 100);
+	m_vTDiff = new TH2D("TDiff", "", 100, 0, 100, 200, - 100, 100);
+	TH1* h[] = {m_vFhtDiff, m_vExp2D, m_vSource, m_vPos, m_vLiDiff, m_vQDiff, m_vTDiff};
+	m_validHists.assign(h, h + sizeof(h) / sizeof(h[0]));
+	SniperPtr<RootWriter> rw(getParent(), "RootWriter");
+	m_validAttached = rw.valid() && !m_batch;
+	for (size_t i = 0; i < m_validHists.size(); i ++) {
+		m_validHists[i]->SetDirectory(0);
+		if (m_validAttached)
+			rw->attach("FhtAna/valid", m_validHists[i]);
+	}
+	// Otherwise they go to the shard or to one PDF at finalize()
+	return true;
+}
+
+void FhtAna::WriteValidation() {
+	if (m_validAttached)
+		return;
+	if (m_shard) {
+		m_shard->cd();
+		for (size_t i = 0; i < m_validHists.size(); i ++)
+			m_validHists[i]->Write();
+	}
+	else {
+		OpenPdf(m_path + "pdf/" + m_name + "_" + m_turn + "_valid.pdf");
+		PrintPage(m_vFhtDiff, "", "(exp - truth) / ns", "Count");
+		PrintPage(m_vExp2D, "colz", "Theta / Radian", "Phi / Radian");
+		PrintPage(m_vSource, "colz", "x / mm", "z / mm");
+		PrintPage(m_vPos, "colz", "x / mm", "z / mm");
+		PrintPage(m_vLiDiff, "colz", "Light route / mm", "(exp - truth) / ns");
+		PrintPage(m_vQDiff, "colz", "Charge / PE", "(exp - truth) / ns");
+		PrintPage(m_vTDiff, "colz", "FHT / ns", "(exp - truth) / ns");
+		CloseEventFiles();
+	}
+	for (size_t i = 0; i < m_validHists.size(); i ++)
+		delete m_validHists[i];
+	m_validHists.clear();
+}
+
+// Runs on the event loop thread, the navigator moves on with the next
+// event before a pipelined worker gets to StageTruth()
+bool FhtAna::LoadTruth(SimTruth& truth) {
+	JM::SimEvent* simevent = 0;
+	JM::EvtNavigator* nav =m_buf->curEvt();
+	std::vector<std::string>& paths = nav->getPath();
+	JM::SimHeader* simheader = 0;
+	for (size_t i = 0; i < paths.size(); ++i) {
+		const std::string& path = paths[i];
+		if (path == "/Event/SimOrig") {
+			simheader = static_cast<JM::SimHeader*>(nav->getHeader("/Event/SimOrig"));
+			LogDebug << "SimHeader (/Event/SimOrig): " << simheader << endl;
+			if (simheader)
+				break;
+		}
+	}
+	// Real data, nothing to look for in the following events
+	if (not simheader) {
+		LogInfo << "No SimHeader, truth and validation are skipped" << endl;
+		m_noSim = true;
+		return false;
+	}
+	simevent = dynamic_cast<JM::SimEvent*>(simheader->event());
+	if (not simevent)
+		return false;
+	LogDebug << "SimEventGot" << std::endl;
+	truth.nTrk = simevent->getTracksVec().size();
+	JM::SimTrack* strk = simevent->findTrackByTrkID(1);
+	if (not strk)
+		return false;
+	truth.inci = Vec3(strk->getInitX(), strk->getInitY(), strk->getInitZ());
+	truth.dir = Vec3(strk->getInitPx(), strk->getInitPy(), strk->getInitPz());
+	truth.exit = Vec3(strk->getExitX(), strk->getExitY(), strk->getExitZ());
+	truth.edep = strk->getEdep();
+	truth.qedep = strk->getQEdep();
+	truth.found = true;
 	return true;
 }
 
@@ -690,6 +1551,240 @@ bool FhtAna::initGeomSvc() {
 	return true;
 }
 
+bool FhtAna::initPmtIndex() {
+	// About four PMTs a cell
+	unsigned int n = m_wpgeom->getPmtNum();
+	std::vector<Vec3> dir(n);
+	for (unsigned int pid = 0; pid < n; pid ++) {
+		PmtGeom* pmt = m_wpgeom->getPmt(Identifier(WpID::id(pid, 0)));
+		if (!pmt) {
+			LogError << "Wrong PMT ID" << std::endl;
+			return false;
+		}
+		dir[pid] = Vec3::From(pmt->getCenter()).Unit();
+	}
+	m_pmtIndex.Build(dir, 2 * sqrt(4 * PI / (n ? n : 1)));
+	LogDebug << "PMT index, cells: " << m_pmtIndex.nCell() << std::endl;
+	return true;
+}
+
+bool FhtAna::initSkyGraph() {
+	if (m_skyGrid == "ThetaPhi")
+		return true;
+	if (m_skyGrid != "HealPix" && m_skyGrid != "PmtGraph") {
+		LogError << "Unknown SkyGrid: " << m_skyGrid << std::endl;
+		return false;
+	}
+	int n = m_pmtIndex.size();
+	m_pmtNode.resize(n);
+	if (m_skyGrid == "HealPix") {
+		HealPix hp(m_nside);
+		hp.BuildGraph(m_skyGraph, 8);
+		for (int pid = 0; pid < n; pid ++)
+			m_pmtNode[pid] = hp.Pixel(m_pmtIndex.Dir(pid));
+		LogInfo << "HealPix grid, Nside: " << m_nside << "\tnPix: " << hp.nPix() << std::endl;
+		return true;
+	}
+
+	// One node per PMT, linked to the PMTs within PmtGraphRadius or, when
+	// the radius is not set, to its PmtGraphK nearest neighbours
+	m_skyGraph.node.resize(n);
+	m_skyGraph.offset.assign(1, 0);
+	m_skyGraph.adj.clear();
+	std::vector<std::pair<double, int> > cand;
+	std::vector<int> near;
+	for (int i = 0; i < n; i ++) {
+		const Vec3& u = m_pmtIndex.Dir(i);
+		m_skyGraph.node[i] = u;
+		m_pmtNode[i] = i;
+		if (m_graphRadius > 0)
+			m_pmtIndex.Radius(u, m_graphRadius, near);
+		else
+			m_pmtIndex.Nearest(u, m_graphK + 1, near);
+		cand.clear();
+		for (size_t m = 0; m < near.size(); m ++)
+			if (near[m] != i)
+				cand.push_back(std::make_pair(- (u * m_pmtIndex.Dir(near[m])), near[m]));
+		int k = cand.size();
+		if (m_graphRadius <= 0 && m_graphK < k)
+			k = m_graphK;
+		std::partial_sort(cand.begin(), cand.begin() + k, cand.end());
+		for (int j = 0; j < k; j ++)
+			m_skyGraph.adj.push_back(cand[j].second);
+		m_skyGraph.offset.push_back(m_skyGraph.adj.size());
+	}
+	// Nearest neighbours are not mutual, GraphLabel() needs both ways
+	m_skyGraph.Symmetrize();
+	LogInfo << "PMT graph, nNode: " << n << "\tnEdge: " << m_skyGraph.adj.size() << std::endl;
+	return true;
+}
+
+bool FhtAna::initBinTables() {
+	unsigned int n = m_wpgeom->getPmtNum();
+	std::vector<Vec3> pos(n);
+	for (unsigned int pid = 0; pid < n; pid ++) {
+		PmtGeom* pmt = m_wpgeom->getPmt(Identifier(WpID::id(pid, 0)));
+		if (!pmt) {
+			LogError << "Wrong PMT ID" << std::endl;
+			return false;
+		}
+		pos[pid] = Vec3::From(pmt->getCenter());
+	}
+
+	// Identifier lookup for the ingestion
+	m_idPid.clear();
+	m_pidUsed.resize(n);
+	for (unsigned int pid = 0; pid < n; pid ++) {
+		Identifier id = Identifier(WpID::id(pid, 0));
+		m_idPid[id.getValue()] = pid;
+		m_pidUsed[pid] = WpID::is20inch(id) && m_20inchusedflag;
+	}
+	m_hitPid.reserve(n);
+	m_hitQ.reserve(n);
+	m_hitFht.reserve(n);
+
+	// Same axis lookup as TH2D::Fill, and the truncated bin the FHT map used
+	TH2D base("BinTable", "", Grid::nTheta, 0, PI, Grid::nPhi, -PI, PI);
+	double unit = Grid::Unit();
+	m_bins.qBin.resize(n);
+	m_bins.fhtBin.resize(n);
+	std::vector<int> count(Grid::Base::size, 0);
+	for (unsigned int pid = 0; pid < n; pid ++) {
+		double the = pos[pid].Theta();
+		double phi = pos[pid].Phi();
+		m_bins.qBin[pid] = base.GetBin(base.GetXaxis()->FindBin(the), base.GetYaxis()->FindBin(phi));
+		m_bins.fhtBin[pid] = Grid::Base::Bin((int)(the / unit), (int)((phi + TMath::Pi()) / unit));
+		count[m_bins.qBin[pid]] ++;
+	}
+
+	// Coarse cells and directions for FastVeto(), m_ptab is the worker's
+	const int nCoarseTheta = Grid::nTheta / Grid::pool;
+	m_bins.coarseCell.resize(n);
+	m_pmtDir.resize(n);
+	for (unsigned int pid = 0; pid < n; pid ++) {
+		int i = m_bins.qBin[pid] % Grid::Base::stride;
+		int j = m_bins.qBin[pid] / Grid::Base::stride;
+		i = i < 1 ? 1 : (i > Grid::nTheta ? Grid::nTheta : i);
+		j = j < 1 ? 1 : (j > Grid::nPhi ? Grid::nPhi : j);
+		m_bins.coarseCell[pid] = (i - 1) / Grid::pool + nCoarseTheta * ((j - 1) / Grid::pool);
+		m_pmtDir[pid] = pos[pid].Unit();
+	}
+	m_coarseQ.assign(nCoarseTheta * (Grid::nPhi / Grid::pool), 0);
+	m_coarseU.assign(m_coarseQ.size(), Vec3());
+	m_early.reserve(n);
+
+	m_bins.offset.assign(Grid::Base::size + 1, 0);
+	for (int b = 0; b < Grid::Base::size; b ++)
+		m_bins.offset[b + 1] = m_bins.offset[b] + count[b];
+	m_bins.pmt.resize(n);
+	std::vector<int> fill(m_bins.offset.begin(), m_bins.offset.end() - 1);
+	for (unsigned int pid = 0; pid < n; pid ++)
+		m_bins.pmt[fill[m_bins.qBin[pid]] ++] = pid;
+
+	int maxCount = *std::max_element(count.begin(), count.end());
+	m_bins.norm.assign(Grid::Base::size, 0);
+	for (int b = 0; b < Grid::Base::size; b ++)
+		if (count[b])
+			m_bins.norm[b] = (double)maxCount / count[b];
+	m_nPmtMap = new TH2D("nPMT", "", Grid::nTheta, 0, PI, Grid::nPhi, -PI, PI);
+	m_nPmtMap->SetDirectory(0);
+	for (int b = 0; b < Grid::Base::size; b ++)
+		m_nPmtMap->GetArray()[b] = (double)count[b] / maxCount;
+
+	// Pass bin numbers through the extension to learn which base bin every
+	// extended bin copies
+	std::vector<double> id(Grid::Base::size);
+	for (int b = 0; b < Grid::Base::size; b ++)
+		id[b] = b;
+	std::vector<double> ext(Grid::Ext::size, -1);
+	MapKernel<Grid::Base>::Extend<Grid::halo>(&id[0], &ext[0]);
+	m_bins.alias.resize(Grid::Ext::size);
+	m_bins.aliasExt.assign(Grid::Ext::size, -1);
+	for (int e = 0; e < Grid::Ext::size; e ++) {
+		int b = m_bins.alias[e] = (int)ext[e];
+		if (b >= 0)
+			m_bins.aliasExt[e] = Grid::Ext::Bin(b % Grid::Base::stride + Grid::halo, b / Grid::Base::stride + Grid::halo);
+	}
+
+	// Extended map bins holding each PMT, its own bin first and then the
+	// copies in the halo, in the order GetCenterPos() used to visit them
+	const int N = Grid::nTheta;
+	const int H = Grid::halo;
+	auto extBin = [](int x, int y) {
+		x = x < 0 ? 0 : (x > Grid::nx + 1 ? Grid::nx + 1 : x);
+		y = y < 0 ? 0 : (y > Grid::ny + 1 ? Grid::ny + 1 : y);
+		return Grid::Ext::Bin(x, y);
+	};
+	m_bins.extOffset.assign(1, 0);
+	m_bins.extBin.clear();
+	for (unsigned int i = 0; i < n; i ++) {
+		int x = pos[i].Theta() / unit + H + 1;
+		int y = (pos[i].Phi() + PI) / unit + H + 1;
+		m_bins.extBin.push_back(extBin(x, y));
+		if (x <= 2 * H) {
+			if ((y > 2 * H && y <= N) || (y > N + 2 * H && y <= 2 * N)) {
+				y = y < N + H ? y + N : y - N;
+				x = 2 * H + 1 - x;
+				m_bins.extBin.push_back(extBin(x, y));
+			}
+			else {
+				double y1 = y <= N + H ? y + N : y - N;
+				double x1 = 2 * H + 1 - x;
+				m_bins.extBin.push_back(extBin(x1, y1));
+				if (y <= 2 * H) {
+					y1 = y + 2 * N;
+					x1 = x;
+				}
+				else if (y <= N + H && y > N) {
+					y1 -= 2 * N;
+				}
+				else if (y <= N + 2 * H && y > N + H) {
+					y1 = y1 + 2 * N;
+				}
+				else {
+					y1 = y - 2 * N;
+					x1 = x;
+				}
+				m_bins.extBin.push_back(extBin(x1, y1));
+			}
+		}
+		else if (x > N) {
+			if ((y > 2 * H && y <= N - H) || (y > N + H && y <= 2 * N)) {
+				y = y < N + H ? y + N : y - N;
+				x = 2 * (N + H) + 1 - x;
+				m_bins.extBin.push_back(extBin(x, y));
+			}
+			else {
+				double y1 = y <= N + H ? y + N : y - N;
+				double x1 = 2 * (N + H) + 1 - x;
+				m_bins.extBin.push_back(extBin(x1, y1));
+				if (y <= 2 * H) {
+					y1 = y + 2 * N;
+					x1 = x;
+				}
+				else if (y <= N + H && y > N) {
+					y1 -= 2 * N;
+				}
+				else if (y <= N + 2 * H && y > N + H) {
+					y1 = y1 + 2 * N;
+				}
+				else {
+					y1 = y - 2 * N;
+					x1 = x;
+				}
+				m_bins.extBin.push_back(extBin(x1, y1));
+			}
+		}
+		else if (y <= 2 * H)
+			m_bins.extBin.push_back(extBin(x, y + 2 * N));
+		else if (y > 2 * N)
+			m_bins.extBin.push_back(extBin(x, y - 2 * N));
+		m_bins.extOffset.push_back(m_bins.extBin.size());
+	}
+	LogDebug << "Bin tables built, largest PMT count of a bin: " << maxCount << std::endl;
+	return true;
+}
+
 bool FhtAna::initPmt() {
 	LogDebug << "Initializing PMTs" << std::endl;
 	totPmtNum = 0;
@@ -708,7 +1803,7 @@ bool FhtAna::initPmt() {
 			LogError << "Wrong PMT ID" << std::endl;
 			return false;
 		}
-		TVector3 pmtCenter = pmt->getCenter();
+		Vec3 pmtCenter = Vec3::From(pmt->getCenter());
 		m_ptab[pid].pos = pmtCenter;
 		// if (WpID::is3inch(Id)) {
 		// 	m_ptab[pid].res = m_3inchRes;
@@ -729,7 +1824,7 @@ bool FhtAna::initPmt() {
 	return true;
 }
 
-bool FhtAna::freshPmtData(TH2D* ht, TH2D* pht, TH2D *h2d, TH2D *q2d, TH2D* nPMT, double &theta, double &phi) {
+bool FhtAna::LoadHits(EventRecord& rec) {
 	JM::EvtNavigator* nav = m_buf->curEvt();
 	if (not nav) {
 		LogError << "Cannot retrieve current navigator" << std::endl;
@@ -741,58 +1836,171 @@ bool FhtAna::freshPmtData(TH2D* ht, TH2D* pht, TH2D *h2d, TH2D *q2d, TH2D* nPMT,
 		return false;
 	}
 	const std::list<JM::CalibPMTChannel*>& chhlist = calibheader->event()->calibPMTCol();
-	std::list<JM::CalibPMTChannel*>::const_iterator chit = chhlist.begin();
-	if (chit == chhlist.end()) {
-		LogDebug << "chit == chhlist.end()" << std::endl;
+	if (chhlist.empty()) {
+		LogDebug << "Empty calib PMT collection" << std::endl;
 		return false;
 	}
-	double earliest = 1000;
-	while (chit != chhlist.end()) {
-		JM::CalibPMTChannel* calib = *chit ++;
-		Identifier id = Identifier(calib->pmtId());
-		Identifier::value_type value = id.getValue();
-		unsigned int pid;
-		if (not ((value & 0xFF000000) >> 24 == 0x20)) {
-			continue;
-		}
-		if (pid > totPmtNum) {
-			LogError << "Data/Geometry Mis-Match : PmtId(" << pid << ") >= the number of PMTs." << std::endl;
-			return false;
-		}
-		pid = WpID::module(id);
-		m_ptab[pid].q = calib->nPE();
-		m_ptab[pid].fht = calib->firstHitTime();
-		if ((WpID::is20inch(id) && m_20inchusedflag)) {
-			if (earliest > m_ptab[pid].fht) {
-				earliest = m_ptab[pid].fht;
-				theta = m_ptab[pid].pos.Theta();
-				phi = m_ptab[pid].pos.Phi();
+
+	// One pass over the channel list into flat pid/nPE/fht arrays, the
+	// identifiers of the geometry are decoded through m_idPid
+	rec.hitPid.clear();
+	rec.hitQ.clear();
+	rec.hitFht.clear();
+	int nPmt = m_pidUsed.size();
+	std::list<JM::CalibPMTChannel*>::const_iterator chit = chhlist.begin();
+	for (; chit != chhlist.end(); chit ++) {
+		JM::CalibPMTChannel* calib = *chit;
+		Identifier::value_type value = calib->pmtId();
+		int pid;
+		std::unordered_map<Identifier::value_type, int>::const_iterator it = m_idPid.find(value);
+		if (it != m_idPid.end())
+			pid = it->second;
+		else {
+			if (not ((value & 0xFF000000) >> 24 == 0x20))
+				continue;
+			pid = WpID::module(Identifier(value));
+			if (pid < 0 || pid >= nPmt) {
+				LogError << "Data/Geometry Mis-Match : PmtId(" << pid << ") >= the number of PMTs." << std::endl;
+				return false;
 			}
-			m_ptab[pid].loc = 1;
-			m_ptab[pid].used = true;
-			m_usedPmtNum ++;
-			ht->Fill(m_ptab[pid].pos.Theta(), m_ptab[pid].fht);
-			pht->Fill(m_ptab[pid].pos.Phi(), m_ptab[pid].fht);
-			int binx = m_ptab[pid].pos.Theta() / (PI / 100);
-			int biny = (m_ptab[pid].pos.Phi() + TMath::Pi()) / (PI / 100);
-			if (m_ptab[pid].fht < 100)
-				h2d->SetBinContent(binx, biny,
-								   m_ptab[pid].fht < h2d->GetBinContent(binx, biny) || h2d->GetBinContent(binx, biny) == 0 ?
-								   m_ptab[pid].fht : h2d->GetBinContent(binx, biny));
-			// q2d->SetBinContent(binx, biny, q2d->GetBinContent(binx, biny) + m_ptab[pid].q);
-			q2d->Fill(m_ptab[pid].pos.Theta(), m_ptab[pid].pos.Phi(), m_ptab[pid].q);
-			// nPMT->SetBinContent(binx, biny, nPMT->GetBinContent(binx, biny) + 1);
-			nPMT->Fill(m_ptab[pid].pos.Theta(), m_ptab[pid].pos.Phi(), 1);
-			// LogDebug << m_ptab[pid].fht << std::endl;
-			// LogDebug << h2d->GetBinContent(binx, biny) << std::endl;
 		}
+		rec.hitPid.push_back(pid);
+		rec.hitQ.push_back(calib->nPE());
+		rec.hitFht.push_back(calib->firstHitTime());
 	}
+	return true;
+}
+
+bool FhtAna::freshPmtData(TH2D *h2d, TH2D *q2d, Vec3& first) {
+	// first is the direction of the earliest fired PMT
+	double earliest = 1000;
+	double* fhtMap = h2d->GetArray();
+	double* qMap = q2d->GetArray();
+	int nFilled = 0;
+	int nHit = m_hitPid.size();
+	for (int k = 0; k < nHit; k ++) {
+		int pid = m_hitPid[k];
+		m_ptab[pid].q = m_hitQ[k];
+		m_ptab[pid].fht = m_hitFht[k];
+		if (!m_pidUsed[pid])
+			continue;
+		if (earliest > m_ptab[pid].fht) {
+			earliest = m_ptab[pid].fht;
+			first = m_ptab[pid].pos;
+		}
+		m_ptab[pid].loc = 1;
+		m_ptab[pid].used = true;
+		m_usedPmtNum ++;
+		double& fht = fhtMap[m_bins.fhtBin[pid]];
+		if (m_ptab[pid].fht < 100)
+			fht = m_ptab[pid].fht < fht || fht == 0 ? m_ptab[pid].fht : fht;
+		qMap[m_bins.qBin[pid]] += m_ptab[pid].q;
+		nFilled ++;
+	}
+	// The maps are written through their bin arrays, keep the statistics
+	first = first.Unit();
+	h2d->SetEntries(nFilled);
+	q2d->SetEntries(nFilled);
 	LogDebug << "Loading calibration data done" << std::endl;
 	return true;
 }
 
-bool FhtAna::IfCrossCd(TVector3& Inci, TVector3& Dir, Double_t R) {
-	TVector3 dir = Dir.Unit();
+PreFilterResult FhtAna::PreFilter(const EventRecord& rec) {
+	// Only fired 20-inch water pool PMTs above ChargeCut are counted
+	double totPE = 0;
+	m_hitTimes.clear();
+	int nHit = rec.hitPid.size();
+	for (int k = 0; k < nHit; k ++) {
+		if (!m_pidUsed[rec.hitPid[k]])
+			continue;
+		double q = rec.hitQ[k];
+		if (q <= m_qcut)
+			continue;
+		totPE += q;
+		m_hitTimes.push_back(rec.hitFht[k]);
+	}
+
+	int nFired = m_hitTimes.size();
+	if (nFired < m_minFiredPmt)
+		return _PFLOWPMT;
+	if (totPE < m_minTotPE)
+		return _PFLOWCHARGE;
+
+	// Spread between the earliest hit and the n-th earliest one, a muon
+	// lights its entry region within a few tens of ns while noise does not
+	int n = m_nEarlyHits < nFired ? m_nEarlyHits : nFired;
+	if (n > 1) {
+		double first = *std::min_element(m_hitTimes.begin(), m_hitTimes.end());
+		std::nth_element(m_hitTimes.begin(), m_hitTimes.begin() + n - 1, m_hitTimes.end());
+		if (m_hitTimes[n - 1] - first > m_maxEarlySpread)
+			return _PFSPREAD;
+	}
+	LogDebug << "Pre-filter passed, nFired: " << nFired << "\ttotPE: " << totPE << endl;
+	return _PFPASS;
+}
+
+void FhtAna::FastVeto(EventRecord& rec) {
+	// Entry at the earliest fired PMTs, exit at the brightest coarse cell
+	// well away from it, read off the hit list without booking a map
+	MuonVeto& v = rec.veto;
+	v = MuonVeto();
+	v.event = rec.id;
+	v.level = _VETOFAST;
+	v.muon = rec.pf == _PFPASS;
+	if (!v.muon)
+		return;
+	std::fill(m_coarseQ.begin(), m_coarseQ.end(), 0);
+	std::fill(m_coarseU.begin(), m_coarseU.end(), Vec3());
+	m_early.clear();
+	int nHit = rec.hitPid.size();
+	for (int k = 0; k < nHit; k ++) {
+		int pid = rec.hitPid[k];
+		double q = rec.hitQ[k];
+		if (!m_pidUsed[pid] || q <= m_qcut)
+			continue;
+		int c = m_bins.coarseCell[pid];
+		m_coarseQ[c] += q;
+		m_coarseU[c] += q * m_pmtDir[pid];
+		m_early.push_back(k);
+	}
+	int n = m_nEarlyHits < (int)m_early.size() ? m_nEarlyHits : m_early.size();
+	// No PMT over ChargeCut (or NEarlyHits 0) leaves no entry to point at
+	if (n <= 0) {
+		v.muon = false;
+		v.quality = 0;
+		return;
+	}
+	std::partial_sort(m_early.begin(), m_early.begin() + n, m_early.end(), [&rec](int a, int b) {
+		return rec.hitFht[a] < rec.hitFht[b];
+	});
+	Vec3 entry;
+	for (int k = 0; k < n; k ++)
+		entry += rec.hitQ[m_early[k]] * m_pmtDir[rec.hitPid[m_early[k]]];
+	entry = entry.Unit();
+	v.ti = v.tStart = rec.hitFht[m_early[0]];
+	v.inci = m_LSRadius * entry;
+
+	// More than 60 degrees off the entry
+	int exit = -1;
+	for (int c = 0; c < (int)m_coarseQ.size(); c ++) {
+		if (m_coarseQ[c] <= 0 || m_coarseU[c].Unit() * entry > 0.5)
+			continue;
+		if (exit < 0 || m_coarseQ[c] > m_coarseQ[exit])
+			exit = c;
+	}
+	if (exit >= 0) {
+		v.dir = (m_coarseU[exit].Unit() - entry).Unit();
+		v.quality = 2;
+	}
+	else {
+		// One bright region only, through the centre
+		v.dir = - entry;
+		v.quality = 1;
+	}
+}
+
+bool FhtAna::IfCrossCd(const Vec3& Inci, const Vec3& Dir, Double_t R) {
+	Vec3 dir = Dir.Unit();
 	Double_t Dis = TMath::Sqrt(Inci.Mag() * Inci.Mag() - fabs(Inci * dir) * fabs(Inci * dir));
 	// LogDebug << "Distance to center: " << Dis << endl;
 	if (R < Dis)
@@ -800,26 +2008,78 @@ bool FhtAna::IfCrossCd(TVector3& Inci, TVector3& Dir, Double_t R) {
 	return true;
 }
 
-TVector3 FhtAna::InciOnLS(TVector3& Inci, TVector3& Dir, Double_t R) {
-	TVector3 dir = Dir.Unit();
+Vec3 FhtAna::InciOnLS(const Vec3& Inci, const Vec3& Dir, Double_t R) {
+	Vec3 dir = Dir.Unit();
 	Double_t Dis2 = Inci.Mag() * Inci.Mag() - fabs(Inci * dir) * fabs(Inci * dir);
-	TVector3 LSInci = Inci + dir * (fabs(Inci * dir) - TMath::Sqrt(R * R - Dis2));
+	Vec3 LSInci = Inci + dir * (fabs(Inci * dir) - TMath::Sqrt(R * R - Dis2));
 	return LSInci;
 }
 
-TVector3 FhtAna::PosOnLS(TVector3& pos, TVector3& Dir, Double_t R, int co) {
-	TVector3 dir = Dir.Unit();
+Vec3 FhtAna::PosOnLS(const Vec3& pos, const Vec3& Dir, Double_t R, int co) {
+	Vec3 dir = Dir.Unit();
 	Double_t Dis2 = pos.Mag2() - fabs(pos * dir) * fabs(pos * dir);
-	TVector3 LSpos = pos + co * dir * (TMath::Sqrt(R * R - Dis2) + co * ((pos * dir > 0) ? -1 : 1) * fabs(pos * dir));
+	Vec3 LSpos = pos + co * dir * (TMath::Sqrt(R * R - Dis2) + co * ((pos * dir > 0) ? -1 : 1) * fabs(pos * dir));
 	return LSpos;
 }
 
 bool FhtAna::finalize() {
 	LogDebug << "Finalizing" << std::endl;
+	if (m_pipelined) {
+		// Drain the worker and commit what it still holds
+		m_inQueue->Push(NULL, [this]() { CommitDone(); });
+		while (EventRecord* rec = m_outQueue->Pop())
+			Commit(rec);
+		m_worker.join();
+		LogInfo << "Read -> reconstruct queue, mean depth: " << m_inQueue->MeanDepth() << "\tmax: " << m_inQueue->MaxDepth()
+				<< "\treader waits: " << m_inQueue->nFull() << "\tworker waits: " << m_inQueue->nEmpty() << endl;
+		LogInfo << "Reconstruct -> commit queue, mean depth: " << m_outQueue->MeanDepth() << "\tmax: " << m_outQueue->MaxDepth()
+				<< "\tworker waits: " << m_outQueue->nFull() << endl;
+	}
+	m_sweepPool.Stop();
+	LogInfo << "Fast veto decision, mean: " << (m_nFast ? m_fastTime / m_nFast : 0) << " us\tmax: " << m_maxFastTime
+			<< " us\tover the " << m_fastBudget << " us budget: " << m_nOverBudget << endl;
+	if (m_validation)
+		WriteValidation();
+	if (m_snap.IsOpen()) {
+		LogInfo << "Snapshot maps: " << m_snap.nRecords() << "\tbytes: " << m_snap.nBytes() << "\tin " << m_snapFile << endl;
+		m_snap.Close();
+	}
+	if (m_shard)
+		CloseShard();
+	if (m_cache.IsOpen()) {
+		LogInfo << "Result cache hits: " << m_cache.nHit() << "\tmisses: " << m_cache.nMiss()
+				<< "\tnew records: " << m_cache.nInsert() << endl;
+		m_cache.Close();
+	}
+	for (size_t i = 0; i < m_freeRecords.size(); i ++)
+		delete m_freeRecords[i];
+	m_freeRecords.clear();
+	for (size_t i = 0; i < m_sweep.size(); i ++)
+		for (size_t k = 0; k < m_sweep[i].maps.size(); k ++)
+			delete m_sweep[i].maps[k];
+	m_sweep.clear();
+	LogInfo << "Pre-filter passed: " << m_nPreFilter[_PFPASS] << endl;
+	LogInfo << "Pre-filter no calib data: " << m_nPreFilter[_PFNOCALIB] << endl;
+	LogInfo << "Pre-filter few fired PMTs: " << m_nPreFilter[_PFLOWPMT] << endl;
+	LogInfo << "Pre-filter low charge: " << m_nPreFilter[_PFLOWCHARGE] << endl;
+	LogInfo << "Pre-filter wide early-hit spread: " << m_nPreFilter[_PFSPREAD] << endl;
+	if (m_timeBudget > 0)
+		LogInfo << "Over the " << m_timeBudget << " ms budget: " << m_nDegraded << " events\tcoarse centroids: "
+				<< m_nDegradeFlag[0] << "\tplain segmentation: " << m_nDegradeFlag[1]
+				<< "\tsingle track hypothesis: " << m_nDegradeFlag[2] << endl;
+	LogInfo << "Map buffers allocated: " << m_pipe.nAllocated() << "\tpeak in use: " << m_pipe.PeakLive() << endl;
+	if (m_nChecked) {
+		LogInfo << m_mapPrecision << " maps against double, events: " << m_nChecked
+				<< "\tlabel changes: " << m_nLabelDiff << "\tcentroid count changes: " << m_nCenterDiff << endl;
+		LogInfo << "Largest centroid shift: " << m_maxCenterDiff << " rad\tdirection: " << m_maxDirDiff
+				<< " rad\tincident point: " << m_maxInciDiff << " mm\tti: " << m_maxTiDiff << " ns" << endl;
+	}
+	delete m_nPmtMap;
+	m_nPmtMap = NULL;
 	return true;
 }
 
-TVector3 FhtAna::GetInciPos(TH1D *ThevFht, TH1D *ThevPhi, int n) {
+Vec3 FhtAna::GetInciPos(TH1D *ThevFht, TH1D *ThevPhi, int n) {
 	int thetaBin;
 	int fht = 1000;
 	for (int i = 1; i < n - 3; i ++) {
@@ -832,14 +2092,14 @@ TVector3 FhtAna::GetInciPos(TH1D *ThevFht, TH1D *ThevPhi, int n) {
 	double phi = ThevPhi->GetBinContent(thetaBin);
 	phi = phi * TMath::Pi() / 100 - TMath::Pi();
 	double theta = (double)thetaBin * TMath::Pi() / n;
-	TVector3 InciPos;
+	Vec3 InciPos;
 	InciPos.SetMagThetaPhi(17700, theta, phi);
 	LogInfo << "Theta: " << theta << "\t"
 			<< "Phi: " << phi << endl;
 	return InciPos;
 }
 
-TVector3 FhtAna::GetExitPos(TH1D *ThevFht, TH1D *ThevPhi, int n) {
+Vec3 FhtAna::GetExitPos(TH1D *ThevFht, TH1D *ThevPhi, int n) {
 	int fht = 1000;
 	int thetaBin;
 	for (int i = 1; i < n - 3; i ++) {
@@ -869,24 +2129,24 @@ TVector3 FhtAna::GetExitPos(TH1D *ThevFht, TH1D *ThevPhi, int n) {
 			}
 	}
 	if (thetaBin == ThevFht->GetMinimumBin()) {
-		return TVector3(0, 0, 0);
+		return Vec3(0, 0, 0);
 	}
 
 	theta = (double)thetaBin * TMath::Pi() / n;
 		
 	double phi = ThevPhi->GetBinContent(thetaBin);
 	phi = phi * TMath::Pi() / 100 - TMath::Pi();
-	TVector3 ExitPos;
+	Vec3 ExitPos;
 	ExitPos.SetMagThetaPhi(19400, theta, phi);
 	LogInfo << "Theta: " << theta << "\t"
 			<< "Phi: " << phi << endl;
 	return ExitPos;
 }
 
-TVector3 FhtAna::GetChargeCenter() {
+Vec3 FhtAna::GetChargeCenter() {
 	int n = m_ptab.size();
 	double totCharge = 0;
-	TVector3 totChaPos(0, 0, 0);
+	Vec3 totChaPos(0, 0, 0);
 	for (int i = 0; i < n; i ++) {
 		if (!m_ptab[i].used)
 			continue;
@@ -897,64 +2157,22 @@ TVector3 FhtAna::GetChargeCenter() {
 	return totChaPos;
 }
 
-TH2D* FhtAna::MapSmooth(TH2D* ori, int nx, int ny, TString name) {
-	TH2D* h = (TH2D*)ori->Clone("tmph");
-
-	// Extend edge of the map
-	double unit = PI / nx;
-	TH2D* ret = new TH2D(name, "", nx + 20, 0 - 10 * unit, PI + 10 * unit, ny + 20, -PI - 10 * unit, PI + 10 * unit);
-	MapExtend(ret, h, nx, ny);
-	delete h;
-
-	// Smooth process
-	TH2D* bc = (TH2D*)ret->Clone("BackH");
-	for (int i = 3; i <= nx + 18; i ++) {
-		for (int j = 3; j <= ny + 18; j ++) {
-			double tmp = 0;
-			for (int k = i - 2; k <= i + 2; k ++)
-				for (int l = j - 2; l <= j + 2; l ++)
-					tmp += bc->GetBinContent(k, l);
-			tmp /= 25;
-			ret->SetBinContent(i, j, tmp);
-		}
-	}
-
-	delete bc;
+TH2D* FhtAna::MapSmooth(TH2D* ori, TString name) {
+	// Extend edge of the map and smooth it in one pass, the 2-bin border
+	// keeps the extended values
+	TH2D* ret = NewExtMap(name);
+	MapGather<MapRef> ex = Gather(MapRef(ori->GetArray()), &m_bins.alias[0]);
+	EvalFrame<Grid::Ext>(ret->GetArray(), ex, 2);
+	Eval<Grid::Ext>(ret->GetArray(), Box<Grid::Ext, 2>(ex) / 25., 2);
 	return ret;
 }
 
-bool FhtAna::FillContent(TH2D* h, int nx, int ny) {
+bool FhtAna::FillContent(TH2D* h) {
 	for (int i = 0; i < 2; i ++);
-		Expansion(h, nx, ny);
+		Expansion<Grid::Base>(h);
 	return true;
 }
 
-TH2D* FhtAna::PECut(TH2D* ori, int nx, int ny, double thr) {
-	// LogDebug << "ori address: " << ori << endl;
-	TString name("Q2D");
-	name += thr;
-	name += ori->GetName();
-	TH2D* ret = new TH2D(name, "", nx, - 0.1 * PI, 1.1 * PI, ny, - 1.1 * PI, 1.1 * PI);
-	double peak = ori->GetBinContent(ori->GetMaximumBin());
-	// if (peak > 12000)
-	// 	thr *= peak;
-	// else
-	// 	thr = (thr + 0.1) * peak;
-	thr = thr * peak;
-	LogDebug << "Threshold: " << thr << endl;
-	// if (thr < 1000) {
-	// 	LogDebug << "No track in CD" << endl;
-	// 	return NULL;
-	// }
-	for (int i = 1; i <= nx; i ++)
-		for (int j = 1; j <= ny; j ++) {
-			double tmp = ori->GetBinContent(i, j);
-			// ori->SetBinContent(i, j, tmp > thr ? tmp : 0);
-			ret->SetBinContent(i, j, tmp > thr ? tmp : 0);
-		}
-	return ret;
-}
-
 void FhtAna::nCorrosion(TH2D* ori, int nx, int ny, int nturn) {
 	for (int i = 0; i < nturn; i ++)
 		Corrosion(ori, nx, ny);
@@ -978,424 +2196,315 @@ void FhtAna::Corrosion(TH2D* ori, int nx, int ny) {
 	delete bc;
 }
 
-int FhtAna::AreaCut(TH2D* ori, TH2D* mark, int nx, int ny, double thr, bool cutOut, bool cutIn) {
-	TH2D* bc = (TH2D*)ori->Clone("oriBack");
-	struct Area {
-		int area = 0;
-		double aIn = 0;
-		double aOut = 0;
-		double max = 0;
-		double min = 1E9;
-		TVector2 st;
-		TVector2 ed;
-	};
+int FhtAna::AreaCut(TH2D* ori, TH2D* mark, int nx, int ny, const SegParams& p, bool cutOut, bool cutIn) {
+	double* o = ori->GetArray();
+	double* mk = mark->GetArray();
+	RunMask<Grid::Ext> runs;
+	runs.Scan(mk, true);
 	map<int, struct Area> mArea;
-	for (int i = 1; i <= nx; i ++) {
-		for (int j = 1; j <= ny; j ++) {
-			double tmp = mark->GetBinContent(i, j);
-			if (tmp) {
-				double val = ori->GetBinContent(i, j);
-				mArea[(int)tmp].area ++;
-				if (i >= 11 && i <= nx - 10 && j >= 11 && j <= ny - 10)
-					mArea[(int)tmp].aIn ++;
-				else
-					mArea[(int)tmp].aOut ++;
-				if (mArea[(int)tmp].area == 1) {
-					mArea[(int)tmp].st.Set((double)i, (double)j);
-					mArea[(int)tmp].ed.Set((double)i, (double)j);
-					mArea[(int)tmp].max = val;
-				}
-				else {
-					mArea[(int)tmp].st.Set(i < mArea[(int)tmp].st.X() ? i : mArea[(int)tmp].st.X(), j < mArea[(int)tmp].st.Y() ? j : mArea[(int)tmp].st.Y());
-					mArea[(int)tmp].ed.Set(i > mArea[(int)tmp].ed.X() ? i : mArea[(int)tmp].ed.X(), j > mArea[(int)tmp].ed.Y() ? j : mArea[(int)tmp].ed.Y());
-					mArea[(int)tmp].max = val > mArea[(int)tmp].max ? val : mArea[(int)tmp].max;
-					mArea[(int)tmp].min = val < mArea[(int)tmp].min ? val : mArea[(int)tmp].min;
-				}
-			}
-		}
-	}
+	AreaStats(runs, o, NULL, mArea);
 
 	map<int, Area>::iterator it = mArea.begin();
 	bool overArea = false;
-	LogInfo << mArea.size() << endl;
+	LogSegDebug << mArea.size() << endl;
 	while (it != mArea.end() && cutIn) {
-		if ((it->second).area > 200) {
+		if ((it->second).area > p.maxArea) {
 			overArea = true;
-			double th = thr * ((it->second).max - (it->second).min) + (it->second).min;
+			double th = p.areaCut * ((it->second).max - (it->second).min) + (it->second).min;
 			// if ((it->second).max < 1E6)
 			// 	th = 1.1E6;
-			LogInfo << "Threshold: " << th << endl;
-			for (int i = ((it->second).st.X()); i <= ((it->second).ed.X()); i ++) {
-				for (int j = (it->second).st.Y(); j <= (it->second).ed.Y(); j ++) {
-					double tmp = ori->GetBinContent(i, j);
-					int ma = (int)mark->GetBinContent(i, j);
-					if (tmp < th && ma == it->first) {
-						ori->SetBinContent(i, j, 0);
-						mark->SetBinContent(i, j, 0);
+			LogSegDebug << "Threshold: " << th << endl;
+			for (int i = 1; i <= nx; i ++)
+				for (int r = runs.col[i]; r < runs.col[i + 1]; r ++) {
+					if ((int)runs.val[r] != it->first)
+						continue;
+					for (int j = runs.j0[r]; j <= runs.j1[r]; j ++) {
+						int b = Grid::Ext::Bin(i, j);
+						if (o[b] < th) {
+							o[b] = 0;
+							mk[b] = 0;
+						}
 					}
 				}
-			}
 		}
 		it ++;
 	}
 
-	if (overArea) {
-		for (int i = 1; i <= nx; i ++)
-			for (int j = 1; j <= ny; j ++)
-				mark->SetBinContent(i, j, 0);
-		MarkConnection(ori, nx, ny, mark, 10);
-	}
+	if (overArea)
+		MarkConnection(ori, nx, ny, mark, p.minSplit);
 
 	if (!cutOut)
 		return mArea.size();
 
 	map<int, Area> areas;
-	for (int i = 1; i <= nx; i ++) {
-		for (int j = 1; j <= ny; j ++) {
-			double tmp = mark->GetBinContent(i, j);
-			if (tmp) {
-				double val = ori->GetBinContent(i, j);
-				areas[(int)tmp].area ++;
-				if (i >= 11 && i <= nx - 10 && j >= 11 && j <= ny - 10)
-					areas[(int)tmp].aIn ++;
-				else
-					areas[(int)tmp].aOut ++;
-				if (areas[(int)tmp].area == 1) {
-					areas[(int)tmp].st.Set((double)i, (double)j);
-					areas[(int)tmp].ed.Set((double)i, (double)j);
-					areas[(int)tmp].max = val;
-				}
-				else {
-					areas[(int)tmp].st.Set(i < areas[(int)tmp].st.X() ? i : areas[(int)tmp].st.X(), j < areas[(int)tmp].st.Y() ? j : areas[(int)tmp].st.Y());
-					areas[(int)tmp].ed.Set(i > areas[(int)tmp].ed.X() ? i : areas[(int)tmp].ed.X(), j > areas[(int)tmp].ed.Y() ? j : areas[(int)tmp].ed.Y());
-					areas[(int)tmp].max = val > areas[(int)tmp].max ? val : areas[(int)tmp].max;
-					areas[(int)tmp].min = val < areas[(int)tmp].min ? val : areas[(int)tmp].min;
-				}
-			}
-		}
-	}
+	runs.Scan(mk, true);
+	AreaStats(runs, o, NULL, areas);
 
 	overArea = false;
 	it = areas.begin();
 	while (it != areas.end()) {
-		LogInfo << "AreaID: " << it->first << endl;
-		LogInfo << "AreaIn: " << (it->second).aIn << endl;
-		LogInfo << "AreaOut: " << (it->second).aOut << endl;
+		LogSegDebug << "AreaID: " << it->first << endl;
+		LogSegDebug << "AreaIn: " << (it->second).aIn << endl;
+		LogSegDebug << "AreaOut: " << (it->second).aOut << endl;
 		if ((it->second).aIn < (it->second).aOut) {
 			overArea = true;
-			for (int i = ((it->second).st.X()); i <= ((it->second).ed.X()); i ++) {
-				for (int j = (it->second).st.Y(); j <= (it->second).ed.Y(); j ++) {
-					int ma = (int)mark->GetBinContent(i, j);
-					if (ma == it->first) {
-						ori->SetBinContent(i, j, 0);
-						mark->SetBinContent(i, j, 0);
+			for (int i = 1; i <= nx; i ++)
+				for (int r = runs.col[i]; r < runs.col[i + 1]; r ++) {
+					if ((int)runs.val[r] != it->first)
+						continue;
+					for (int j = runs.j0[r]; j <= runs.j1[r]; j ++) {
+						o[Grid::Ext::Bin(i, j)] = 0;
+						mk[Grid::Ext::Bin(i, j)] = 0;
 					}
 				}
-			}
 		}
 		it ++;
 	}
-	if (overArea) {
-		for (int i = 1; i <= nx; i ++)
-			for (int j = 1; j <= ny; j ++)
-				mark->SetBinContent(i, j, 0);
-		return MarkConnection(ori, nx, ny, mark, 10);
-	}
+	if (overArea)
+		return MarkConnection(ori, nx, ny, mark, p.minSplit);
 	return mArea.size();
 }
 
-int* FhtAna::GetMassPos(TH2D* ori, TH2D* mark, int nx, int ny, TH2D* test) {
-	struct PosPE
-	{
-		int pos;
-		double PE;
-	};
-
-	vector<PosPE> ct;
-	
-	// for (int i = 11; i <= nx - 10; i ++) {
-	// 	for (int j = 11; j <= ny - 10; j ++) {
-	// 		double tmp = 0;
-	// 		for (int k = i - 5; k <= i + 5; k ++)
-	// 			for (int l = j - 5; l <= j + 5; l ++)
-	// 				tmp += ori->GetBinContent(k, l);
-	// 		tmp /= 121;
-	// 		if (tmp > 7000) {
-	// 			PosPE pp;
-	// 			pp.pos = (i - 10) * 1000 + (j - 10);
-	// 			pp.PE = tmp;
-	// 			ct.push_back(pp);
-	// 		}
-	// 	}
-	// }
-
-	// double x[225];
-	map<int, TVector3> qp;
-	map<int, double> q;
-	map<int, int> area;
-	double unit = TMath::Pi() / 100;
-	for (int i = 1; i <= nx; i ++) {
-		for (int j = 1; j <= ny; j ++) {
-			double tmp = mark->GetBinContent(i, j);
-			if (tmp > 0) {
-				// LogDebug << "tmp: " << tmp << endl;
-				TVector3 p;
-				double phi;
-				double the;
-				if (j < 11) {
-					phi = (190 + j) * unit - TMath::Pi();
-					if (i < 11) {
-						the = (11 - i) * unit;
-						phi = phi > 0 ? phi - TMath::Pi() : phi == 0 ? 0 : phi + TMath::Pi();
-					}
-					else if (i > 110) {
-						the = (210 - i) * unit;
-						phi = phi > 0 ? phi - TMath::Pi() : phi == 0 ? 0 : phi + TMath::Pi();
-					}
-					else {
-						the = (i - 10) * unit;
-					}
-				}
-				else if (j > 210) {
-					phi = (j - 210) * unit - TMath::Pi();
-					if (i < 11) {
-						the = (11 - i) * unit;
-						phi = phi > 0 ? phi - TMath::Pi() : phi == 0 ? 0 : phi + TMath::Pi();
-					}
-					else if (i > 110) {
-						the = (210 - i) * unit;
-						phi = phi > 0 ? phi - TMath::Pi() : phi == 0 ? 0 : phi + TMath::Pi();
-					}
-					else {
-						the = (i - 10) * unit;
-					}
-				}
-				else {
-					the = (i - 10) * unit;
-					phi = (j - 10) * unit - TMath::Pi();
-				}
-				p.SetMagThetaPhi(m_LSRadius, the, phi);
-				// LogDebug << the << ", " << phi << ", " << p << endl;
-				qp[(int)tmp] += (p * ori->GetBinContent(i, j));
-				// LogDebug << qp[(int)tmp] << endl;
-				q[(int)tmp] += ori->GetBinContent(i, j);
-				area[(int)tmp] ++;
+int FhtAna::Watershed(SegState& s, TH2D* l, TH2D* h, TH2D* ori) {
+	// Marker-controlled watershed, the high areas flood the low threshold
+	// support in decreasing RMS order. A bin reached by two floods is a
+	// dividing line and leaves ori, so the relabelling that follows keeps
+	// touching footprints apart. The support is the bins of the max-tree.
+	// Returns the number of line bins.
+	const int QUEUED = - 2;
+	const int LINE = - 1;
+	double* o = ori->GetArray();
+	double* pl = l->GetArray();
+	const double* ph = h->GetArray();
+	if (s.flood.empty())
+		s.flood.assign(Grid::Ext::size, 0);
+	const int off[4] = {- 1, 1, - Grid::Ext::stride, Grid::Ext::stride};
+	priority_queue<pair<double, int> > front;
+	for (int k = 0; k < s.tree.size(); k ++) {
+		int b = s.tree.Bin(k);
+		if (o[b] && ph[b])
+			s.flood[b] = (int)ph[b];
+	}
+	for (int k = 0; k < s.tree.size(); k ++) {
+		int b = s.tree.Bin(k);
+		if (s.flood[b] <= 0)
+			continue;
+		for (int d = 0; d < 4; d ++) {
+			int nb = b + off[d];
+			if (o[nb] && !s.flood[nb]) {
+				s.flood[nb] = QUEUED;
+				front.push(make_pair(o[nb], nb));
 			}
 		}
 	}
 
-	static int mass[4] = {0};
-	map<int, TVector3>::iterator qpIt = qp.begin();
-	map<int, double>::iterator qIt = q.begin();
-	map<int, int>::iterator aIt = area.begin();
-	map<int, TVector3> rec;
-	int m = 0;
-	while (qpIt != qp.end()) {
-		LogDebug << "nIterator: " << qpIt->first << endl;
-		TVector3 p = 1 / qIt->second * qpIt->second;
-		LogDebug << p << endl;
-		if (m < 4) {
-			map<int, TVector3>::iterator recIt = rec.begin();
-			int i = 0;
-			bool breakFlag = false;
-			while (recIt != rec.end()) {
-				if ((p - recIt->second).Mag() < 3000 &&
-					(p.Theta() < 0.314 && (recIt->second).Theta() < 0.314 ||
-					 p.Theta() > 2.826 && (recIt->second).Theta() > 2.826 ||
-					 p.Phi() < -2.826 && (recIt->second).Phi() < -2.826 ||
-					 p.Phi() > 2.826 && (recIt->second).Phi() > 2.826)) {
-					if (area[recIt->first] < area[qpIt->first]) {
-						mass[i] = (int)(p.Theta() / unit) * 1000 + (int)((p.Phi() + TMath::Pi()) / unit);
-						rec.erase(recIt);
-					}
-					breakFlag = true;
-					break;
-				}
-				i ++;
-				recIt ++;
-			}
-			if (!breakFlag) {
-				int pp = (int)(p.Theta() / unit) * 1000 + (int)((p.Phi() + TMath::Pi()) / unit);
-				mass[m] = pp;
-				m ++;
+	int nLine = 0;
+	while (!front.empty()) {
+		int b = front.top().second;
+		front.pop();
+		int lab = 0;
+		bool line = false;
+		for (int d = 0; d < 4; d ++) {
+			int f = s.flood[b + off[d]];
+			if (f <= 0)
+				continue;
+			if (lab && f != lab)
+				line = true;
+			lab = f;
+		}
+		if (line) {
+			s.flood[b] = LINE;
+			nLine ++;
+			continue;
+		}
+		s.flood[b] = lab;
+		for (int d = 0; d < 4; d ++) {
+			int nb = b + off[d];
+			if (o[nb] && !s.flood[nb]) {
+				s.flood[nb] = QUEUED;
+				front.push(make_pair(o[nb], nb));
 			}
 		}
-		rec[qpIt->first] = p;
-		qpIt ++;
-		qIt ++;
 	}
 
-	for (int i = 0; i < 4; i ++)
-		LogDebug << "mass[" << i << "]: " << mass[i] << endl;
-
-	qp.clear();
-	q.clear();
-	area.clear();
-	rec.clear();
-
-	return mass;
-}
-
-int FhtAna::MarkConnection(TH2D* ori, int nx, int ny, TH2D* mark, int thr) {
-	vector<int> st;
-	vector<int> ed;
-	double ID = 0;
-	map<int, int> parent;
-	for (int i = 1; i <= nx; i ++) {
-		double last = 0;
-		vector<int> start;
-		vector<int> end;
-		for (int j = 1; j <= ny; j ++) {
-			if (ori->GetBinContent(i, j)) {
-				if (last == 0) {
-					ID ++;
-					start.push_back(j);
-					parent[ID] = ID;
-				}
-				if (j == ny) {
-					end.push_back(j);
-					// LogDebug << "st.size: " << start.size() << " ed.size: " << end.size() << endl;
-					int k = 0;
-					for (int& u : ed) {
-						if (start.back() <= u && end.back() >= st[k]) {
-							double tmpID = mark->GetBinContent(i - 1, u);
-							while (tmpID != parent[tmpID])
-								tmpID = parent[tmpID];
-							if (parent[ID] < parent[tmpID])
-								parent[tmpID] = parent[ID];
-							else
-								parent[ID] = parent[tmpID];
-							// LogDebug << "InIf: " << tmpID << endl;
-						}
-						k ++;
-					}
-				}
-				mark->SetBinContent(i, j, ID);
-			}
-			else {
-				if (last) {
-					end.push_back(j - 1);
-					int k = 0;
-					for (int& u : ed) {
-						if (start.back() <= u && end.back() >= st[k]) {
-							double tmpID = mark->GetBinContent(i - 1, u);
-							while (tmpID != parent[tmpID])
-								tmpID = parent[tmpID];
-							double bcID = ID;
-							while (bcID != parent[bcID])
-								bcID = parent[bcID];
-							if (parent[bcID] < parent[tmpID])
-								parent[tmpID] = parent[bcID];
-							else
-								parent[bcID] = parent[tmpID];
-							// LogDebug << "InIf: " << tmpID << endl;
-						}
-						k ++;
-					}
-					// LogDebug << "PosID: " << i << ", " << j << ", " << parent[ID] << ", " << k << endl;
-				}
-			}
-			last = ori->GetBinContent(i, j);
+	// Basins take the label of their high area, areas with no high area
+	// keep theirs
+	for (int k = 0; k < s.tree.size(); k ++) {
+		int b = s.tree.Bin(k);
+		if (s.flood[b] == LINE) {
+			o[b] = 0;
+			pl[b] = 0;
 		}
-		st.swap(start);
-		ed.swap(end);
+		else if (s.flood[b] > 0)
+			pl[b] = s.flood[b];
+		s.flood[b] = 0;
 	}
+	return nLine;
+}
 
-	int ret = 0;
-	map<int, int> count;
-	for (int i = 1; i <= nx; i ++) {
-		for (int j = 1; j <= ny; j ++) {
-			double tmp = mark->GetBinContent(i, j);
-			if (tmp) {
-				while (tmp != parent[tmp])
-					tmp = parent[tmp];
-				mark->SetBinContent(i, j, parent[tmp]);
-				count[parent[tmp]] ++;
-			}
-		}
+int FhtAna::TreeLabel(SegState& s, double level, TH2D* ori, TH2D* mark) {
+	// MarkConnection() of the map cut above level, read off the max-tree
+	std::vector<int> top;
+	std::vector<int> areas;
+	s.tree.Cut(level, true, top);
+	s.tree.Areas(top, s.p.minLabel, areas);
+	std::vector<int> label(s.tree.size(), 0);
+	for (size_t a = 0; a < areas.size(); a ++)
+		label[areas[a]] = a + 1;
+	double* o = ori->GetArray();
+	double* mk = mark->GetArray();
+	for (int k = 0; k < s.tree.size(); k ++) {
+		if (top[k] < 0)
+			continue;
+		int b = s.tree.Bin(k);
+		mk[b] = label[top[k]];
+		if (!label[top[k]])
+			o[b] = 0;
 	}
+	return areas.size() + 1;
+}
 
-	map<int, int>::iterator it = count.begin();
-	ID = 1;
-	while (it != count.end()) {
-		if (it->second < thr) {
-			it->second = 0;
+int FhtAna::TreeAreaCut(SegState& s, TH2D* ori, TH2D* mark) {
+	// AreaCut() with cutIn of the high threshold areas: an area over
+	// maxArea bins keeps its bins at or above areaCut * (max - min) + min,
+	// which are the tree nodes at that level under the area
+	std::vector<int> top;
+	std::vector<int> areas;
+	s.tree.Cut(s.hLevel, true, top);
+	s.tree.Areas(top, s.p.minLabel, areas);
+	LogSegDebug << areas.size() << endl;
+	int n = s.tree.size();
+	std::vector<double> th(n, - 1);
+	std::vector<char> kept(n, 0);
+	bool overArea = false;
+	for (size_t a = 0; a < areas.size(); a ++) {
+		int k = areas[a];
+		kept[k] = 1;
+		if (s.tree.Area(k) > s.p.maxArea) {
+			overArea = true;
+			th[k] = s.p.areaCut * (s.tree.Max(k) - s.tree.Min(k)) + s.tree.Min(k);
+			LogSegDebug << "Threshold: " << th[k] << endl;
 		}
-		else {
-			it->second = (int)ID;
-			ID += 1.0;
+	}
+	if (!overArea)
+		return areas.size();
+
+	std::vector<int> sub(n, - 1);
+	for (int k = n - 1; k >= 0; k --) {
+		int a = top[k];
+		if (a < 0 || !kept[a])
+			continue;
+		if (th[a] < 0)
+			sub[k] = a;
+		else if (s.tree.Value(k) >= th[a]) {
+			int p = s.tree.Parent(k);
+			sub[k] = (p == k || s.tree.Value(p) < th[a]) ? k : sub[p];
 		}
-		it ++;
 	}
+	std::vector<int> split;
+	s.tree.Areas(sub, s.p.minSplit, split);
+	std::vector<int> label(n, 0);
+	for (size_t s = 0; s < split.size(); s ++)
+		label[split[s]] = s + 1;
+	double* o = ori->GetArray();
+	double* mk = mark->GetArray();
+	for (int k = 0; k < n; k ++) {
+		if (top[k] < 0 || !kept[top[k]])
+			continue;
+		int b = s.tree.Bin(k);
+		int l = sub[k] < 0 ? 0 : label[sub[k]];
+		mk[b] = l;
+		if (!l)
+			o[b] = 0;
+	}
+	return areas.size();
+}
 
-	ret = (int)ID;
+void FhtAna::AreaStats(const RunMask<Grid::Ext>& runs, const double* ori, const double* high, map<int, Area>& areas) {
+	// Area, inside/outside bins, bounding box and extrema of every label,
+	// the bins are visited in map scan order. With a high threshold map
+	// max skips the bins under it, and the high areas met are counted.
+	for (int i = 1; i <= Grid::nx; i ++) {
+		for (int r = runs.col[i]; r < runs.col[i + 1]; r ++) {
+			Area& a = areas[(int)runs.val[r]];
+			for (int j = runs.j0[r]; j <= runs.j1[r]; j ++) {
+				int b = Grid::Ext::Bin(i, j);
+				double val = ori[b];
+				double tmph = high ? high[b] : 0;
+				a.area ++;
+				if (Grid::Inside(i, j))
+					a.aIn ++;
+				else
+					a.aOut ++;
+				if (a.area == 1) {
+					a.st.Set((double)i, (double)j);
+					a.ed.Set((double)i, (double)j);
+					a.max = val;
+				}
+				else {
+					a.st.Set(i < a.st.X() ? i : a.st.X(), j < a.st.Y() ? j : a.st.Y());
+					a.ed.Set(i > a.ed.X() ? i : a.ed.X(), j > a.ed.Y() ? j : a.ed.Y());
+					if (!tmph)
+						a.max = val > a.max ? val : a.max;
+					a.min = val < a.min ? val : a.min;
+					a.hMax = val > a.hMax ? val : a.hMax;
+				}
+				if (tmph && tmph != a.lastMark)
+					a.nOL ++;
+				if (tmph)
+					a.lastMark = tmph;
+			}
+		}
+	}
+}
 
+int FhtAna::MarkConnection(TH2D* ori, int nx, int ny, TH2D* mark, int thr) {
+	// Areas of non-zero bins of ori, labelled on the runs of the map. Areas
+	// under thr bins are removed from ori, mark only keeps the new labels
+	double* o = ori->GetArray();
+	double* mk = mark->GetArray();
+	RunMask<Grid::Ext> runs;
+	runs.Scan(o, false);
+	std::vector<int> label;
+	int ret = runs.Label(thr, label);
+	std::fill(mk, mk + Grid::Ext::size, 0.);
 	for (int i = 1; i <= nx; i ++) {
-		for (int j = 1; j <= ny; j ++) {
-			double tmp = mark->GetBinContent(i, j);
-			if (tmp) {
-				mark->SetBinContent(i, j, count[parent[tmp]]);
-				if (!count[parent[tmp]])
-					ori->SetBinContent(i, j, 0);
+		for (int r = runs.col[i]; r < runs.col[i + 1]; r ++) {
+			for (int j = runs.j0[r]; j <= runs.j1[r]; j ++) {
+				int b = Grid::Ext::Bin(i, j);
+				mk[b] = label[r];
+				if (!label[r])
+					o[b] = 0;
 			}
 		}
 	}
-
-	// ret = AreaCut(ori, mark, nx, ny, 0.5);
-
 	return ret;
 }
 
-bool FhtAna::FindTrk(TVector3& inci, TVector3& dir, double& dis, double& ang, double& ti, TH2D* tMap, long int* mass) {
-	struct posFht {
-		double theta;
-		double phi;
-		double fht;
-		double mag;
-		double z;
-	};
-	vector<posFht> points;
-	double unit = PI / 100;
-	int nMass = 0;
-	for (int i  = 0; i < 4; i ++) {
-		if (mass[i])
-			nMass ++;
-		double mag = (int)(mass[i] / 1000000);
-		mass[i] = (int)(mass[i] % 1000000);
-		double the = (int)(mass[i] / 1000);
-		double phi = (int)(mass[i] % 1000);
-		double fht = tMap->GetBinContent(the, phi);
-		the *= unit;
-		phi = phi * unit - PI;
-		LogInfo << "mag: " << mag << "\ttheta: " << the << "\tphi: " << phi << "\tfht: " << fht << endl;
-		posFht pf;
-		pf.phi = phi;
-		pf.theta = the;
-		pf.fht = mass[i] == 0 ? 10000 : fht;
-		pf.mag = m_LSRadius;
-		TVector3 tmp;
-		tmp.SetMagThetaPhi(mag, the, phi);
-		pf.z = mass[i] == 0 ? INT_MIN : tmp.Z();
-		points.push_back(pf);
-		mass[i] = 0;
-	}
-	sort(points.begin(), points.end(), [](posFht p1, posFht p2) {
-		return p1.z > p2.z;
+bool FhtAna::FindTrk(Vec3& inci, Vec3& dir, double& dis, double& ang, double& ti, TH2D* tMap, const std::vector<Centroid>& centers) {
+	// Centroids from the top down, projected on the LS sphere
+	std::vector<Centroid> c(centers);
+	sort(c.begin(), c.end(), [](const Centroid& a, const Centroid& b) {
+		return a.r * a.u.Z() > b.r * b.u.Z();
 	});
-	vector<double> angs;
-	TVector3 p1, p2, p3, p4;
-	int ID = 0;
-	p1.SetMagThetaPhi(points[0].mag, points[0].theta, points[0].phi);
-	p2.SetMagThetaPhi(points[1].mag, points[1].theta, points[1].phi);
-	p3.SetMagThetaPhi(points[2].mag, points[2].theta, points[2].phi);
-	p4.SetMagThetaPhi(points[3].mag, points[3].theta, points[3].phi);
+	double unit = Grid::Unit();
+	int nMass = c.size();
+	Vec3 p[4];
+	for (int i = 0; i < nMass && i < 4; i ++) {
+		LogSegDebug << "u: " << c[i].u << "\tr: " << c[i].r << "\tq: " << c[i].q << endl;
+		p[i] = m_LSRadius * c[i].u;
+	}
+	const Vec3& p1 = p[0];
+	const Vec3& p2 = p[1];
+	const Vec3& p3 = p[2];
+	const Vec3& p4 = p[3];
 
 	if (nMass == 0) {
-		LogInfo << "No Track" << endl;
+		LogSegDebug << "No Track" << endl;
 		return true;
 	}	
 	else if (nMass == 1) {
-		TVector3 tmp = GetChargeCenter();
+		Vec3 tmp = GetChargeCenter();
 		dir = (tmp.Z() < p1.Z()) ? (tmp - p1).Unit() : (p1 - tmp).Unit();
 		// inci = (tmp.Z() < p1.Z()) ? PosOnLS(p1, dir, m_LSRadius, -1) : PosOnLS(tmp, dir, m_LSRadius, -1);
 		inci = PosOnLS(p1, dir, m_LSRadius, -1);
@@ -1408,10 +2517,10 @@ bool FhtAna::FindTrk(TVector3& inci, TVector3& dir, double& dis, double& ang, do
 		dir = (p1.Z() < p2.Z()) ? (p1 - p2).Unit() : (p2 - p1).Unit();
 		// inci = p1.Z() < p2.Z() ? PosOnLS(p2, dir, m_LSRadius, -1) : PosOnLS(p1, dir, m_LSRadius, -1);
 		inci = PosOnLS(p1, dir, m_LSRadius, -1);
-		TVector3 tmp = GetChargeCenter();
+		Vec3 tmp = GetChargeCenter();
 		tmp = tmp - (inci + dir * (tmp - inci) * inci);
 		dis = tmp.Mag() * 2;
-		TVector3 ori(0, dir.Z(), -dir.Y());
+		Vec3 ori(0, dir.Z(), -dir.Y());
 		ang = tmp.Angle(ori);
 		ori.Rotate(ang, dir);
 		if (tmp.Angle(ori) > 0.2)
@@ -1420,40 +2529,40 @@ bool FhtAna::FindTrk(TVector3& inci, TVector3& dir, double& dis, double& ang, do
 		return true;
 	}
 	else if (nMass == 3) {
-		TVector3 d1, d2, d3;
+		Vec3 d1, d2, d3;
 		d1 = p1 - p2;
 		d2 = p2 - p3;
 		d3 = p3 - p1;
 		double a1, a2, a3;
-		a1 = fabs(d1.Angle(TVector3(0, 0, -1)));
+		a1 = fabs(d1.Angle(Vec3(0, 0, -1)));
 		a1 = (a1 > PI / 2) ? PI - a1 : a1;
-		a2 = fabs(d2.Angle(TVector3(0, 0, -1)));
+		a2 = fabs(d2.Angle(Vec3(0, 0, -1)));
 		a2 = (a2 > PI / 2) ? PI - a2 : a2;
-		a3 = fabs(d3.Angle(TVector3(0, 0, -1)));
+		a3 = fabs(d3.Angle(Vec3(0, 0, -1)));
 		a3 = (a3 > PI / 2) ? PI - a3 : a3;
 		int i;
-		TVector3 tmp;
+		Vec3 tmp;
 		if (a1 < a2 && a1 < a3) {
-			dir = (d1 * TVector3(0, 0, -1) > 0) ? d1 : - d1;
+			dir = (d1 * Vec3(0, 0, -1) > 0) ? d1 : - d1;
 			dir = dir.Unit();
 			inci = PosOnLS(p1, dir, m_LSRadius, -1);
 			tmp = p3 - (inci + dir * (p3 - inci) * dir);
 		}
 		else if (a2 < a1 && a2 < a3) {
-			dir = (d2 * TVector3(0, 0, -1) > 0) ? d2 : - d2;
+			dir = (d2 * Vec3(0, 0, -1) > 0) ? d2 : - d2;
 			dir = dir.Unit();
 			inci = PosOnLS(p3, dir, m_LSRadius, -1);
 			tmp = p1 - (inci + dir * (p1 - inci) * dir);
 		}
 		else if (a3 < a1 && a3 < a2) {
-			dir = (d3 * TVector3(0, 0, -1) > 0) ? d3 : - d3;
+			dir = (d3 * Vec3(0, 0, -1) > 0) ? d3 : - d3;
 			dir = dir.Unit();
 			inci = PosOnLS(p1, dir, m_LSRadius, -1);
 			tmp = p2 - (inci + dir * (p2 - inci) * dir);
 		}
 		dis = tmp.Mag();
 		ti = tMap->GetBinContent(inci.Theta() / unit, (inci.Phi() + PI) / unit);
-		TVector3 ori(0, dir.Z(), - dir.Y());
+		Vec3 ori(0, dir.Z(), - dir.Y());
 		ang = tmp.Angle(ori);
 		ori.Rotate(ang, dir);
 		if (tmp.Angle(ori) > 0.2)
@@ -1462,7 +2571,7 @@ bool FhtAna::FindTrk(TVector3& inci, TVector3& dir, double& dis, double& ang, do
 	}
 	else if (nMass == 4) {
 		double a1, a2, a3;
-		TVector3 tmp;
+		Vec3 tmp;
 		a1 = fabs((p1 - p2).Angle(p3 - p4));
 		a1 = (a1 > PI / 2) ? PI - a1 : a1;
 		a2 = fabs((p1 - p3).Angle(p2 - p4));
@@ -1471,28 +2580,28 @@ bool FhtAna::FindTrk(TVector3& inci, TVector3& dir, double& dis, double& ang, do
 		a3 = (a3 > PI / 2) ? PI - a3 : a3;
 		if (a1 < a2 && a1 < a3) {
 			dir = p1 - p2;
-			dir = (dir * TVector3(0, 0, -1) > 0) ? dir : - dir;
+			dir = (dir * Vec3(0, 0, -1) > 0) ? dir : - dir;
 			dir = dir.Unit();
 			inci = PosOnLS(p1, dir, m_LSRadius, -1);
 			tmp = p3 - (inci + dir * (p3 - inci) * dir);
 		}
 		else if (a2 < a1 && a2 < a3) {
 			dir = p1 - p3;
-			dir = (dir * TVector3(0, 0, -1) > 0) ? dir : - dir;
+			dir = (dir * Vec3(0, 0, -1) > 0) ? dir : - dir;
 			dir = dir.Unit();
 			inci = PosOnLS(p1, dir, m_LSRadius, -1);
 			tmp = p2 - (inci + dir * (p3 - inci) * dir);
 		}
 		else if (a3 < a1 && a3 < a2) {
 			dir = p1 - p4;
-			dir = (dir * TVector3(0, 0, -1) > 0) ? dir : - dir;
+			dir = (dir * Vec3(0, 0, -1) > 0) ? dir : - dir;
 			dir = dir.Unit();
 			inci = PosOnLS(p1, dir, m_LSRadius, -1);
 			tmp = p2 - (inci + dir * (p2 - inci) * dir);
 		}
 		dis = tmp.Mag();
 		ti = tMap->GetBinContent(inci.Theta() / unit, (inci.Phi() + PI) / unit);
-		TVector3 ori(0, dir.Z(), - dir.Y());
+		Vec3 ori(0, dir.Z(), - dir.Y());
 		ang = tmp.Angle(ori);
 		ori.Rotate(ang, dir);
 		if (tmp.Angle(ori) > 0.2)
@@ -1500,217 +2609,68 @@ bool FhtAna::FindTrk(TVector3& inci, TVector3& dir, double& dis, double& ang, do
 		return true;
 	}
 	else {
-		LogInfo << "Find trk fail" << endl;
+		LogSegDebug << "Find trk fail" << endl;
 		return false;
 	}
 }
 
-bool FhtAna::ChooseCut(TH2D* ori, TH1D* q, int nx, int ny) {
-	for (int i = 1; i <= nx; i ++) {
-		for (int j = 1; j <= ny; j ++) {
+bool FhtAna::ChooseCut(TH2D* ori, TH1D* q) {
+	for (int i = 1; i <= Grid::nx; i ++) {
+		for (int j = 1; j <= Grid::ny; j ++) {
 			q->Fill(ori->GetBinContent(i, j));
 		}
 	}
 	return true;
 }
 
-bool FhtAna::Expansion(TH2D* ori, int nx, int ny) {
+template <class S>
+bool FhtAna::Expansion(TH2D* ori, int n) {
 	if (ori == NULL) {
 		LogInfo << "The map is NULL" << endl;
 		return false;
 	}
-	// LogInfo << "------------------------------ Expanding ------------------------------" << endl;
-	TH2D* cp = (TH2D*)ori->Clone("tmpCp");
-	for (int i = 1; i <= nx; i ++) {
-		for (int j = 1; j <= ny; j ++) {
-			if (cp->GetBinContent(i, j))
-				continue;
-			double sum = 0;
-			double max = 0;
-			int n = 0;
-			if (i > 1 && cp->GetBinContent(i - 1, j)) {
-				sum += cp->GetBinContent(i - 1, j);
-				max = cp->GetBinContent(i - 1, j) > max ? cp->GetBinContent(i - 1, j) : max;
-				n ++;
-			}
-			if (i < nx && cp->GetBinContent(i + 1, j)) {
-				sum += cp->GetBinContent(i + 1, j);
-				max = cp->GetBinContent(i + 1, j) > max ? cp->GetBinContent(i + 1, j) : max;
-				n ++;
-			}
-			if (j > 1 && cp->GetBinContent(i, j - 1)) {
-				sum += cp->GetBinContent(i, j - 1);
-				max = cp->GetBinContent(i, j - 1) > max ? cp->GetBinContent(i, j - 1) : max;
-				n ++;
-			}
-			if (j < ny && cp->GetBinContent(i, j + 1)) {
-				sum += cp->GetBinContent(i, j + 1);
-				max = cp->GetBinContent(i, j + 1) > max ? cp->GetBinContent(i, j + 1) : max;
-				n ++;
-			}
-			if (i > 1 && j > 1 && cp->GetBinContent(i - 1, j - 1)) {
-				sum += cp->GetBinContent(i - 1, j - 1);
-				max = cp->GetBinContent(i - 1, j - 1) > max ? cp->GetBinContent(i - 1, j - 1) : max;
-				n ++;
-			}
-			if (i > 1 && j < ny && cp->GetBinContent(i - 1, j + 1)) {
-				sum += cp->GetBinContent(i - 1, j + 1);
-				max = cp->GetBinContent(i - 1, j + 1) > max ? cp->GetBinContent(i - 1, j + 1) : max;
-				n ++;
-			}
-			if (i < nx && j > 1 && cp->GetBinContent(i + 1, j - 1)) {
-				sum += cp->GetBinContent(i + 1, j - 1);
-				max = cp->GetBinContent(i + 1, j - 1) > max ? cp->GetBinContent(i + 1, j - 1) : max;
-				n ++;
-			}
-			if (i < nx && j < ny && cp->GetBinContent(i + 1, j + 1)) {
-				sum += cp->GetBinContent(i + 1, j + 1);
-				max = cp->GetBinContent(i + 1, j + 1) > max ? cp->GetBinContent(i + 1, j + 1) : max;
-				n ++;
-			}
-			if (n) {
-				// ori->SetBinContent(i, j, max);
-				ori->SetBinContent(i, j, sum / n);
-			}
-		}
-	}
+	MapKernel<S>::Expansion(ori->GetArray(), n);
 	return true;
 }
-bool FhtAna::RMSMap(TH2D* ori, TH2D* rms, int nx, int ny, int u, int len, double thr) {
+template <class S, int U, int R>
+bool FhtAna::RMSMap(TH2D* ori, TH2D* rms) {
 	if (ori == NULL) {
 		LogInfo << "The map is NULL" << endl;
 		return false;
 	}
-	/*
-	for (int i = 11; i <= nx - 10; i ++) {
-		for (int j = 11; j <= ny - 10; j ++) {
-			double sum = ori->Integral(i - 5, i + 5, j - 5, j + 5);
-			double ave = sum / 121;
-			sum = 0;
-			for (int k = i - 5; k <= i + 5; k ++)
-				for (int l = j - 5; l <= j + 5; l ++)
-					sum += TMath::Power(ave - ori->GetBinContent(k, l), 2);
-			sum /= 121;
-			rms->SetBinContent(i - 10, j - 10, TMath::Sqrt(sum));
-		}
-	}
-	*/
-	for (int i = u + 1; i <= nx - u; i ++) {
-		for (int j = u + 1; j <= ny - u; j ++) {
-			double sum = 0;
-			TVector2 ave;
-			double p = 0;
-			double sig = 0;
-			double tmp = ori->GetBinContent(i, j);
-			// sum += ori->GetBinContent(i, j) - ori->GetBinContent(i - 5, j);
-			// sum += ori->GetBinContent(i, j) - ori->GetBinContent(i + 5, j);
-			// sum += ori->GetBinContent(i, j) - ori->GetBinContent(i, j - 5);
-			// sum += ori->GetBinContent(i, j) - ori->GetBinContent(i, j + 5);
-/*
-			for (int k = i - len; k <= i + len; k ++) {
-				for (int l = j - len; l <= j + len; l ++) {
-					double coe = len - TMath::Abs(i - k) + 1;
-					if (coe > (len - TMath::Abs(j - l) + 1))
-						coe = len - TMath::Abs(j - l) + 1;
-					sum += ori->GetBinContent(k, l) * coe;
-					coes += coe;
-				}
-			}
-			sum /= coes;
-*/
-			for (int k = i - len; k <= i + len; k ++) {
-				for (int l = j - len; l <= j + len; l ++) {
-					ave += ori->GetBinContent(k, l) * TVector2(k, l);
-					sum += ori->GetBinContent(k, l);
-				}
-			}
-			ave /= sum;
-			for (int k = i - len; k <= i + len; k ++) {
-				for (int l = j - len; l <= i + len; l ++) {
-					TVector2 tmpv(k, l);
-					p += ori->GetBinContent(k, l) * TMath::Power((tmpv - ave).Mod(), 4);
-					sig += ori->GetBinContent(k, l) * TMath::Power((tmpv - ave).Mod(), 2);
-				}
-			}
-			p /= sum;
-			sig = TMath::Power(sig / sum, 2);
-
-			rms->SetBinContent(i - u, j - u, sum);
-			// rms->SetBinContent(i - u, j - u, sum > thr ? sum : 0);
-			// if (ori->GetBinContent(i, j) == 200000)
-			// 	rms->SetBinContent(i - 10, j - 10, 0);
-		}
-	}
+	// Local charge sum over the (2R + 1)^2 window
+	MapKernel<S>::template BoxSum<U, R>(ori->GetArray(), rms->GetArray());
 	return true;
 }
 
-bool FhtAna::MapExtend(TH2D* ret, TH2D* h, int nx, int ny) {
+bool FhtAna::MapExtend(TH2D* ret, TH2D* h) {
 	if (h == NULL || ret == NULL) {
 		LogInfo << "The map is NULL" << endl;
 		return false;
 	}
-	double unit = PI / nx;
-	for (int i = 1; i <= nx; i ++)
-		for (int j = 1; j <= ny; j ++)
-			ret->SetBinContent(i + 10, j + 10, h->GetBinContent(i, j));
-	for (int i = 1; i <= ny; i ++) {
-		int pos = (i == 100 ? 1 : (i < 100 ? i + 100 : i - 100));
-		for (int j = 1; j <= 10; j ++)
-			ret->SetBinContent(j, i + 10, h->GetBinContent(11 - j, pos));
-		for (int j = nx + 11; j <= nx + 20; j ++)
-			ret->SetBinContent(j, i + 10, h->GetBinContent(nx - (j - nx - 11), pos));
-	}
-	for (int i = 1; i <= nx + 20; i ++) {
-		for (int j = 1; j <= 10; j ++) {
-			ret->SetBinContent(i, j, ret->GetBinContent(i, j + ny));
-			ret->SetBinContent(i, ny + 10 + j, ret->GetBinContent(i, j + 10));
-		}
-	}
+	const double* in = h->GetArray();
+	double* out = ret->GetArray();
+	const int* alias = &m_bins.alias[0];
+	for (int e = 0; e < Grid::Ext::size; e ++)
+		if (alias[e] >= 0)
+			out[e] = in[alias[e]];
 	return true;
 }
 
-bool FhtAna::Pool(TH2D* ori, TH2D* pool, int nx, int ny, int s) {
+bool FhtAna::Pool(TH2D* ori, TH2D* pool) {
 	if (ori == NULL) {
 		LogInfo << "The map is NULL" << endl;
 		return false;
 	}
-	nx /= s;
-	ny /= s;
-	for (int i = 1; i <= nx; i ++) {
-		for (int j = 1; j <= ny; j ++) {
-			double sum = 0;
-			for (int k = (i - 1) * s + 1; k <= i * s; k ++) {
-				for (int l = (j - 1) * s + 1; l <= j * s; l ++) {
-					sum += ori->GetBinContent(k, l);
-				}
-			}
-			pool->SetBinContent(i, j, sum);
-		}
-	}
+	MapKernel<Grid::Ext>::Pool<Grid::pool>(ori->GetArray(), pool->GetArray());
 	return true;
 }
 
-bool FhtAna::XOR(TH2D* a, TH2D* b, int nx, int ny) {
-	// a is the map of low threshold, b is the map of high threshold
-	if (!a || !b) {
-		LogInfo << "Input map is NULL" << endl;
-		return false;
-	}
-	for (int i = 1; i <= nx; i ++) {
-		for (int j = 1; j <= ny; j ++) {
-			double tmpa = a->GetBinContent(i, j);
-			double tmpb = b->GetBinContent(i, j);
-			a->SetBinContent(i, j, ((!tmpa && tmpb) || (tmpa && !tmpb)) ? (tmpa ? tmpa : tmpb) : 0);
-		}
-	}
-	return a;
-}
-
-TH2D* FhtAna::Combine(TH2D* a, TH2D* b, int nx, int ny) {
+bool FhtAna::Combine(TH2D* a, TH2D* b, TH2D* ret, int minSize) {
 	// Combine the map a & b, if the connection area partially overlap, perform AND, or perform OR
-	if (!a || !b) {
+	if (!a || !b || !ret) {
 		LogInfo << "Input map is NULL" << endl;
-		return NULL;
+		return false;
 	}
 
 	// map<int, int> marks;
@@ -1740,416 +2700,399 @@ TH2D* FhtAna::Combine(TH2D* a, TH2D* b, int nx, int ny) {
 	// }
 	// return ret;
 
-	TString name("Combine");
-	name += a->GetName();
-	name += b->GetName();
-	TH2D* ret = new TH2D(name, "", nx, 0, 1.1 * PI, ny, -1.1 * PI, 1.1 * PI);
-	for (int i = 1; i <= nx; i ++) {
-		for (int j = 1; j <= ny; j ++) {
-			double tmpa = a->GetBinContent(i, j);
-			double tmpb = b->GetBinContent(i, j);
-			a->SetBinContent(i, j, tmpa + tmpb);
-		}
-	}
-	MarkConnection(a, nx, ny, ret, 5);
-	return ret;
+	// Areas of a + b, the sum is only seen through the runs. ret comes
+	// empty, only the labelled bins are written
+	RunMask<Grid::Ext> runs;
+	runs.Scan(MapRef(a->GetArray()) + MapRef(b->GetArray()), false);
+	std::vector<int> label;
+	runs.Label(minSize, label);
+	double* mk = ret->GetArray();
+	for (int i = 1; i <= Grid::nx; i ++)
+		for (int r = runs.col[i]; r < runs.col[i + 1]; r ++)
+			for (int j = runs.j0[r]; j <= runs.j1[r]; j ++)
+				mk[Grid::Ext::Bin(i, j)] = label[r];
+	return true;
 }
 
-bool FhtAna::AND(TH2D* ori, TH2D* co, int nx, int ny) {
-	if (!ori || !co) {
+bool FhtAna::GetCenterPos(TH2D* ori, TH2D* mark, int nx, int ny, std::vector<Centroid>& centers) {
+	centers.clear();
+	if (!ori || !mark) {
 		LogInfo << "Input map is NULL" << endl;
 		return false;
 	}
-	TString name("Mask");
-	name += ori->GetName();
-	TH2D* ret = new TH2D(name, "", nx, 0, 1.1 * PI, ny, -1.1 * PI, 1.1 * PI);
-	for (int i = 1; i <= nx; i ++) {
-		for (int j = 1; j <= ny; j ++) {
-			double tmpa = ori->GetBinContent(i, j);
-			double tmpb = co->GetBinContent(i, j);
-			ori->SetBinContent(i, j, (tmpa && tmpb) ? tmpa : 0);
+	map<int, Vec3> qp;
+	map<int, double> q;
+	map<int, int> area;
+	// Every fired PMT adds its bin and the halo bins copying it
+	const double* o = ori->GetArray();
+	const double* mk = mark->GetArray();
+	for (int i = 0; i < totPmtNum; i ++) {
+		if (!m_ptab[i].used)
+			continue;
+		for (int k = m_bins.extOffset[i]; k < m_bins.extOffset[i + 1]; k ++) {
+			int b = m_bins.extBin[k];
+			double tmp = mk[b];
+			if (tmp) {
+				qp[(int)tmp] += o[b] * m_ptab[i].pos;
+				q[(int)tmp] += o[b];
+				area[(int)tmp] ++;
+			}
+		}
+	}
+
+	// An area near a pole seen again across the seam of the halo is the
+	// same footprint, the larger copy is kept. theta < 0.314 or > 2.826 is
+	// read from the z of the centroid.
+	const double cosN = cos(0.314);
+	const double cosS = cos(2.826);
+	std::vector<Vec3> pos;
+	std::vector<int> size;
+	map<int, Vec3>::iterator qpIt = qp.begin();
+	map<int, double>::iterator qIt = q.begin();
+	for (; qpIt != qp.end() && centers.size() < 4; qpIt ++, qIt ++) {
+		LogSegDebug << "The " << qpIt->first << "th mass." << endl;
+		Vec3 p = 1 / qIt->second * qpIt->second;
+		double r = p.Mag();
+		int a = area[qpIt->first];
+		size_t k = 0;
+		for (; k < pos.size(); k ++) {
+			double rk = centers[k].r;
+			if ((p - pos[k]).Mag() < 3000 &&
+				((p.Z() > cosN * r && pos[k].Z() > cosN * rk) ||
+				 (p.Z() < cosS * r && pos[k].Z() < cosS * rk)))
+				break;
+		}
+		Centroid c;
+		c.u = p.Unit();
+		c.r = r;
+		c.q = qIt->second;
+		if (k == pos.size()) {
+			centers.push_back(c);
+			pos.push_back(p);
+			size.push_back(a);
+		}
+		else if (size[k] < a) {
+			centers[k] = c;
+			pos[k] = p;
+			size[k] = a;
 		}
 	}
+
+	for (size_t i = 0; i < centers.size(); i ++)
+		LogSegDebug << "center[" << i << "]: " << centers[i].u << "\tr: " << centers[i].r << endl;
 	return true;
 }
 
-bool FhtAna::UnionCut(TH2D* l, TH2D* h, TH2D* ori, int nx, int ny, double thr, TH2D* test1) {
-	if (!l || !h) {
-		LogInfo << "Input map is NULL" << endl;
-		return false;
+bool FhtAna::OverBudget() const {
+	return m_timeBudget > 0 && std::chrono::steady_clock::now() > m_deadline;
+}
+
+void FhtAna::CoarseFallback() {
+	// Over budget before the segmentation, the centroids come off the
+	// pooled sky cells and the dense stages left are skipped
+	LogDebug << "Over the time budget, coarse centroids" << endl;
+	CoarseCenters(m_centers);
+	m_degraded |= _DEGCOARSE;
+	const char* dense[] = {"Expansion", "Smooth", "CoarseRMS", "RMS", "ChargeSpectrum",
+						   "Threshold", "Label", "Segment", "Centers", "Sweep"};
+	for (size_t i = 0; i < sizeof(dense) / sizeof(dense[0]); i ++)
+		m_pipe.Skip(dense[i]);
+}
+
+bool FhtAna::CoarseCenters(std::vector<Centroid>& centers) {
+	// Areas of the pooled sky cells over the low threshold, each centroid
+	// from the PMTs of its cells. The coarse map has no halo, so areas
+	// meeting across the phi seam or around a pole are joined here, and
+	// the 4 brightest are kept as GetCenterPos() would.
+	typedef Grid::CoarseBase C;
+	centers.clear();
+	m_cellQ.assign(C::size, 0);
+	m_cellP.assign(C::size, Vec3());
+	for (unsigned int pid = 0; pid < totPmtNum; pid ++) {
+		if (!m_ptab[pid].used)
+			continue;
+		int c = m_bins.coarseCell[pid];
+		int b = C::Bin(c % C::nx + 1, c / C::nx + 1);
+		m_cellQ[b] += m_ptab[pid].q;
+		m_cellP[b] += m_ptab[pid].q * m_ptab[pid].pos;
 	}
-	TH2D* H = (TH2D*)h->Clone("CloneH");
-	for (int i = 0; i < 13; i ++)
-		Expansion(H, 120, 220);
-	if (!Expansion(H, 120, 220)) {
-		LogInfo << "Error in Expansion()" << endl;
+	double peak = MapKernel<C>::Max(&m_cellQ[0]);
+	if (peak <= 0)
 		return false;
-	}
-
-	for (int i = 1; i <= nx; i ++)
-		for (int j = 1; j <= ny; j ++)
-			test1->SetBinContent(i, j, H->GetBinContent(i, j));
-
-	struct Area {
-		int area = 0;
-		double aIn = 0;
-		double aOut = 0;
-		double max = 0;
-		TVector2 st;
-		TVector2 ed;
-		double nOL = 0;
-		double lastMark = 0;
-		double hMax = 0;
+	RunMask<C> runs;
+	runs.Scan(Over(MapRef(&m_cellQ[0]), m_seg.p.lFrac * peak), false);
+	std::vector<int> label;
+	int n = runs.Label(1, label);
+	std::vector<int> cellLabel(C::size, 0);
+	for (int i = 1; i <= C::nx; i ++)
+		for (int r = runs.col[i]; r < runs.col[i + 1]; r ++)
+			for (int j = runs.j0[r]; j <= runs.j1[r]; j ++)
+				cellLabel[C::Bin(i, j)] = label[r];
+	// The smaller label stays the root
+	std::vector<int> root(n);
+	for (int l = 0; l < n; l ++)
+		root[l] = l;
+	auto find = [&root](int l) {
+		while (root[l] != l)
+			l = root[l] = root[root[l]];
+		return l;
 	};
-	LogInfo << "Checking..." << endl;
-	map<int, struct Area> areas;
-	for (int i = 1; i <= nx; i ++) {
-		for (int j = 1; j <= ny; j ++) {
-			double tmpl = l->GetBinContent(i, j);
-			if (tmpl) {
-				double tmph = H->GetBinContent(i, j);
-				double val = ori->GetBinContent(i, j);
-				areas[(int)tmpl].area ++;
-				if (i >= 11 && i <= nx - 10 && j >= 11 && j <= ny - 10)
-					areas[(int)tmpl].aIn ++;
-				else
-					areas[(int)tmpl].aOut ++;
-				if (areas[(int)tmpl].area == 1) {
-					areas[(int)tmpl].st.Set((double)i, (double)j);
-					areas[(int)tmpl].ed.Set((double)i, (double)j);
-					areas[(int)tmpl].max = val;
-				}
-				else {
-					TVector2 ST = areas[(int)tmpl].st;
-					TVector2 ED = areas[(int)tmpl].ed;
-					areas[(int)tmpl].st.Set(i < ST.X() ? i : ST.X(), j < ST.Y() ? j : ST.Y());
-					areas[(int)tmpl].ed.Set(i > ED.X() ? i : ED.X(), j > ED.Y() ? j : ED.Y());
-					if (!tmph)
-						areas[(int)tmpl].max = val > areas[(int)tmpl].max ? val : areas[(int)tmpl].max;
-					areas[(int)tmpl].hMax = val > areas[(int)tmpl].hMax ? val : areas[(int)tmpl].hMax;
-				}
-				if (tmph && tmph != areas[(int)tmpl].lastMark)
-					areas[(int)tmpl].nOL ++;
-				if (tmph)
-					areas[(int)tmpl].lastMark = tmph;
-			}
+	auto join = [&](int a, int b) {
+		if (!a || !b)
+			return;
+		a = find(a);
+		b = find(b);
+		if (a != b)
+			root[std::max(a, b)] = std::min(a, b);
+	};
+	for (int i = 1; i <= C::nx; i ++)
+		join(cellLabel[C::Bin(i, 1)], cellLabel[C::Bin(i, C::ny)]);
+	// Every cell of the first and last theta row touches its pole
+	const int pole[] = {1, C::nx};
+	for (int k = 0; k < 2; k ++) {
+		int first = 0;
+		for (int j = 1; j <= C::ny; j ++) {
+			int l = cellLabel[C::Bin(pole[k], j)];
+			if (!first)
+				first = l;
+			join(first, l);
 		}
 	}
+	std::vector<double> q(n, 0);
+	std::vector<Vec3> qp(n);
+	for (int b = 0; b < C::size; b ++) {
+		if (!cellLabel[b])
+			continue;
+		int l = find(cellLabel[b]);
+		q[l] += m_cellQ[b];
+		qp[l] += m_cellP[b];
+	}
+	std::vector<int> order;
+	for (int l = 1; l < n; l ++)
+		if (q[l] > 0)
+			order.push_back(l);
+	std::stable_sort(order.begin(), order.end(), [&q](int a, int b) { return q[a] > q[b]; });
+	for (size_t k = 0; k < order.size() && centers.size() < 4; k ++) {
+		int l = order[k];
+		Vec3 p = 1 / q[l] * qp[l];
+		Centroid c;
+		c.u = p.Unit();
+		c.r = p.Mag();
+		c.q = q[l];
+		centers.push_back(c);
+	}
+	LogDebug << "Coarse centroids: " << centers.size() << endl;
+	return true;
+}
 
-	LogInfo << "Processing..." << endl;
-	map<int, Area>::iterator it = areas.begin();
-	bool overArea = false;
-	while (it != areas.end()) {
-		// XOR & AreaCut
-		LogInfo << "n overlap: " << (it->second).nOL << endl;
-		if ((it->second).area > 200 && (it->second).nOL >= 2) {
-			overArea = true;
-			double th = thr * (it->second).max;
-			if ((it->second).max < 0.7 * (it->second).hMax)
-				th = (it->second).hMax * 0.7;
-			LogInfo << "Threshold: " << th << endl;
-			for (int i = (it->second).st.X(); i <= (it->second).ed.X(); i ++) {
-				for (int j = (it->second).st.Y(); j <= (it->second).ed.Y(); j ++) {
-					double tmpl = l->GetBinContent(i, j);
-					double tmph = H->GetBinContent(i, j);
-					if (tmpl && tmph) {
-						l->SetBinContent(i, j, 0);
-						ori->SetBinContent(i, j, 0);
-					}
-					double tmp = ori->GetBinContent(i, j);
-					if (tmp && tmp < th && tmpl == it->first) {
-						ori->SetBinContent(i, j, 0);
-						l->SetBinContent(i, j, 0);
-					}
-				}
-			}
-		}
-		if ((it->second).area > 300 && (it->second).nOL == 1) {
-			overArea = true;
-			double th = thr * (it->second).max;
-			if ((it->second).max < 0.65 * (it->second).hMax)
-				th = (it->second).hMax * 0.5;
-			LogInfo << "Threshold: " << th << endl;
-			for (int i = (it->second).st.X(); i <= (it->second).ed.X(); i ++) {
-				for (int j = (it->second).st.Y(); j <= (it->second).ed.Y(); j ++) {
-					double tmpl = l->GetBinContent(i, j);
-					double tmph = H->GetBinContent(i, j);
-					if (tmpl && tmph) {
-						l->SetBinContent(i, j, 0);
-						ori->SetBinContent(i, j, 0);
-					}
-					double tmp = ori->GetBinContent(i, j);
-					if (tmp && tmp < th && tmpl == it->first) {
-						ori->SetBinContent(i, j, 0);
-						l->SetBinContent(i, j, 0);
-					}
-				}
-			}
-		}
-		it ++;
-	}
+double FhtAna::FHTPredict(const PmtProp& pmt, const Vec3& inci, const Vec3& dir, double ti) {
+	double nLS = 1.485;
+	double cLight = 299.;
+	double vMuon = 299.;
+	double nW = 1.34;
 
-	if (overArea) {
-		for (int i = 1; i <= nx; i ++)
-			for (int j = 1; j <= ny; j ++)
-				l->SetBinContent(i, j, 0);
-		MarkConnection(ori, nx, ny, l, 10);
-	}
-	else
-		return true;
+	double tan = TMath::Sqrt(nW * nW - 1);
 
-	map<int, struct Area> Areas;
-	for (int i = 1; i <= nx; i ++) {
-		for (int j = 1; j <= ny; j ++) {
-			double tmpl = l->GetBinContent(i, j);
-			if (tmpl) {
-				double tmph = H->GetBinContent(i, j);
-				double val = ori->GetBinContent(i, j);
-				Areas[(int)tmpl].area ++;
-				if (i >= 11 && i <= nx - 10 && j >= 11 && j <= ny - 10)
-					Areas[(int)tmpl].aIn ++;
-				else
-					Areas[(int)tmpl].aOut ++;
-				if (Areas[(int)tmpl].area == 1) {
-					Areas[(int)tmpl].st.Set((double)i, (double)j);
-					Areas[(int)tmpl].ed.Set((double)i, (double)j);
-					Areas[(int)tmpl].max = val;
-				}
-				else {
-					TVector2 ST = Areas[(int)tmpl].st;
-					TVector2 ED = Areas[(int)tmpl].ed;
-					Areas[(int)tmpl].st.Set(i < ST.X() ? i : ST.X(), j < ST.Y() ? j : ST.Y());
-					Areas[(int)tmpl].ed.Set(i > ED.X() ? i : ED.X(), j > ED.Y() ? j : ED.Y());
-					if (!tmph)
-						Areas[(int)tmpl].max = val > Areas[(int)tmpl].max ? val : Areas[(int)tmpl].max;
-				}
-				if (tmph != Areas[(int)tmpl].lastMark)
-					Areas[(int)tmpl].nOL ++;
-				Areas[(int)tmpl].lastMark = tmph;
+	Vec3 perp = inci + dir * (pmt.pos - inci) * dir;
+
+	Vec3 liSource = perp - (pmt.pos - perp).Mag() / tan * dir;
+
+	Vec3 liDir = pmt.pos - liSource;
+
+	double dis = TMath::Sqrt(TMath::Power(pmt.pos.Mag(), 2) - TMath::Power(pmt.pos * liDir.Unit(), 2));
+
+	return ti + (liSource - inci) * dir / vMuon + (pmt.pos - liSource).Mag() * nW / cLight;
+}
+
+bool FhtAna::ReconGraph(const SkyGraph& g, const std::vector<int>& pmtNode, int nExpand, int nSmooth, int nSum, const SegParams& p, int size, std::vector<Centroid>& centers) {
+	int n = g.size();
+	std::vector<double> q(n, 0);
+	std::vector<int> cnt(n, 0);
+	std::vector<Vec3> qPos(n);
+	for (unsigned int i = 0; i < totPmtNum; i ++) {
+		if (!m_ptab[i].used)
+			continue;
+		q[pmtNode[i]] += m_ptab[i].q;
+		qPos[pmtNode[i]] += m_ptab[i].q * m_ptab[i].pos;
+		cnt[pmtNode[i]] ++;
+	}
+	std::vector<double> qSum(q);
+	for (int i = 0; i < n; i ++)
+		if (cnt[i])
+			q[i] /= cnt[i];
+
+	// Nodes holding a PMT need no filling, a PMT graph skips the expansion
+	for (int i = 0; i < nExpand; i ++)
+		GraphExpansion(g, q);
+	GraphSmooth(g, q, nSmooth);
+
+	// Local charge sum, the counterpart of RMSMap()
+	std::vector<double> rms(q);
+	GraphSmooth(g, rms, nSum);
+	double peak = *std::max_element(rms.begin(), rms.end());
+
+	std::vector<int> high, low;
+	GraphLabel(g, rms, p.hFrac * peak, high, size);
+	GraphLabel(g, rms, p.lFrac * peak, low, size);
+	GraphSplit(g, low, high);
+	return GetGraphCenters(g, q, low, qSum, qPos, centers);
+}
+
+bool FhtAna::GraphExpansion(const SkyGraph& g, std::vector<double>& val) {
+	std::vector<double> cp(val);
+	for (int i = 0; i < g.size(); i ++) {
+		if (cp[i])
+			continue;
+		double sum = 0;
+		int n = 0;
+		for (int k = g.begin(i); k < g.end(i); k ++) {
+			if (cp[g.adj[k]]) {
+				sum += cp[g.adj[k]];
+				n ++;
 			}
 		}
+		if (n)
+			val[i] = sum / n;
 	}
+	return true;
+}
 
-	overArea = false;
-	it = Areas.begin();
-	while (it != Areas.end()) {
-		// Delete the area near the edge
-		if ((it->second).aIn < (it->second).aOut) {
-			overArea = true;
-			LogInfo << "Cut outside..." << endl;
-			for (int i = (it->second).st.X(); i <= (it->second).ed.X(); i ++) {
-				for (int j = (it->second).st.Y(); j <= (it->second).ed.Y(); j ++) {
-					double tmpl = l->GetBinContent(i, j);
-					if (tmpl == it->first) {
-						ori->SetBinContent(i, j, 0);
-						l->SetBinContent(i, j, 0);
-					}
-				}
-			}
+bool FhtAna::GraphSmooth(const SkyGraph& g, std::vector<double>& val, int nturn) {
+	std::vector<double> cp(val.size());
+	for (int t = 0; t < nturn; t ++) {
+		cp.swap(val);
+		for (int i = 0; i < g.size(); i ++) {
+			double sum = cp[i];
+			for (int k = g.begin(i); k < g.end(i); k ++)
+				sum += cp[g.adj[k]];
+			val[i] = sum / (g.end(i) - g.begin(i) + 1);
 		}
-		it ++;
-	}
-	LogInfo << "Marking..." << endl;
-	if (overArea) {
-		for (int i = 1; i <= nx; i ++)
-			for (int j = 1; j <= ny; j ++)
-				l->SetBinContent(i, j, 0);
 	}
 	return true;
 }
 
-long int* FhtAna::GetCenterPos(TH2D* ori, TH2D* mark, int nx, int ny) {
-	static long int mass[4] = {0};
-	if (!ori || !mark) {
-		LogInfo << "Input map is NULL" << endl;
-		return mass;
-	}
-	map<int, TVector3> qp;
-	map<int, double> q;
-	map<int, int> area;
-	double unit = PI / 100;
-	for (int i = 0; i < totPmtNum; i ++) {
-		if (!m_ptab[i].used)
+int FhtAna::GraphLabel(const SkyGraph& g, const std::vector<double>& val, double thr, std::vector<int>& mark, int size) {
+	int n = g.size();
+	mark.assign(n, 0);
+	std::vector<int> stack;
+	std::vector<int> comp;
+	int ID = 0;
+	for (int i = 0; i < n; i ++) {
+		if (mark[i] || val[i] <= thr)
 			continue;
-		double the = m_ptab[i].pos.Theta();
-		double phi = m_ptab[i].pos.Phi();
-		int x = the / unit + 11;
-		int y = (phi + PI) / unit + 11;
-		if (mark->GetBinContent(x, y)) {
-			double tmp = mark->GetBinContent(x, y);
-			qp[(int)tmp] += ori->GetBinContent(x, y) * m_ptab[i].pos;
-			q[(int)tmp] += ori->GetBinContent(x, y);
-			area[(int)tmp] ++;
-		}
-		if (x <= 20) {
-			if ((y > 20 && y <= 100) || (y > 120 && y <= 200)) {
-				y = y < 110 ? y + 100 : y - 100;
-				x = 21 - x;
-				double tmp = mark->GetBinContent(x, y);
-				if (tmp) {
-					qp[(int)tmp] += ori->GetBinContent(x, y) * m_ptab[i].pos;
-					q[(int)tmp] += ori->GetBinContent(x, y);
-					area[(int)tmp] ++;
-				}
-			}
-			else {
-				double y1 = y <= 110 ? y + 100 : y - 100;
-				double x1 = 21 - x;
-				double tmp = mark->GetBinContent(x1, y1);
-				if (tmp) {
-					qp[(int)tmp] += ori->GetBinContent(x1, y1) * m_ptab[i].pos;
-					q[(int)tmp] += ori->GetBinContent(x1, y1);
-					area[(int)tmp] ++;
-				}
-				if (y <= 20) {
-					y1 = y + 200;
-					x1 = x;
-				}
-				else if (y <= 110 && y > 100) {
-					y1 -= 200;
-				}
-				else if (y <= 120 && y > 110) {
-					y1 = y1 + 200;
-				}
-				else {
-					y1 = y - 200;
-					x1 = x;
-				}
-				tmp = mark->GetBinContent(x1, y1);
-				if (tmp) {
-					qp[(int)tmp] += ori->GetBinContent(x1, y1) * m_ptab[i].pos;
-					q[(int)tmp] += ori->GetBinContent(x1, y1);
-					area[(int)tmp] ++;
-				}
-			}
-		}
-		else if (x > 100) {
-			if ((y > 20 && y <= 90) || (y > 110 && y <= 200)) {
-				y = y < 110 ? y + 100 : y - 100;
-				x = 221 - x;
-				double tmp = mark->GetBinContent(x, y);
-				if (tmp) {
-					qp[(int)tmp] += ori->GetBinContent(x, y) * m_ptab[i].pos;
-					q[(int)tmp] += ori->GetBinContent(x, y);
-					area[(int)tmp] ++;
-				}
-			}
-			else {
-				double y1 = y <= 110 ? y + 100 : y - 100;
-				double x1 = 221 - x;
-				double tmp = mark->GetBinContent(x1, y1);
-				if (tmp) {
-					qp[(int)tmp] += ori->GetBinContent(x1, y1) * m_ptab[i].pos;
-					q[(int)tmp] += ori->GetBinContent(x1, y1);
-					area[(int)tmp] ++;
-				}
-				if (y <= 20) {
-					y1 = y + 200;
-					x1 = x;
-				}
-				else if (y <= 110 && y > 100) {
-					y1 -= 200;
-				}
-				else if (y <= 120 && y > 110) {
-					y1 = y1 + 200;
-				}
-				else {
-					y1 = y - 200;
-					x1 = x;
-				}
-				tmp = mark->GetBinContent(x1, y1);
-				if (tmp) {
-					qp[(int)tmp] += ori->GetBinContent(x1, y1) * m_ptab[i].pos;
-					q[(int)tmp] += ori->GetBinContent(x1, y1);
-					area[(int)tmp] ++;
+		ID ++;
+		comp.clear();
+		stack.push_back(i);
+		mark[i] = ID;
+		while (!stack.empty()) {
+			int u = stack.back();
+			stack.pop_back();
+			comp.push_back(u);
+			for (int k = g.begin(u); k < g.end(u); k ++) {
+				int v = g.adj[k];
+				if (!mark[v] && val[v] > thr) {
+					mark[v] = ID;
+					stack.push_back(v);
 				}
 			}
 		}
-		else if (y <= 20) {
-			double y1 = y + 200;
-			double x1 = x;
-			double tmp = mark->GetBinContent(x1, y1);
-			if (tmp) {
-				qp[(int)tmp] += ori->GetBinContent(x1, y1) * m_ptab[i].pos;
-				q[(int)tmp] += ori->GetBinContent(x1, y1);
-				area[(int)tmp] ++;
-			}
-		}
-		else if (y > 200) {
-			double y1 = y - 200;
-			double x1 = x;
-			double tmp = mark->GetBinContent(x1, y1);
-			if (tmp) {
-				qp[(int)tmp] += ori->GetBinContent(x1, y1) * m_ptab[i].pos;
-				q[(int)tmp] += ori->GetBinContent(x1, y1);
-				area[(int)tmp] ++;
-			}
+		if ((int)comp.size() < size) {
+			// Mark as visited below threshold, cleared after the scan
+			for (size_t k = 0; k < comp.size(); k ++)
+				mark[comp[k]] = -1;
+			ID --;
 		}
 	}
+	for (int i = 0; i < n; i ++)
+		if (mark[i] < 0)
+			mark[i] = 0;
+	return ID;
+}
 
-	map<int, TVector3>::iterator qpIt = qp.begin();
-	map<int, double>::iterator qIt = q.begin();
-	map<int, int>::iterator aIt = area.begin();
-	map<int, TVector3> rec;
-	int m = 0;
-	while (qpIt != qp.end()) {
-		LogInfo << "The " << qpIt->first << "th mass." << endl;
-		TVector3 p = 1 / qIt->second * qpIt->second;
-		if (m < 4) {
-			map<int, TVector3>::iterator recIt = rec.begin();
-			int i = 0;
-			bool breakFlag = false;
-			while (recIt != rec.end()) {
-				if ((p - recIt->second).Mag() < 3000 &&
-					(p.Theta() < 0.314 && (recIt->second).Theta() < 0.314 ||
-					 p.Theta() > 2.826 && (recIt->second).Theta() > 2.826)) {
-					if (area[recIt->first] < area[qpIt->first]) {
-						mass[i] = (long int)p.Mag() * 1E6 + (long int)(p.Theta() / unit) * 1000 + (long int)((p.Phi() + TMath::Pi()) / unit);
-						rec.erase(recIt);
-					}
-					breakFlag = true;
-					break;
-				}
-				i ++;
-				recIt ++;
-			}
-			if (!breakFlag) {
-				long int pp = (long int)p.Mag() * 1E6 + (long int)(p.Theta() / unit) * 1000 + (long int)((p.Phi() + TMath::Pi()) / unit);
-				mass[m] = pp;
-				m ++;
+int FhtAna::GraphSplit(const SkyGraph& g, std::vector<int>& low, const std::vector<int>& high) {
+	// Low threshold areas holding several high threshold seeds are flooded
+	// from the seeds, every other area keeps its own label
+	int n = g.size();
+	map<int, set<int> > seeds;
+	for (int i = 0; i < n; i ++)
+		if (low[i] && high[i])
+			seeds[low[i]].insert(high[i]);
+
+	std::vector<int> ret(n, 0);
+	map<int, int> highID;
+	map<int, int> lowID;
+	queue<int> front;
+	int ID = 0;
+	for (int i = 0; i < n; i ++) {
+		if (!low[i] || !high[i] || seeds[low[i]].size() < 2)
+			continue;
+		if (!highID.count(high[i]))
+			highID[high[i]] = ++ ID;
+		ret[i] = highID[high[i]];
+		front.push(i);
+	}
+	while (!front.empty()) {
+		int u = front.front();
+		front.pop();
+		for (int k = g.begin(u); k < g.end(u); k ++) {
+			int v = g.adj[k];
+			if (!ret[v] && low[v] == low[u]) {
+				ret[v] = ret[u];
+				front.push(v);
 			}
 		}
-		rec[qpIt->first] = p;
-		qpIt ++;
-		qIt ++;
 	}
-
-	for (int i = 0; i < 4; i ++)
-		LogDebug << "mass[" << i << "]: " << mass[i] << endl;
-
-	qp.clear();
-	q.clear();
-	area.clear();
-	rec.clear();
-
-	return mass;
+	for (int i = 0; i < n; i ++) {
+		if (!low[i] || ret[i])
+			continue;
+		if (!lowID.count(low[i]))
+			lowID[low[i]] = ++ ID;
+		ret[i] = lowID[low[i]];
+	}
+	low.swap(ret);
+	return ID;
 }
 
-double FhtAna::FHTPredict(const PmtProp& pmt, TVector3 inci, TVector3 dir, double ti) {
-	double nLS = 1.485;
-	double cLight = 299.;
-	double vMuon = 299.;
-	double nW = 1.34;
-
-	double tan = TMath::Sqrt(nW * nW - 1);
-
-	TVector3 perp = inci + dir * (pmt.pos - inci) * dir;
-
-	TVector3 liSource = perp - (pmt.pos - perp).Mag() / tan * dir;
-
-	TVector3 liDir = pmt.pos - liSource;
-
-	double dis = TMath::Sqrt(TMath::Power(pmt.pos.Mag(), 2) - TMath::Power(pmt.pos * liDir.Unit(), 2));
-
-	return ti + (liSource - inci) * dir / vMuon + (pmt.pos - liSource).Mag() * nW / cLight;
+bool FhtAna::GetGraphCenters(const SkyGraph& g, const std::vector<double>& q, const std::vector<int>& mark,
+							 const std::vector<double>& qSum, const std::vector<Vec3>& qPos, std::vector<Centroid>& centers) {
+	// Areas are ranked on the smoothed node charge, the centroid is taken
+	// at the exact positions of the fired PMTs of the area, as
+	// GetCenterPos(). An area of filled nodes only keeps its node centroid.
+	centers.clear();
+	map<int, Vec3> qp;
+	map<int, double> qs;
+	map<int, Vec3> pp;
+	map<int, double> ps;
+	for (int i = 0; i < g.size(); i ++) {
+		if (!mark[i])
+			continue;
+		qp[mark[i]] += q[i] * g.node[i];
+		qs[mark[i]] += q[i];
+		pp[mark[i]] += qPos[i];
+		ps[mark[i]] += qSum[i];
+	}
+
+	// Uniform neighbourhoods leave no seam to merge across, keep the four
+	// areas with the largest charge
+	vector<pair<double, int> > order;
+	for (map<int, double>::iterator it = qs.begin(); it != qs.end(); it ++)
+		order.push_back(make_pair(- it->second, it->first));
+	sort(order.begin(), order.end());
+	for (size_t i = 0; i < order.size() && i < 4; i ++) {
+		int l = order[i].second;
+		Centroid c;
+		if (ps[l] > 0) {
+			Vec3 p = 1 / ps[l] * pp[l];
+			c.u = p.Unit();
+			c.r = p.Mag();
+		}
+		else {
+			c.u = qp[l].Unit();
+			c.r = m_LSRadius;
+		}
+		c.q = - order[i].first;
+		centers.push_back(c);
+		LogDebug << "center[" << i << "]: " << c.u << endl;
+	}
+	return true;
 }
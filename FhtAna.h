@@ -17,21 +17,39 @@
 #include "Identifier/WpID.h"
 #include "Geometry/RecGeomSvc.h"
 #include "TTree.h"
-#include "TVector3.h"
-#include "TVector2.h"
+#include "Vec3.h"
 #include "TMath.h"
 #include <fstream>
 #include <iostream>
 #include <cmath>
 #include "PmtProp.h"
+#include "SkyGraph.h"
+#include "PmtIndex.h"
+#include "SkyBinTable.h"
+#include "MapKernels.h"
+#include "MapExpr.h"
+#include "RunMask.h"
+#include "MaxTree.h"
+#include "StagePipeline.h"
+#include "SpscQueue.h"
+#include "WorkerPool.h"
+#include "MuonVetoSvc.h"
+#include "MapSnapshot.h"
+#include "ResultCache.h"
 #include "TH2D.h"
 #include "TStyle.h"
 #include "TPad.h"
 #include "TCanvas.h"
 #include "TString.h"
 #include "TH1F.h"
+#include "TFile.h"
+#include "TProfile2D.h"
 #include "TMath.h"
 #include <vector>
+#include <unordered_map>
+#include <memory>
+#include <thread>
+#include <chrono>
 #include <algorithm>
 #include <limits.h>
 
@@ -42,40 +60,282 @@ using namespace std;
 class CdGeom;
 class WpGeom;
 
+// Element type of the dense charge chain (Expansion, Smooth, RMS), see
+// the MapPrecision property
+enum MapType {
+	_MAPDOUBLE,
+	_MAPFLOAT,
+	_MAPUINT16,
+};
+
+// Outcome of the calib-level pre-filter, one counter per entry
+enum PreFilterResult {
+	_PFPASS,
+	_PFNOCALIB,
+	_PFLOWPMT,
+	_PFLOWCHARGE,
+	_PFSPREAD,
+	_PFNRESULT,
+};
+
+// Outcome of an event in the reconstruction tree
+enum RecStatus {
+	_RECTRACK,
+	_RECPREFILTER,	// rejected by the pre-filter
+	_RECSTOPPED,	// a stage failed
+	_RECNOTRACK,	// no track from the centroids
+	_RECFAST,		// VetoMode Fast, no reconstruction
+};
+
+// Cheaper paths taken by an event over the TimeBudget, bits of the
+// degraded column
+enum DegradeFlag {
+	_DEGCOARSE = 1,		// centroids of the coarse sky cells, no segmentation
+	_DEGSEGMENT = 2,	// areas neither re-thresholded nor split
+	_DEGTRACK = 4,		// track on the two brightest centroids only
+};
+// Number of DegradeFlag bits, one counter each
+const int nDegradeFlag = 3;
+
 class FhtAna : public AlgBase {
     public:
+		// Statistics of a labelled area, see AreaStats()
+		struct Area {
+			int area = 0;
+			double aIn = 0;
+			double aOut = 0;
+			double max = 0;
+			double min = 1E9;
+			Vec2 st;
+			Vec2 ed;
+			double nOL = 0;
+			double lastMark = 0;
+			double hMax = 0;
+		};
+		// Charge centroid of one area, its direction and its distance to
+		// the centre
+		struct Centroid {
+			Vec3 u;
+			double r;
+			double q;
+		};
+		// First simulated track, read with the event, see LoadTruth()
+		struct SimTruth {
+			bool found = false;
+			int nTrk = 0;
+			Vec3 inci;
+			Vec3 dir;
+			Vec3 exit;
+			double edep = 0;
+			double qedep = 0;
+		};
+		// Constants of the segmentation, fractions of the RMS peak and
+		// sizes in bins, see the Segmentation and Sweep properties
+		struct SegParams {
+			std::string tag = "default";
+			double hFrac = 0.8;		// high threshold
+			double lFrac = 0.35;	// low threshold
+			double areaCut = 0.3;	// re-threshold of the large areas
+			int maxArea = 200;		// areas over it are re-thresholded
+			int minLabel = 20;		// smallest area of a threshold
+			int minSplit = 10;		// smallest part of a re-thresholded area
+			int minConnect = 20;	// smallest low area after the watershed
+			int minCombine = 5;		// smallest area of the combined mark
+		};
+		// Track of one segmentation configuration
+		struct SegResult {
+			bool track = false;
+			std::vector<Centroid> centers;
+			Vec3 inci;
+			Vec3 dir;
+			double dis = 0;
+			double ang = 0;
+			double ti = 0;
+		};
+		// Working set of one configuration. A sweep configuration owns its
+		// maps, R2HCut, R2LCut, cHRMS, cLRMS and totMark, so the
+		// configurations run side by side.
+		struct SegState {
+			SegParams p;
+			MaxTree<Grid::Ext> tree;
+			double hLevel = 0;
+			double lLevel = 0;
+			std::vector<int> flood;
+			std::vector<TH2D*> maps;
+			SegResult res;
+		};
+		// One event from reading to commit. A pipelined worker only sees
+		// the record, never the event navigator.
+		struct EventRecord {
+			int id;
+			PreFilterResult pf;
+			std::vector<int> hitPid;
+			std::vector<double> hitQ;
+			std::vector<double> hitFht;
+			SimTruth truth;
+			MuonVeto veto;
+			bool track;
+			std::string error;
+			std::vector<Centroid> centers;
+			Vec3 inci;
+			Vec3 dir;
+			double dis;
+			double ang;
+			double ti;
+			double fastTime;
+			int degraded;
+			std::vector<float> stageTime;
+			std::vector<MapRecord> maps;
+			std::vector<SegResult> sweep;
+		};
+		// Branch buffers of the reconstruction tree, see initRecTree()
+		struct RecRow {
+			static const int maxCenter = 16;
+			int evt;
+			int pf;
+			int status;
+			int vetoLevel;
+			float inci[3];
+			float dir[3];
+			float dis;
+			float ang;
+			float ti;
+			int nCenter;
+			float cTheta[maxCenter];
+			float cPhi[maxCenter];
+			float cR[maxCenter];
+			float cQ[maxCenter];
+			float tFast;
+			float tTotal;
+			int degraded;
+			std::vector<float> tStage;
+			int trFound;
+			int trNTrk;
+			float trInci[3];
+			float trDir[3];
+			float trEdep;
+			float trQEdep;
+		};
+		// Branch buffers of the sweep tree, one row per event and
+		// configuration, see initSweep()
+		struct SweepRow {
+			int evt;
+			int cfg;
+			char tag[32];
+			float hFrac;
+			float lFrac;
+			float areaCut;
+			int maxArea;
+			int minLabel;
+			int minSplit;
+			int minConnect;
+			int minCombine;
+			int status;
+			float inci[3];
+			float dir[3];
+			float dis;
+			float ang;
+			float ti;
+			int nCenter;
+			float cTheta[RecRow::maxCenter];
+			float cPhi[RecRow::maxCenter];
+			float cR[RecRow::maxCenter];
+			float cQ[RecRow::maxCenter];
+		};
 		FhtAna(const std::string&);
 		bool initialize();
 		bool execute();
 		bool initGeomSvc();
 		bool initPmt();
-		bool freshPmtData(TH2D*, TH2D*, TH2D*, TH2D*, TH2D*, double&, double&);
+		bool initPmtIndex();
+		bool initSkyGraph();
+		bool initPipeline();
+		bool initBinTables();
+		bool initRecTree();
+		void FillRecTree(const EventRecord&);
+		bool LoadHits(EventRecord&);
+		bool LoadTruth(SimTruth&);
+		bool freshPmtData(TH2D*, TH2D*, Vec3&);
+		PreFilterResult PreFilter(const EventRecord&);
+		void FastVeto(EventRecord&);
+		void Reconstruct(EventRecord&);
+		void Commit(EventRecord*);
+		void CommitDone();
+		void Worker();
 		bool finalize();
-		bool IfCrossCd(TVector3&, TVector3&, Double_t);
-		TVector3 InciOnLS(TVector3&, TVector3&, Double_t);
-		TVector3 PosOnLS(TVector3&, TVector3&, Double_t, int);
-		TVector3 GetInciPos(TH1D*, TH1D*, int);
-		TVector3 GetExitPos(TH1D*, TH1D*, int);
-		TVector3 GetChargeCenter();
-		TH2D* MapSmooth(TH2D*, int, int, TString);
-		int* GetMassPos(TH2D*, TH2D*, int, int, TH2D*);
-		TH2D* PECut(TH2D*, int, int, double);
+		bool IfCrossCd(const Vec3&, const Vec3&, Double_t);
+		Vec3 InciOnLS(const Vec3&, const Vec3&, Double_t);
+		Vec3 PosOnLS(const Vec3&, const Vec3&, Double_t, int);
+		Vec3 GetInciPos(TH1D*, TH1D*, int);
+		Vec3 GetExitPos(TH1D*, TH1D*, int);
+		Vec3 GetChargeCenter();
+		TH2D* MapSmooth(TH2D*, TString);
 		void nCorrosion(TH2D*, int, int, int);
 		int MarkConnection(TH2D*, int, int, TH2D*, int);
-		int AreaCut(TH2D*, TH2D*, int, int, double, bool, bool);
-		bool FindTrk(TVector3&, TVector3&, double&, double&, double&, TH2D*, long int*);
-		bool FillContent(TH2D*, int, int);
-		bool ChooseCut(TH2D*, TH1D*, int, int);
-		bool Expansion(TH2D*, int, int);
-		bool RMSMap(TH2D*, TH2D*, int, int, int, int, double);
-		bool MapExtend(TH2D*, TH2D*, int, int);
-		bool Pool(TH2D*, TH2D*, int, int, int);
-		bool XOR(TH2D*, TH2D*, int, int);
-		TH2D* Combine(TH2D*, TH2D*, int, int);
-		bool UnionCut(TH2D*, TH2D*, TH2D*, int, int, double, TH2D*);
-		bool AND(TH2D*, TH2D*, int, int);
-		long int* GetCenterPos(TH2D*, TH2D*, int, int);
-		double FHTPredict(const PmtProp&, TVector3, TVector3, double);
+		int AreaCut(TH2D*, TH2D*, int, int, const SegParams&, bool, bool);
+		int TreeLabel(SegState&, double, TH2D*, TH2D*);
+		int Watershed(SegState&, TH2D*, TH2D*, TH2D*);
+		int TreeAreaCut(SegState&, TH2D*, TH2D*);
+		void Threshold(SegState&, const double*, TH2D*, TH2D*);
+		void Segment(SegState&, TH2D*, TH2D*, TH2D*, TH2D*, TH2D*, bool);
+		bool ParseSegParams(const std::string&, SegParams&);
+		void AreaStats(const RunMask<Grid::Ext>&, const double*, const double*, map<int, Area>&);
+		bool FindTrk(Vec3&, Vec3&, double&, double&, double&, TH2D*, const std::vector<Centroid>&);
+		bool FillContent(TH2D*);
+		bool ChooseCut(TH2D*, TH1D*);
+		template <class S> bool Expansion(TH2D*, int = 1);
+		template <class S, int U, int R> bool RMSMap(TH2D*, TH2D*);
+		bool MapExtend(TH2D*, TH2D*);
+		bool Pool(TH2D*, TH2D*);
+		bool Combine(TH2D*, TH2D*, TH2D*, int);
+		bool GetCenterPos(TH2D*, TH2D*, int, int, std::vector<Centroid>&);
+		bool CoarseCenters(std::vector<Centroid>&);
+		bool OverBudget() const;
+		void CoarseFallback();
+		double FHTPredict(const PmtProp&, const Vec3&, const Vec3&, double);
+		bool ReconGraph(const SkyGraph&, const std::vector<int>&, int, int, int, const SegParams&, int, std::vector<Centroid>&);
+		bool GraphExpansion(const SkyGraph&, std::vector<double>&);
+		bool GraphSmooth(const SkyGraph&, std::vector<double>&, int);
+		int GraphLabel(const SkyGraph&, const std::vector<double>&, double, std::vector<int>&, int);
+		int GraphSplit(const SkyGraph&, std::vector<int>&, const std::vector<int>&);
+		bool GetGraphCenters(const SkyGraph&, const std::vector<double>&, const std::vector<int>&, const std::vector<double>&, const std::vector<Vec3>&, std::vector<Centroid>&);
+		// Reconstruction stages, see initPipeline()
+		bool StageIngest();
+		bool StageFhtProfile();
+		bool StageInputPdf();
+		bool StageNormalize();
+		bool StageMapDump();
+		bool StageExpansion();
+		void NarrowCharge(const double*);
+		bool RunReference();
+		void ComparePrecision();
+		bool StageSmooth();
+		bool StageCoarseRMS();
+		bool StageRMS();
+		bool StageChargeSpectrum();
+		bool StageThreshold();
+		bool StageLabel();
+		bool StageSegment();
+		bool StageCenters();
+		bool StageGraphCenters();
+		bool StageSweep();
+		void SweepConfig(SegState&, const double*, TH2D*, TH2D*);
+		bool StageTrack();
+		bool StageTruth();
+		bool initValidation();
+		void FillValidation(const Vec3&, const Vec3&);
+		void WriteValidation();
+		bool initSnapshot();
+		void Snapshot(const std::string&, const std::string&, TH2D*);
+		void WriteMap(MapRecord&);
+		bool initSweep();
+		void FillSweepTree(const EventRecord&);
+		bool initShard();
+		bool initCache();
+		uint64_t EventKey() const;
+		bool LoadCenters(uint64_t);
+		void StoreCenters(uint64_t);
+		void CloseShard();
     private:
 		char* outPath;
 		char* m_name;
@@ -102,7 +362,159 @@ class FhtAna : public AlgBase {
 		bool m_3inchusedflag;
 		bool m_20inchusedflag;
 		Double_t m_qcut;
+		std::string m_skyGrid;
+		int m_nside;
+		int m_graphK;
+		Double_t m_graphRadius;
+		int m_graphMinSize;
+		PmtIndex m_pmtIndex;
+		SkyGraph m_skyGraph;
+		std::vector<int> m_pmtNode;
+		Double_t m_minTotPE;
+		int m_minFiredPmt;
+		int m_nEarlyHits;
+		Double_t m_maxEarlySpread;
+		std::vector<double> m_hitTimes;
+		// Water pool channels and truth of the event being reconstructed,
+		// swapped in from its EventRecord
+		std::vector<int> m_hitPid;
+		std::vector<double> m_hitQ;
+		std::vector<double> m_hitFht;
+		SimTruth m_truth;
+		bool m_wantTruth;
+		bool m_trackDone;
+		int m_evtId;
+		// Pipelined mode, the event loop thread reads and commits events
+		// and m_worker reconstructs them
+		bool m_pipelined;
+		int m_queueDepth;
+		std::unique_ptr<SpscQueue<EventRecord*> > m_inQueue;
+		std::unique_ptr<SpscQueue<EventRecord*> > m_outQueue;
+		std::thread m_worker;
+		std::vector<EventRecord*> m_freeRecords;
+		// Muon veto answers, see FastVeto()
+		MuonVetoSvc* m_veto;
+		std::string m_vetoMode;
+		bool m_fastOnly;
+		double m_fastBudget;
+		double m_fastTime;
+		double m_maxFastTime;
+		long m_nFast;
+		long m_nOverBudget;
+		std::vector<Vec3> m_pmtDir;
+		std::vector<double> m_coarseQ;
+		std::vector<Vec3> m_coarseU;
+		std::vector<int> m_early;
+		std::string m_treePath;
+		TTree* m_recTree;
+		RecRow m_row;
+		bool m_noSim;
+		// Truth residuals over the whole job, see initValidation()
+		bool m_validation;
+		bool m_validAttached;
+		TH1F* m_vFhtDiff;
+		TProfile2D* m_vExp2D;
+		TProfile2D* m_vSource;
+		TProfile2D* m_vPos;
+		TH2D* m_vLiDiff;
+		TH2D* m_vQDiff;
+		TH2D* m_vTDiff;
+		std::vector<TH1*> m_validHists;
+		// Maps dumped for offline drawing, see initSnapshot()
+		std::vector<std::string> m_snapMaps;
+		std::vector<int> m_snapEvents;
+		int m_snapEvery;
+		std::string m_snapFile;
+		bool m_snapThis;
+		MapSnapshotWriter m_snap;
+		std::vector<MapRecord> m_snapBuf;
+		// Batch mode, everything of the job goes to one shard file, see
+		// initShard() and tools/MergeShards.cc
+		std::string m_shardFile;
+		bool m_batch;
+		TFile* m_shard;
+		TTree* m_mapTree;
+		MapRecord m_mapRow;
+		TH1D* m_hPreFilter;
+		TH1D* m_hStatus;
+		TH1F* m_hFast;
+		std::vector<TH1F*> m_hStage;
+		long m_nCommit;
+		long m_nTrack;
+		std::ofstream m_noFile;
+		// Centroids of earlier jobs, see initCache()
+		std::string m_cachePath;
+		ResultCache m_cache;
+		uint64_t m_cacheParams;
+		std::vector<std::string> m_cacheSkip;
+		std::vector<double> m_cacheBuf;
+		std::unordered_map<Identifier::value_type, int> m_idPid;
+		std::vector<char> m_pidUsed;
+		long m_nPreFilter[_PFNRESULT];
+		std::vector<std::string> m_outputs;
+		StagePipeline m_pipe;
+		std::vector<Centroid> m_centers;
+		// Per-event time budget, see OverBudget()
+		double m_timeBudget;
+		std::chrono::steady_clock::time_point m_deadline;
+		int m_degraded;
+		long m_nDegraded;
+		long m_nDegradeFlag[nDegradeFlag];
+		std::vector<double> m_cellQ;
+		std::vector<Vec3> m_cellP;
+		Vec3 m_rInci;
+		Vec3 m_rDir;
+		double m_rDis;
+		double m_rAng;
+		double m_rTi;
+		TCanvas* m_c1;
+		TString m_pdfPath;
+		std::ofstream m_txt;
+		SkyBinTable m_bins;
+		// Segmentation of the reconstruction and of the sweep
+		// configurations, see initSweep()
+		std::string m_segParams;
+		SegState m_seg;
+		std::vector<std::string> m_sweepParams;
+		std::vector<SegState> m_sweep;
+		int m_sweepThreads;
+		WorkerPool m_sweepPool;
+		bool m_sweepDone;
+		std::string m_sweepPath;
+		TTree* m_sweepTree;
+		SweepRow m_sweepRow;
+		// Reduced precision maps, the base charge map and the smoothed
+		// extended map
+		std::string m_mapPrecision;
+		int m_mapType;
+		std::vector<float> m_fq;
+		std::vector<float> m_fs;
+		std::vector<unsigned short> m_q16;
+		// Double path results of the event for PrecisionCheck
+		bool m_precisionCheck;
+		bool m_refRun;
+		std::vector<double> m_refMark;
+		std::vector<double> m_lowMark;
+		std::vector<Centroid> m_refCenters;
+		Vec3 m_refInci;
+		Vec3 m_refDir;
+		double m_refDis;
+		double m_refTi;
+		long m_nChecked;
+		long m_nLabelDiff;
+		long m_nCenterDiff;
+		double m_maxCenterDiff;
+		double m_maxDirDiff;
+		double m_maxInciDiff;
+		double m_maxTiDiff;
+		TH2D* m_nPmtMap;
 		void Corrosion(TH2D*, int, int);
+		TH2D* NewMap(const char*);
+		TH2D* NewExtMap(const char*);
+		std::ofstream& EventTxt();
+		void OpenPdf(const TString&);
+		void PrintPage(TH1*, const char*, const char*, const char*);
+		void CloseEventFiles();
 };
 
 #endif
@@ -0,0 +1,125 @@
+#include "HealPix.h"
+#include "TMath.h"
+#include <algorithm>
+#include <utility>
+#include <cmath>
+
+HealPix::HealPix(int nside)
+: m_nside(nside),
+m_npix(12 * nside * nside),
+m_ncap(2 * nside * (nside - 1))
+{
+}
+
+int HealPix::Pixel(const Vec3& v) const {
+	double z = v.Z() / v.Mag();
+	double za = fabs(z);
+	double phi = atan2(v.Y(), v.X());
+	if (phi < 0)
+		phi += 2 * TMath::Pi();
+	double tt = phi / (0.5 * TMath::Pi());
+	if (tt >= 4)
+		tt -= 4;
+	if (za <= 2. / 3) {
+		// Equatorial belt
+		double t1 = m_nside * (0.5 + tt);
+		double t2 = m_nside * z * 0.75;
+		int jp = (int)(t1 - t2);
+		int jm = (int)(t1 + t2);
+		int ir = m_nside + 1 + jp - jm;
+		int kshift = 1 - (ir & 1);
+		int ip = (jp + jm - m_nside + kshift + 1) / 2;
+		ip = ((ip % (4 * m_nside)) + 4 * m_nside) % (4 * m_nside);
+		return m_ncap + (ir - 1) * 4 * m_nside + ip;
+	}
+	// Polar caps
+	double tp = tt - (int)tt;
+	double tmp = m_nside * sqrt(3 * (1 - za));
+	int jp = (int)(tp * tmp);
+	int jm = (int)((1 - tp) * tmp);
+	int ir = jp + jm + 1;
+	int ip = (int)(tt * ir);
+	ip = ((ip % (4 * ir)) + 4 * ir) % (4 * ir);
+	if (z > 0)
+		return 2 * ir * (ir - 1) + ip;
+	return m_npix - 2 * ir * (ir + 1) + ip;
+}
+
+int HealPix::Ring(int pix) const {
+	if (pix < m_ncap)
+		return (1 + (int)sqrt(1. + 2 * pix)) >> 1;
+	if (pix < m_npix - m_ncap)
+		return (pix - m_ncap) / (4 * m_nside) + m_nside;
+	int ip = m_npix - pix;
+	return 4 * m_nside - ((1 + (int)sqrt(2. * ip - 1)) >> 1);
+}
+
+int HealPix::RingSize(int ring) const {
+	if (ring < m_nside)
+		return 4 * ring;
+	if (ring <= 3 * m_nside)
+		return 4 * m_nside;
+	return 4 * (4 * m_nside - ring);
+}
+
+int HealPix::RingStart(int ring) const {
+	if (ring <= m_nside)
+		return 2 * ring * (ring - 1);
+	if (ring <= 3 * m_nside)
+		return m_ncap + (ring - m_nside) * 4 * m_nside;
+	int r = 4 * m_nside - ring;
+	return m_npix - 2 * r * (r + 1);
+}
+
+Vec3 HealPix::Center(int pix) const {
+	int ring = Ring(pix);
+	int iphi = pix - RingStart(ring) + 1;
+	double z, phi;
+	if (ring < m_nside) {
+		z = 1 - (double)ring * ring * 4. / m_npix;
+		phi = (iphi - 0.5) * 0.5 * TMath::Pi() / ring;
+	}
+	else if (ring <= 3 * m_nside) {
+		double fodd = ((ring + m_nside) & 1) ? 1 : 0.5;
+		z = (2 * m_nside - ring) * 2. / (3 * m_nside);
+		phi = (iphi - fodd) * 0.5 * TMath::Pi() / m_nside;
+	}
+	else {
+		int r = 4 * m_nside - ring;
+		z = - 1 + (double)r * r * 4. / m_npix;
+		phi = (iphi - 0.5) * 0.5 * TMath::Pi() / r;
+	}
+	double st = sqrt((1 - z) * (1 + z));
+	return Vec3(st * cos(phi), st * sin(phi), z);
+}
+
+void HealPix::BuildGraph(SkyGraph& g, int k) const {
+	// The k nearest pixel centres of the same and the two adjacent rings,
+	// iso-latitude rings make this a local search with no pole special case.
+	// Nearest is not mutual, the reverse edges are added at the end.
+	g.node.resize(m_npix);
+	for (int i = 0; i < m_npix; i ++)
+		g.node[i] = Center(i);
+	g.offset.assign(1, 0);
+	g.adj.clear();
+	g.adj.reserve(m_npix * k);
+	std::vector<std::pair<double, int> > cand;
+	for (int i = 0; i < m_npix; i ++) {
+		cand.clear();
+		int ring = Ring(i);
+		for (int r = ring - 1; r <= ring + 1; r ++) {
+			if (r < 1 || r > nRing())
+				continue;
+			int st = RingStart(r);
+			for (int j = st; j < st + RingSize(r); j ++)
+				if (j != i)
+					cand.push_back(std::make_pair(- g.node[i] * g.node[j], j));
+		}
+		int n = (int)cand.size() < k ? cand.size() : k;
+		std::partial_sort(cand.begin(), cand.begin() + n, cand.end());
+		for (int j = 0; j < n; j ++)
+			g.adj.push_back(cand[j].second);
+		g.offset.push_back(g.adj.size());
+	}
+	g.Symmetrize();
+}
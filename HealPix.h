@@ -0,0 +1,24 @@
+#ifndef HealPix_h
+#define HealPix_h
+// Equal-area iso-latitude pixelization of the sphere (HEALPix, ring scheme)
+#include "Vec3.h"
+#include "SkyGraph.h"
+
+class HealPix {
+	public:
+		HealPix(int nside);
+		int Nside() const { return m_nside; }
+		int nPix() const { return m_npix; }
+		int nRing() const { return 4 * m_nside - 1; }
+		int Pixel(const Vec3&) const;
+		Vec3 Center(int) const;
+		int Ring(int) const;
+		int RingStart(int) const;
+		int RingSize(int) const;
+		void BuildGraph(SkyGraph&, int) const;
+	private:
+		int m_nside;
+		int m_npix;
+		int m_ncap;
+};
+#endif
@@ -0,0 +1,167 @@
+#ifndef MapExpr_h
+#define MapExpr_h
+// Map algebra on the raw TH2D bin arrays. An expression only records the
+// chain of operations, Eval() walks the bins once and computes the whole
+// chain per bin, so no intermediate map is written and read back.
+//
+//     Eval<Grid::Ext>(out, Box<Grid::Ext, 2>(Gather(MapRef(in), alias)) / 25., 2);
+//
+// Rows run along theta and hold nx + 2 bins, so the rows a stencil reads
+// stay in cache while Eval() goes row by row.
+//
+// Every node has the value_type of its arithmetic, float maps are summed
+// in float and mixing in a double promotes like the built-in types.
+#include "MapKernels.h"
+#include <type_traits>
+#include <utility>
+
+template <class E>
+struct MapExpr {
+	const E& self() const { return static_cast<const E&>(*this); }
+};
+
+// Leaves
+template <class T>
+struct MapArray : MapExpr<MapArray<T> > {
+	typedef T value_type;
+	explicit MapArray(const T* a) : a(a) {}
+	T operator[](int b) const { return a[b]; }
+	const T* a;
+};
+typedef MapArray<double> MapRef;
+
+template <class T>
+struct MapConst : MapExpr<MapConst<T> > {
+	typedef T value_type;
+	explicit MapConst(T v) : v(v) {}
+	T operator[](int) const { return v; }
+	T v;
+};
+
+// Element-wise operations
+struct MapPlus {
+	template <class X, class Y>
+	static auto Apply(X x, Y y) -> decltype(x + y) { return x + y; }
+};
+struct MapMinus {
+	template <class X, class Y>
+	static auto Apply(X x, Y y) -> decltype(x - y) { return x - y; }
+};
+struct MapTimes {
+	template <class X, class Y>
+	static auto Apply(X x, Y y) -> decltype(x * y) { return x * y; }
+};
+struct MapDivide {
+	template <class X, class Y>
+	static auto Apply(X x, Y y) -> decltype(x / y) { return x / y; }
+};
+// x where it is over y, 0 elsewhere, as MapKernel::Cut()
+struct MapOver {
+	template <class X, class Y>
+	static X Apply(X x, Y y) { return x > y ? x : 0; }
+};
+// x where y is not empty
+struct MapMask {
+	template <class X, class Y>
+	static X Apply(X x, Y y) { return y ? x : 0; }
+};
+
+template <class Op, class L, class R>
+struct MapBinary : MapExpr<MapBinary<Op, L, R> > {
+	typedef decltype(Op::Apply(std::declval<typename L::value_type>(), std::declval<typename R::value_type>())) value_type;
+	MapBinary(const L& l, const R& r) : l(l), r(r) {}
+	value_type operator[](int b) const { return Op::Apply(l[b], r[b]); }
+	L l;
+	R r;
+};
+
+#define MAPEXPR_BINARY(op, Op) \
+template <class L, class R> \
+MapBinary<Op, L, R> op(const MapExpr<L>& l, const MapExpr<R>& r) { \
+	return MapBinary<Op, L, R>(l.self(), r.self()); \
+} \
+template <class L, class T> \
+typename std::enable_if<std::is_arithmetic<T>::value, MapBinary<Op, L, MapConst<T> > >::type \
+op(const MapExpr<L>& l, T r) { \
+	return MapBinary<Op, L, MapConst<T> >(l.self(), MapConst<T>(r)); \
+} \
+template <class T, class R> \
+typename std::enable_if<std::is_arithmetic<T>::value, MapBinary<Op, MapConst<T>, R> >::type \
+op(T l, const MapExpr<R>& r) { \
+	return MapBinary<Op, MapConst<T>, R>(MapConst<T>(l), r.self()); \
+}
+MAPEXPR_BINARY(operator+, MapPlus)
+MAPEXPR_BINARY(operator-, MapMinus)
+MAPEXPR_BINARY(operator*, MapTimes)
+MAPEXPR_BINARY(operator/, MapDivide)
+MAPEXPR_BINARY(Over, MapOver)
+MAPEXPR_BINARY(Mask, MapMask)
+#undef MAPEXPR_BINARY
+
+// Value of e at bin table[b], table[b] has to be valid for every
+// evaluated bin
+template <class E>
+struct MapGather : MapExpr<MapGather<E> > {
+	typedef typename E::value_type value_type;
+	MapGather(const E& e, const int* table) : e(e), table(table) {}
+	value_type operator[](int b) const { return e[table[b]]; }
+	E e;
+	const int* table;
+};
+
+template <class E>
+MapGather<E> Gather(const MapExpr<E>& e, const int* table) {
+	return MapGather<E>(e.self(), table);
+}
+
+// (2R + 1)^2 box sum of e on shape S. Every term of e is computed once per
+// box it falls in, so e should be a cheap expression.
+template <class S, int R, class E>
+struct MapBox : MapExpr<MapBox<S, R, E> > {
+	typedef typename E::value_type value_type;
+	explicit MapBox(const E& e) : e(e) {}
+	value_type operator[](int b) const {
+		value_type sum = 0;
+		for (int k = - R; k <= R; k ++)
+			for (int l = - R; l <= R; l ++)
+				sum += e[b + k + S::stride * l];
+		return sum;
+	}
+	E e;
+};
+
+template <class S, int R, class E>
+MapBox<S, R, E> Box(const MapExpr<E>& e) {
+	return MapBox<S, R, E>(e.self());
+}
+
+// out = e on the bins of S at least m bins away from the edge. out may be
+// read by e only at the evaluated bin.
+template <class S, class T, class E>
+void Eval(T* out, const MapExpr<E>& expr, int m = 0) {
+	const E& e = expr.self();
+	for (int j = 1 + m; j <= S::ny - m; j ++) {
+		int b = S::Bin(1 + m, j);
+		int end = S::Bin(S::nx - m, j);
+		for (; b <= end; b ++)
+			out[b] = e[b];
+	}
+}
+
+// out = e on the bins of S closer than m bins to the edge
+template <class S, class T, class E>
+void EvalFrame(T* out, const MapExpr<E>& expr, int m) {
+	const E& e = expr.self();
+	for (int j = 1; j <= S::ny; j ++) {
+		bool edge = j <= m || j > S::ny - m;
+		for (int i = 1; i <= S::nx; i ++) {
+			if (!edge && i == m + 1)
+				i = S::nx - m + 1;
+			if (i > S::nx)
+				break;
+			out[S::Bin(i, j)] = e[S::Bin(i, j)];
+		}
+	}
+}
+
+#endif
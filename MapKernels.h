@@ -0,0 +1,197 @@
+#ifndef MapKernels_h
+#define MapKernels_h
+// Map kernels specialized at compile time on the grid shape. Maps are the
+// raw TH2D bin arrays, bin (i, j) at i + (nx + 2) * j with under/overflow
+#include <vector>
+#include <cmath>
+#include <algorithm>
+
+// Theta bins of the sky map and halo width of the extended map, chosen at
+// configuration time (-DFHTANA_THETA_BINS=...), phi gets twice the bins
+#ifndef FHTANA_THETA_BINS
+#define FHTANA_THETA_BINS 100
+#endif
+#ifndef FHTANA_HALO_BINS
+#define FHTANA_HALO_BINS 10
+#endif
+
+template <int NX, int NY>
+struct MapShape {
+	static constexpr int nx = NX;
+	static constexpr int ny = NY;
+	static constexpr int stride = NX + 2;
+	static constexpr int size = (NX + 2) * (NY + 2);
+	static constexpr int Bin(int i, int j) { return i + stride * j; }
+};
+
+template <int NTHETA, int HALO>
+struct SkyGridDef {
+	static_assert(NTHETA % 10 == 0, "theta bins must be a multiple of the pooling size");
+	static_assert(HALO % 10 == 0, "halo must be a multiple of the pooling size");
+	static constexpr int nTheta = NTHETA;
+	static constexpr int nPhi = 2 * NTHETA;
+	static constexpr int halo = HALO;
+	static constexpr int nx = NTHETA + 2 * HALO;
+	static constexpr int ny = 2 * NTHETA + 2 * HALO;
+	static constexpr int pool = 10;
+	typedef MapShape<nTheta, nPhi> Base;
+	typedef MapShape<nx, ny> Ext;
+	typedef MapShape<nx / pool, ny / pool> Coarse;
+	// Pooled sky cells with no halo, SkyBinTable::coarseCell
+	typedef MapShape<nTheta / pool, nPhi / pool> CoarseBase;
+	static double Unit() { return M_PI / nTheta; }
+	static double ThetaMin() { return - halo * Unit(); }
+	static double ThetaMax() { return M_PI + halo * Unit(); }
+	static double PhiMin() { return - M_PI - halo * Unit(); }
+	static double PhiMax() { return M_PI + halo * Unit(); }
+	// Inside the original sky, away from the halo
+	static constexpr bool Inside(int i, int j) {
+		return i >= halo + 1 && i <= nx - halo && j >= halo + 1 && j <= ny - halo;
+	}
+};
+
+typedef SkyGridDef<FHTANA_THETA_BINS, FHTANA_HALO_BINS> Grid;
+
+template <class S>
+struct MapKernel {
+	// Fill empty bins with the mean of their non-empty 8 neighbours, n
+	// times over. The passes are chained through 3-row line buffers in a
+	// single sweep, pass k running one row behind pass k - 1, so the map
+	// is read and written once whatever n is.
+	template <class T>
+	static void Expansion(T* a, int n = 1) {
+		std::vector<T> line(3 * (n + 1) * S::stride, 0);
+		auto row = [&](int k, int j) { return &line[(3 * k + j % 3) * S::stride]; };
+		for (int sweep = 0; sweep <= S::ny + 1 + n; sweep ++) {
+			for (int k = 0; k <= n; k ++) {
+				int j = sweep - k;
+				if (j < 0 || j > S::ny + 1)
+					continue;
+				T* out = row(k, j);
+				if (j == 0 || j == S::ny + 1) {
+					std::fill(out, out + S::stride, T(0));
+					continue;
+				}
+				if (k == 0) {
+					for (int i = 1; i <= S::nx; i ++)
+						out[i] = a[S::Bin(i, j)];
+					continue;
+				}
+				const T* lo = row(k - 1, j - 1);
+				const T* mid = row(k - 1, j);
+				const T* hi = row(k - 1, j + 1);
+				for (int i = 1; i <= S::nx; i ++) {
+					out[i] = mid[i];
+					if (mid[i])
+						continue;
+					const T v[8] = {
+						mid[i - 1], mid[i + 1], lo[i], hi[i],
+						lo[i - 1], hi[i - 1], lo[i + 1], hi[i + 1]
+					};
+					T sum = 0;
+					int m = 0;
+					for (int l = 0; l < 8; l ++) {
+						sum += v[l];
+						m += (v[l] != 0);
+					}
+					if (m)
+						out[i] = sum / m;
+				}
+			}
+			int j = sweep - n;
+			if (j >= 1 && j <= S::ny)
+				std::copy(row(n, j) + 1, row(n, j) + S::nx + 1, a + S::Bin(1, j));
+		}
+	}
+
+	// (2R + 1)^2 box mean, the R-bin border is left untouched
+	template <int R>
+	static void Smooth(const double* in, double* out) {
+		for (int j = R + 1; j <= S::ny - R; j ++) {
+			for (int i = R + 1; i <= S::nx - R; i ++) {
+				double tmp = 0;
+				for (int k = - R; k <= R; k ++)
+					for (int l = - R; l <= R; l ++)
+						tmp += in[S::Bin(i + k, j + l)];
+				out[S::Bin(i, j)] = tmp / ((2 * R + 1) * (2 * R + 1));
+			}
+		}
+	}
+
+	// (2R + 1)^2 box sum, bin (i, j) goes to (i - U, j - U) of the cropped map
+	template <int U, int R>
+	static void BoxSum(const double* in, double* out) {
+		typedef MapShape<S::nx - 2 * U, S::ny - 2 * U> O;
+		for (int j = U + 1; j <= S::ny - U; j ++) {
+			for (int i = U + 1; i <= S::nx - U; i ++) {
+				double sum = 0;
+				for (int k = - R; k <= R; k ++)
+					for (int l = - R; l <= R; l ++)
+						sum += in[S::Bin(i + k, j + l)];
+				out[O::Bin(i - U, j - U)] = sum;
+			}
+		}
+	}
+
+	template <class T>
+	static T Max(const T* in) {
+		T peak = in[S::Bin(1, 1)];
+		for (int j = 1; j <= S::ny; j ++)
+			for (int i = 1; i <= S::nx; i ++)
+				peak = in[S::Bin(i, j)] > peak ? in[S::Bin(i, j)] : peak;
+		return peak;
+	}
+
+	static void Cut(const double* in, double* out, double thr) {
+		for (int j = 1; j <= S::ny; j ++)
+			for (int i = 1; i <= S::nx; i ++)
+				out[S::Bin(i, j)] = in[S::Bin(i, j)] > thr ? in[S::Bin(i, j)] : 0;
+	}
+
+	static void Add(double* a, const double* b) {
+		for (int j = 1; j <= S::ny; j ++)
+			for (int i = 1; i <= S::nx; i ++)
+				a[S::Bin(i, j)] += b[S::Bin(i, j)];
+	}
+
+	// Sum over P x P blocks into the pooled map
+	template <int P>
+	static void Pool(const double* in, double* out) {
+		typedef MapShape<S::nx / P, S::ny / P> O;
+		for (int j = 1; j <= O::ny; j ++) {
+			for (int i = 1; i <= O::nx; i ++) {
+				double sum = 0;
+				for (int k = (i - 1) * P + 1; k <= i * P; k ++)
+					for (int l = (j - 1) * P + 1; l <= j * P; l ++)
+						sum += in[S::Bin(k, l)];
+				out[O::Bin(i, j)] = sum;
+			}
+		}
+	}
+
+	// Copy the theta/phi map into the middle of the extended map, mirror
+	// the H bins beyond the poles and wrap the H bins beyond +-PI
+	template <int H>
+	static void Extend(const double* in, double* out) {
+		typedef MapShape<S::nx + 2 * H, S::ny + 2 * H> O;
+		constexpr int half = S::ny / 2;
+		for (int j = 1; j <= S::ny; j ++)
+			for (int i = 1; i <= S::nx; i ++)
+				out[O::Bin(i + H, j + H)] = in[S::Bin(i, j)];
+		for (int j = 1; j <= S::ny; j ++) {
+			int pos = (j == half ? 1 : (j < half ? j + half : j - half));
+			for (int i = 1; i <= H; i ++)
+				out[O::Bin(i, j + H)] = in[S::Bin(H + 1 - i, pos)];
+			for (int i = S::nx + H + 1; i <= S::nx + 2 * H; i ++)
+				out[O::Bin(i, j + H)] = in[S::Bin(S::nx - (i - S::nx - H - 1), pos)];
+		}
+		for (int j = 1; j <= H; j ++) {
+			for (int i = 1; i <= O::nx; i ++) {
+				out[O::Bin(i, j)] = out[O::Bin(i, j + S::ny)];
+				out[O::Bin(i, S::ny + H + j)] = out[O::Bin(i, j + H)];
+			}
+		}
+	}
+};
+
+#endif
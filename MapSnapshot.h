@@ -0,0 +1,125 @@
+#ifndef MapSnapshot_h
+#define MapSnapshot_h
+// Intermediate maps of selected events as raw binary records, one fwrite
+// of the bin array per map, drawn offline by tools/RenderSnapshot.cc.
+// The file starts with "FSNP" and the int32 version, then every record is
+//     int32 event, int32 nx, int32 ny, double xmin, xmax, ymin, ymax,
+//     stage name and map name as int32 length + chars,
+//     (nx + 2) * (ny + 2) doubles in the layout of TH2D::GetArray()
+// in the byte order of the writing host.
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <stdint.h>
+
+struct MapRecord {
+	int32_t event;
+	int32_t nx;
+	int32_t ny;
+	double xmin;
+	double xmax;
+	double ymin;
+	double ymax;
+	std::string stage;
+	std::string name;
+	std::vector<double> bins;
+};
+
+class MapSnapshotWriter {
+	public:
+		MapSnapshotWriter() : m_f(NULL), m_nRecord(0), m_nByte(0) {}
+		~MapSnapshotWriter() { Close(); }
+		bool Open(const std::string& path) {
+			Close();
+			m_f = fopen(path.c_str(), "wb");
+			if (!m_f)
+				return false;
+			int32_t version = 1;
+			fwrite("FSNP", 1, 4, m_f);
+			fwrite(&version, sizeof(version), 1, m_f);
+			return true;
+		}
+		bool IsOpen() const { return m_f; }
+		void Write(int event, const std::string& stage, const std::string& name,
+				   int nx, double xmin, double xmax, int ny, double ymin, double ymax, const double* a) {
+			if (!m_f)
+				return;
+			int32_t head[3] = {event, nx, ny};
+			double range[4] = {xmin, xmax, ymin, ymax};
+			fwrite(head, sizeof(head), 1, m_f);
+			fwrite(range, sizeof(range), 1, m_f);
+			WriteString(stage);
+			WriteString(name);
+			size_t n = (size_t)(nx + 2) * (ny + 2);
+			fwrite(a, sizeof(double), n, m_f);
+			m_nRecord ++;
+			m_nByte += sizeof(head) + sizeof(range) + 8 + stage.size() + name.size() + n * sizeof(double);
+		}
+		void Write(const MapRecord& r) {
+			Write(r.event, r.stage, r.name, r.nx, r.xmin, r.xmax, r.ny, r.ymin, r.ymax, &r.bins[0]);
+		}
+		void Close() {
+			if (m_f)
+				fclose(m_f);
+			m_f = NULL;
+		}
+		long nRecords() const { return m_nRecord; }
+		long nBytes() const { return m_nByte; }
+	private:
+		void WriteString(const std::string& s) {
+			int32_t n = s.size();
+			fwrite(&n, sizeof(n), 1, m_f);
+			fwrite(s.data(), 1, n, m_f);
+		}
+		FILE* m_f;
+		long m_nRecord;
+		long m_nByte;
+};
+
+class MapSnapshotReader {
+	public:
+		MapSnapshotReader() : m_f(NULL) {}
+		~MapSnapshotReader() {
+			if (m_f)
+				fclose(m_f);
+		}
+		bool Open(const std::string& path) {
+			m_f = fopen(path.c_str(), "rb");
+			if (!m_f)
+				return false;
+			char magic[4];
+			int32_t version;
+			if (fread(magic, 1, 4, m_f) != 4 || memcmp(magic, "FSNP", 4) != 0)
+				return false;
+			return fread(&version, sizeof(version), 1, m_f) == 1 && version == 1;
+		}
+		// false at the end of the file or on a truncated record
+		bool Next(MapRecord& r) {
+			int32_t head[3];
+			double range[4];
+			if (fread(head, sizeof(head), 1, m_f) != 1 || fread(range, sizeof(range), 1, m_f) != 1)
+				return false;
+			r.event = head[0];
+			r.nx = head[1];
+			r.ny = head[2];
+			r.xmin = range[0];
+			r.xmax = range[1];
+			r.ymin = range[2];
+			r.ymax = range[3];
+			if (!ReadString(r.stage) || !ReadString(r.name) || r.nx < 1 || r.ny < 1)
+				return false;
+			r.bins.resize((size_t)(r.nx + 2) * (r.ny + 2));
+			return fread(&r.bins[0], sizeof(double), r.bins.size(), m_f) == r.bins.size();
+		}
+	private:
+		bool ReadString(std::string& s) {
+			int32_t n;
+			if (fread(&n, sizeof(n), 1, m_f) != 1 || n < 0 || n > 4096)
+				return false;
+			s.resize(n);
+			return n == 0 || fread(&s[0], 1, n, m_f) == (size_t)n;
+		}
+		FILE* m_f;
+};
+#endif
@@ -0,0 +1,147 @@
+#ifndef MaxTree_h
+#define MaxTree_h
+// Max-tree (component tree) of the bins of a map above a floor, with the
+// 4-neighbourhood of MarkConnection(). A node stands for the connected
+// area of the bins at or above its level, so every threshold of the map
+// is read off the tree instead of relabelling the image.
+//
+// Bins are indexed by their rank in decreasing value, a node is the
+// rank of its canonical bin and its descendants always rank before it.
+#include <vector>
+#include <algorithm>
+
+template <class S>
+class MaxTree {
+	public:
+		MaxTree() : m_rank(S::size, - 1) {}
+
+		void Build(const double* a, double floor) {
+			for (size_t k = 0; k < m_bin.size(); k ++)
+				m_rank[m_bin[k]] = - 1;
+			m_bin.clear();
+			for (int j = 1; j <= S::ny; j ++)
+				for (int i = 1; i <= S::nx; i ++)
+					if (a[S::Bin(i, j)] > floor)
+						m_bin.push_back(S::Bin(i, j));
+			std::sort(m_bin.begin(), m_bin.end(), [a](int x, int y) {
+				return a[x] > a[y] || (a[x] == a[y] && x < y);
+			});
+			int n = m_bin.size();
+			m_val.resize(n);
+			m_parent.resize(n);
+			std::vector<int> zpar(n);
+			for (int k = 0; k < n; k ++) {
+				m_rank[m_bin[k]] = k;
+				m_val[k] = a[m_bin[k]];
+			}
+			// Union-find in decreasing order, the bin joining two areas
+			// becomes their parent
+			const int off[4] = {- 1, 1, - S::stride, S::stride};
+			for (int k = 0; k < n; k ++) {
+				m_parent[k] = k;
+				zpar[k] = k;
+				for (int d = 0; d < 4; d ++) {
+					int r = m_rank[m_bin[k] + off[d]];
+					if (r < 0 || r > k)
+						continue;
+					while (zpar[r] != r)
+						r = zpar[r] = zpar[zpar[r]];
+					if (r != k) {
+						m_parent[r] = k;
+						zpar[r] = k;
+					}
+				}
+			}
+			// Bins of one level point to the canonical bin of their area
+			for (int k = n - 1; k >= 0; k --) {
+				int q = m_parent[k];
+				if (m_val[m_parent[q]] == m_val[q])
+					m_parent[k] = m_parent[q];
+			}
+			m_area.assign(n, 1);
+			m_first.resize(n);
+			m_max.resize(n);
+			m_sum.resize(n);
+			m_lo.resize(n);
+			m_hi.resize(n);
+			for (int k = 0; k < n; k ++) {
+				int i = m_bin[k] % S::stride;
+				int j = m_bin[k] / S::stride;
+				m_first[k] = Key(i, j);
+				m_max[k] = m_val[k];
+				m_sum[k] = m_val[k];
+				m_lo[k] = std::make_pair(i, j);
+				m_hi[k] = std::make_pair(i, j);
+			}
+			for (int k = 0; k < n; k ++) {
+				int p = m_parent[k];
+				if (p == k)
+					continue;
+				m_area[p] += m_area[k];
+				m_first[p] = std::min(m_first[p], m_first[k]);
+				m_max[p] = std::max(m_max[p], m_max[k]);
+				m_sum[p] += m_sum[k];
+				m_lo[p] = std::make_pair(std::min(m_lo[p].first, m_lo[k].first), std::min(m_lo[p].second, m_lo[k].second));
+				m_hi[p] = std::make_pair(std::max(m_hi[p].first, m_hi[k].first), std::max(m_hi[p].second, m_hi[k].second));
+			}
+		}
+
+		int size() const { return m_bin.size(); }
+		int Bin(int k) const { return m_bin[k]; }
+		double Value(int k) const { return m_val[k]; }
+		int Parent(int k) const { return m_parent[k]; }
+		bool Root(int k) const { return m_parent[k] == k; }
+		// Attributes of the area of node k, min is the level of the node
+		int Area(int k) const { return m_area[k]; }
+		int First(int k) const { return m_first[k]; }
+		double Max(int k) const { return m_max[k]; }
+		double Min(int k) const { return m_val[k]; }
+		double Sum(int k) const { return m_sum[k]; }
+		std::pair<int, int> Low(int k) const { return m_lo[k]; }
+		std::pair<int, int> High(int k) const { return m_hi[k]; }
+		// Position of bin (i, j) in the scans of the segmentation
+		static int Key(int i, int j) { return i * (S::ny + 2) + j; }
+
+		// Node of the area above level (at or above unless strict) holding
+		// each bin, - 1 under the level
+		void Cut(double level, bool strict, std::vector<int>& top) const {
+			int n = size();
+			top.assign(n, - 1);
+			for (int k = n - 1; k >= 0; k --) {
+				if (!Over(m_val[k], level, strict))
+					continue;
+				int p = m_parent[k];
+				top[k] = (p == k || !Over(m_val[p], level, strict)) ? k : top[p];
+			}
+		}
+
+		// Areas of top with at least minSize bins, sorted like the labels of
+		// MarkConnection()
+		void Areas(const std::vector<int>& top, int minSize, std::vector<int>& areas) const {
+			areas.clear();
+			for (int k = 0; k < size(); k ++)
+				if (top[k] == k && m_area[k] >= minSize)
+					areas.push_back(k);
+			std::sort(areas.begin(), areas.end(), [this](int x, int y) {
+				return m_first[x] < m_first[y];
+			});
+		}
+
+		static bool Over(double v, double level, bool strict) {
+			return strict ? v > level : v >= level;
+		}
+
+	private:
+		std::vector<int> m_rank;
+		std::vector<int> m_bin;
+		std::vector<double> m_val;
+		std::vector<int> m_parent;
+		std::vector<int> m_area;
+		std::vector<int> m_first;
+		std::vector<double> m_max;
+		std::vector<double> m_sum;
+		std::vector<std::pair<int, int> > m_lo;
+		std::vector<std::pair<int, int> > m_hi;
+};
+
+#endif
@@ -0,0 +1,57 @@
+#include "MuonVetoSvc.h"
+#include "SniperKernel/SvcFactory.h"
+#include "SniperKernel/SniperLog.h"
+
+DECLARE_SERVICE(MuonVetoSvc);
+
+MuonVetoSvc::MuonVetoSvc(const std::string& name)
+: SvcBase(name),
+m_current(0),
+m_nMuon(0)
+{
+	declProp("Depth", m_depth = 16);
+	declProp("VetoWindow", m_window = 1E6);
+}
+
+bool MuonVetoSvc::initialize() {
+	if (m_depth < 1) {
+		LogError << "Depth has to be positive: " << m_depth << std::endl;
+		return false;
+	}
+	m_ring.assign(m_depth, MuonVeto());
+	for (int i = 0; i < 3; i ++)
+		m_nPublish[i] = 0;
+	return true;
+}
+
+bool MuonVetoSvc::finalize() {
+	LogInfo << "Muon veto, muons: " << m_nMuon << "\tfast answers: " << m_nPublish[_VETOFAST]
+			<< "\tfitted answers: " << m_nPublish[_VETOFULL] << std::endl;
+	return true;
+}
+
+const MuonVeto* MuonVetoSvc::Get(int n) const {
+	if (n < 0)
+		return NULL;
+	const MuonVeto& v = m_ring[n % m_depth];
+	return v.event == n ? &v : NULL;
+}
+
+void MuonVetoSvc::Publish(const MuonVeto& v) {
+	// A fitted answer replaces the fast one of its event, it never moves
+	// Current() back to an older event. One arriving after its slot went
+	// to a newer event is dropped.
+	int slot = v.event % m_depth;
+	MuonVeto& old = m_ring[slot];
+	if (v.event < old.event)
+		return;
+	if (old.event == v.event && old.muon)
+		m_nMuon --;
+	m_nMuon += v.muon;
+	old = v;
+	if (v.muon)
+		old.tEnd = v.tStart + m_window;
+	m_nPublish[v.level] ++;
+	if (v.event > m_ring[m_current].event)
+		m_current = slot;
+}
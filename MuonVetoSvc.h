@@ -0,0 +1,50 @@
+#ifndef MuonVetoSvc_h
+#define MuonVetoSvc_h
+// Water pool muon answer of the current event for the selection
+// algorithms. FhtAna publishes it once per event, readers only look it up.
+#include "SniperKernel/SvcBase.h"
+#include "Vec3.h"
+#include <vector>
+
+// Which reconstruction answered
+enum VetoLevel {
+	_VETONONE,
+	_VETOFAST,	// pre-filter and coarse charge map
+	_VETOFULL,	// fitted track
+};
+
+struct MuonVeto {
+	int event = -1;
+	bool muon = false;
+	int level = _VETONONE;
+	Vec3 inci;			// entry point on the LS sphere
+	Vec3 dir;			// unit direction
+	double ti = 0;		// first hit time at the entry, ns
+	int quality = 0;	// bright regions the track rests on, 1 is a charge centre fallback
+	double tStart = 0;	// veto window, ns
+	double tEnd = 0;
+	int degraded = 0;	// cheaper paths of FhtAna.TimeBudget, 0 for the full reconstruction
+};
+
+class MuonVetoSvc : public SvcBase {
+	public:
+		MuonVetoSvc(const std::string&);
+		bool initialize();
+		bool finalize();
+		// Latest event FhtAna has seen, level _VETONONE before the first
+		const MuonVeto& Current() const { return m_ring[m_current]; }
+		// Event n if it is among the last Depth events, NULL otherwise.
+		// With FhtAna.Pipelined the fitted answer of an event comes a few
+		// events later than its fast answer.
+		const MuonVeto* Get(int) const;
+		void Publish(const MuonVeto&);
+		int Depth() const { return m_depth; }
+	private:
+		int m_depth;
+		double m_window;
+		std::vector<MuonVeto> m_ring;
+		int m_current;
+		long m_nPublish[3];
+		long m_nMuon;
+};
+#endif
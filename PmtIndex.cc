@@ -0,0 +1,125 @@
+#include "PmtIndex.h"
+#include <algorithm>
+#include <utility>
+#include <cmath>
+
+PmtIndex::PmtIndex()
+: m_dTheta(M_PI)
+{
+}
+
+void PmtIndex::Build(const std::vector<Vec3>& dir, double cell) {
+	m_dir = dir;
+	int nBand = std::max(1, (int)std::lround(M_PI / cell));
+	m_dTheta = M_PI / nBand;
+	m_nPhi.resize(nBand);
+	m_first.resize(nBand + 1);
+	m_first[0] = 0;
+	for (int b = 0; b < nBand; b ++) {
+		double s = sin((b + 0.5) * m_dTheta);
+		m_nPhi[b] = std::max(1, (int)std::lround(2 * M_PI * s / m_dTheta));
+		m_first[b + 1] = m_first[b] + m_nPhi[b];
+	}
+	int n = m_dir.size();
+	std::vector<int> cellOf(n);
+	m_offset.assign(m_first[nBand] + 1, 0);
+	for (int i = 0; i < n; i ++) {
+		cellOf[i] = Cell(m_dir[i]);
+		m_offset[cellOf[i] + 1] ++;
+	}
+	for (size_t c = 1; c < m_offset.size(); c ++)
+		m_offset[c] += m_offset[c - 1];
+	m_pmt.resize(n);
+	std::vector<int> fill(m_offset.begin(), m_offset.end() - 1);
+	for (int i = 0; i < n; i ++)
+		m_pmt[fill[cellOf[i]] ++] = i;
+}
+
+int PmtIndex::Cell(const Vec3& u) const {
+	int nBand = m_nPhi.size();
+	int b = std::min(nBand - 1, (int)(u.Theta() / m_dTheta));
+	int n = m_nPhi[b];
+	// phi = PI goes to the first cell, as the wrap of the queries
+	int p = (int)floor((u.Phi() + M_PI) / (2 * M_PI) * n) % n;
+	return m_first[b] + p;
+}
+
+void PmtIndex::Radius(const Vec3& u, double a, std::vector<int>& out) const {
+	out.clear();
+	int nBand = m_nPhi.size();
+	if (a >= M_PI) {
+		out.resize(m_dir.size());
+		for (size_t i = 0; i < out.size(); i ++)
+			out[i] = i;
+		return;
+	}
+	double cosA = cos(a);
+	double sinA = sin(a);
+	double t = u.Theta();
+	double ph = u.Phi();
+	int b0 = std::max(0, (int)floor((t - a) / m_dTheta));
+	int b1 = std::min(nBand - 1, (int)floor((t + a) / m_dTheta));
+	// With no pole in the cap, a point at colatitude theta is less than
+	// asin(sin(a) / sin(theta)) off in phi
+	bool pole = t - a <= 0 || t + a >= M_PI;
+	for (int b = b0; b <= b1; b ++) {
+		int n = m_nPhi[b];
+		int p0 = 0;
+		int p1 = n - 1;
+		if (!pole) {
+			double lo = std::max(b * m_dTheta, t - a);
+			double hi = std::min((b + 1) * m_dTheta, t + a);
+			double s = std::min(sin(lo), sin(hi));
+			if (sinA < s) {
+				double dPhi = asin(sinA / s) + 1E-9;
+				double w = 2 * M_PI / n;
+				p0 = (int)floor((ph - dPhi + M_PI) / w);
+				p1 = (int)floor((ph + dPhi + M_PI) / w);
+				if (p1 - p0 >= n) {
+					p0 = 0;
+					p1 = n - 1;
+				}
+			}
+		}
+		for (int p = p0; p <= p1; p ++) {
+			int c = m_first[b] + (p % n + n) % n;
+			for (int k = m_offset[c]; k < m_offset[c + 1]; k ++)
+				if (m_dir[m_pmt[k]] * u >= cosA)
+					out.push_back(m_pmt[k]);
+		}
+	}
+}
+
+void PmtIndex::Band(const Vec3& u, double a0, double a1, std::vector<int>& out) const {
+	Radius(u, a1, out);
+	if (a0 <= 0)
+		return;
+	double cos0 = cos(a0);
+	size_t m = 0;
+	for (size_t k = 0; k < out.size(); k ++)
+		if (m_dir[out[k]] * u <= cos0)
+			out[m ++] = out[k];
+	out.resize(m);
+}
+
+void PmtIndex::Nearest(const Vec3& u, int k, std::vector<int>& out) const {
+	// Caps of doubling radius until one holds k PMTs, which are then
+	// the nearest ones
+	int n = m_dir.size();
+	k = std::min(k, n);
+	out.clear();
+	if (k <= 0)
+		return;
+	for (double a = m_dTheta; ; a *= 2) {
+		Radius(u, a, out);
+		if ((int)out.size() >= k || a >= M_PI)
+			break;
+	}
+	std::vector<std::pair<double, int> > cand(out.size());
+	for (size_t i = 0; i < out.size(); i ++)
+		cand[i] = std::make_pair(- (m_dir[out[i]] * u), out[i]);
+	std::partial_sort(cand.begin(), cand.begin() + k, cand.end());
+	out.resize(k);
+	for (int i = 0; i < k; i ++)
+		out[i] = cand[i].second;
+}
@@ -0,0 +1,34 @@
+#ifndef PmtIndex_h
+#define PmtIndex_h
+// Index of the PMT directions on the sphere, fixed by the geometry. The
+// sphere is cut into bands of equal theta width and each band into phi
+// cells about as wide, the PMTs of a cell are stored together, so a query
+// only looks at the cells its cap overlaps.
+#include "Vec3.h"
+#include <vector>
+
+class PmtIndex {
+	public:
+		PmtIndex();
+		// Unit vectors of the PMTs, cells of about cell radians a side
+		void Build(const std::vector<Vec3>&, double cell);
+		int size() const { return m_dir.size(); }
+		const Vec3& Dir(int i) const { return m_dir[i]; }
+		int nCell() const { return m_offset.size() - 1; }
+		// PMTs within angle a of u, in cell order
+		void Radius(const Vec3& u, double a, std::vector<int>& out) const;
+		// PMTs between angles a0 and a1 of u, a cone for a0 = 0 and a ring,
+		// as a Cherenkov footprint, otherwise
+		void Band(const Vec3& u, double a0, double a1, std::vector<int>& out) const;
+		// k PMTs nearest to u, nearest first and ties by index
+		void Nearest(const Vec3& u, int k, std::vector<int>& out) const;
+	private:
+		int Cell(const Vec3&) const;
+		std::vector<Vec3> m_dir;
+		double m_dTheta;
+		std::vector<int> m_nPhi;	// phi cells of band b, the first is m_first[b]
+		std::vector<int> m_first;
+		std::vector<int> m_offset;	// PMTs of cell c are m_pmt[m_offset[c]] .. m_pmt[m_offset[c + 1] - 1]
+		std::vector<int> m_pmt;
+};
+#endif
@@ -8,7 +8,7 @@
 #ifndef PmtProp_H
 #define PmtProp_H
 //define PMT properity
-#include "TVector3.h"
+#include "Vec3.h"
 #include <vector>
 enum Pmttype {
     _PMTNULL, 
@@ -16,7 +16,7 @@ enum Pmttype {
     _PMTINCH20, 
 }; 
 struct PmtProp{
-    TVector3 pos;
+    Vec3 pos;
     double q;
     double fht;
     double res; 
@@ -0,0 +1,165 @@
+#include "ResultCache.h"
+#include <cstring>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/file.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+static const int32_t cacheVersion = 1;
+static const size_t headSize = 8;
+static const size_t recordHead = 16;
+
+ResultCache::ResultCache()
+: m_map(NULL),
+m_mapSize(0),
+m_fd(-1),
+m_nHit(0),
+m_nMiss(0),
+m_nInsert(0)
+{
+}
+
+ResultCache::~ResultCache() {
+	Close();
+}
+
+bool ResultCache::Open(const std::string& path) {
+	Close();
+	int fd = open(path.c_str(), O_RDWR | O_CREAT, 0644);
+	if (fd < 0)
+		return false;
+	// Held until the records are indexed, so another job can neither
+	// append nor cut the tail in between
+	if (flock(fd, LOCK_EX) != 0) {
+		close(fd);
+		return false;
+	}
+	struct stat st;
+	if (fstat(fd, &st) != 0) {
+		close(fd);
+		return false;
+	}
+	size_t size = st.st_size;
+	if (size == 0) {
+		char head[headSize];
+		memcpy(head, "FCCH", 4);
+		memcpy(head + 4, &cacheVersion, 4);
+		if (write(fd, head, headSize) != (ssize_t)headSize) {
+			close(fd);
+			return false;
+		}
+		size = headSize;
+	}
+	if (size < headSize) {
+		close(fd);
+		return false;
+	}
+	void* p = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+	if (p == MAP_FAILED) {
+		close(fd);
+		return false;
+	}
+	m_map = (char*)p;
+	m_mapSize = size;
+	int32_t version;
+	memcpy(&version, m_map + 4, 4);
+	if (memcmp(m_map, "FCCH", 4) != 0 || version != cacheVersion) {
+		close(fd);
+		Close();
+		return false;
+	}
+
+	// Index the complete records, a record cut by an aborted job is
+	// dropped so the appended ones stay aligned
+	size_t pos = headSize;
+	while (pos + recordHead <= size) {
+		uint32_t n;
+		memcpy(&n, m_map + pos + 12, 4);
+		size_t end = pos + recordHead + (size_t)n * sizeof(double);
+		if (end > size)
+			break;
+		uint64_t key;
+		memcpy(&key, m_map + pos, 8);
+		m_index[key] = m_map + pos;
+		pos = end;
+	}
+	if (pos != size && ftruncate(fd, pos) != 0) {
+		close(fd);
+		Close();
+		return false;
+	}
+	flock(fd, LOCK_UN);
+	m_fd = fd;
+	return true;
+}
+
+void ResultCache::Close() {
+	if (m_fd >= 0)
+		close(m_fd);
+	m_fd = -1;
+	if (m_map)
+		munmap(m_map, m_mapSize);
+	m_map = NULL;
+	m_mapSize = 0;
+	m_index.clear();
+}
+
+const double* ResultCache::Find(uint64_t key, uint32_t check, int& n) {
+	std::unordered_map<uint64_t, const char*>::const_iterator it = m_index.find(key);
+	uint32_t c;
+	if (it == m_index.end() || (memcpy(&c, it->second + 8, 4), c != check)) {
+		m_nMiss ++;
+		return NULL;
+	}
+	uint32_t len;
+	memcpy(&len, it->second + 12, 4);
+	n = len;
+	m_nHit ++;
+	return (const double*)(it->second + recordHead);
+}
+
+void ResultCache::Insert(uint64_t key, uint32_t check, const std::vector<double>& v) {
+	if (m_fd < 0)
+		return;
+	uint32_t n = v.size();
+	m_buf.resize(recordHead + (size_t)n * sizeof(double));
+	memcpy(&m_buf[0], &key, 8);
+	memcpy(&m_buf[8], &check, 4);
+	memcpy(&m_buf[12], &n, 4);
+	if (n)
+		memcpy(&m_buf[recordHead], &v[0], n * sizeof(double));
+	if (flock(m_fd, LOCK_EX) != 0)
+		return;
+	// The end as left by the other jobs, a short write is cut back to it
+	off_t end = lseek(m_fd, 0, SEEK_END);
+	size_t done = 0;
+	while (end >= 0 && done < m_buf.size()) {
+		ssize_t w = write(m_fd, &m_buf[done], m_buf.size() - done);
+		if (w <= 0)
+			break;
+		done += w;
+	}
+	if (done == m_buf.size()) {
+		m_nInsert ++;
+		flock(m_fd, LOCK_UN);
+		return;
+	}
+	// Cutting back only fails on a broken file system, stop appending
+	if (end < 0 || ftruncate(m_fd, end) != 0) {
+		close(m_fd);
+		m_fd = -1;
+		return;
+	}
+	flock(m_fd, LOCK_UN);
+}
+
+uint64_t ResultCache::Hash(const void* data, size_t n, uint64_t seed) {
+	const unsigned char* p = (const unsigned char*)data;
+	uint64_t h = seed;
+	for (size_t i = 0; i < n; i ++) {
+		h ^= p[i];
+		h *= 1099511628211ULL;
+	}
+	return h;
+}
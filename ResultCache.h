@@ -0,0 +1,44 @@
+#ifndef ResultCache_h
+#define ResultCache_h
+// On-disk cache of per-event results, addressed by a hash of the event
+// content and of the settings that produced them. The file is mapped at
+// Open() and looked up in place, results new to the file are appended
+// and found by the next job. The file is "FCCH", int32 version, then
+// records of
+//     uint64 key, uint32 check, uint32 n, n doubles
+// in the byte order of the writing host. Jobs may share the file: the
+// tail check at Open() and each append hold flock(LOCK_EX), and a record
+// goes out in one write(), so appends of other jobs never interleave.
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include <stdint.h>
+
+class ResultCache {
+	public:
+		ResultCache();
+		~ResultCache();
+		bool Open(const std::string&);
+		void Close();
+		bool IsOpen() const { return m_fd >= 0; }
+		// n doubles stored under key, NULL if there are none or check
+		// differs, the pointer stays valid until Close()
+		const double* Find(uint64_t key, uint32_t check, int& n);
+		void Insert(uint64_t key, uint32_t check, const std::vector<double>&);
+		long nHit() const { return m_nHit; }
+		long nMiss() const { return m_nMiss; }
+		long nInsert() const { return m_nInsert; }
+		long nRecords() const { return m_index.size(); }
+		// FNV-1a, chain through seed
+		static uint64_t Hash(const void*, size_t, uint64_t seed = 14695981039346656037ULL);
+	private:
+		std::unordered_map<uint64_t, const char*> m_index;
+		char* m_map;
+		size_t m_mapSize;
+		int m_fd;
+		std::vector<char> m_buf;	// record being appended
+		long m_nHit;
+		long m_nMiss;
+		long m_nInsert;
+};
+#endif
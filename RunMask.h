@@ -0,0 +1,102 @@
+#ifndef RunMask_h
+#define RunMask_h
+// Run-length view of a thresholded or labelled map. Runs go along phi
+// (j) inside each theta column (i) and are ordered like the i-outer,
+// j-inner scans of the segmentation, so walking the runs visits the lit
+// bins in the same order as scanning the whole map.
+#include <vector>
+
+template <class S>
+struct RunMask {
+	std::vector<int> col;	// runs of column i are col[i] .. col[i + 1] - 1
+	std::vector<int> j0;
+	std::vector<int> j1;
+	std::vector<double> val;	// value of the first bin of the run
+
+	int size() const { return j0.size(); }
+
+	// Runs of non-zero bins, also split where the value changes if byValue.
+	// a is a bin array or a map expression.
+	template <class A>
+	void Scan(const A& a, bool byValue) {
+		clear();
+		for (int i = 1; i <= S::nx; i ++) {
+			col[i] = j0.size();
+			for (int j = 1; j <= S::ny; j ++) {
+				double v = a[S::Bin(i, j)];
+				if (!v)
+					continue;
+				int s = j;
+				while (j < S::ny && a[S::Bin(i, j + 1)] && (!byValue || a[S::Bin(i, j + 1)] == v))
+					j ++;
+				push(s, j, v);
+			}
+		}
+		col[S::nx + 1] = j0.size();
+	}
+
+	// Areas of runs touching along theta or phi (4-neighbourhood). label[r]
+	// numbers the areas of at least minSize bins from 1 in the order of
+	// their first run, smaller areas get 0. Returns the last label + 1.
+	int Label(int minSize, std::vector<int>& label) const {
+		int n = size();
+		std::vector<int> parent(n);
+		for (int r = 0; r < n; r ++)
+			parent[r] = r;
+		for (int i = 2; i <= S::nx; i ++) {
+			int a = col[i - 1];
+			int b = col[i];
+			while (a < col[i] && b < col[i + 1]) {
+				if (j0[a] <= j1[b] && j1[a] >= j0[b])
+					unite(parent, a, b);
+				if (j1[a] < j1[b])
+					a ++;
+				else
+					b ++;
+			}
+		}
+		std::vector<int> area(n, 0);
+		for (int r = 0; r < n; r ++)
+			area[find(parent, r)] += j1[r] - j0[r] + 1;
+		label.assign(n, 0);
+		int ID = 1;
+		for (int r = 0; r < n; r ++) {
+			int root = find(parent, r);
+			if (root == r)
+				label[r] = area[r] < minSize ? 0 : ID ++;
+			else
+				label[r] = label[root];
+		}
+		return ID;
+	}
+
+	private:
+		void clear() {
+			col.assign(S::nx + 2, 0);
+			j0.clear();
+			j1.clear();
+			val.clear();
+		}
+		void push(int s, int e, double v) {
+			j0.push_back(s);
+			j1.push_back(e);
+			val.push_back(v);
+		}
+		static int find(std::vector<int>& parent, int r) {
+			while (parent[r] != r)
+				r = parent[r] = parent[parent[r]];
+			return r;
+		}
+		// The smaller run index stays the root, areas keep the order of
+		// their first run
+		static void unite(std::vector<int>& parent, int a, int b) {
+			a = find(parent, a);
+			b = find(parent, b);
+			if (a < b)
+				parent[b] = a;
+			else if (b < a)
+				parent[a] = b;
+		}
+};
+
+#endif
@@ -0,0 +1,20 @@
+#ifndef SkyBinTable_h
+#define SkyBinTable_h
+// PMT to map bin tables of the theta/phi grid, fixed by the geometry and
+// built once at initialization, bins are global TH2D bin numbers
+#include <vector>
+
+struct SkyBinTable {
+	std::vector<int> qBin;		// charge map bin of each PMT, as TH2D::Fill
+	std::vector<int> fhtBin;	// first hit time map bin of each PMT
+	std::vector<int> offset;	// PMTs of bin b are pmt[offset[b]] .. pmt[offset[b + 1] - 1]
+	std::vector<int> pmt;
+	std::vector<double> norm;	// largest PMT count of a bin over the PMT count of each bin, 0 if empty
+	std::vector<int> alias;		// base map bin copied into each extended map bin, -1 if none
+	std::vector<int> aliasExt;	// the same, as the extended map bin of that sky bin
+	std::vector<int> extOffset;	// extended map bins of PMT i are extBin[extOffset[i]] .. extBin[extOffset[i + 1] - 1]
+	std::vector<int> extBin;
+	std::vector<int> coarseCell;	// pooled sky cell of each PMT, Grid::pool bins a side
+	int nPmt(int b) const { return offset[b + 1] - offset[b]; }
+};
+#endif
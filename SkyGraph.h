@@ -0,0 +1,38 @@
+#ifndef SkyGraph_h
+#define SkyGraph_h
+// Neighbour graph over directions on the sky, stored as CSR arrays
+#include "Vec3.h"
+#include <vector>
+#include <algorithm>
+
+struct SkyGraph {
+	std::vector<Vec3> node;	// unit vector of each node
+	std::vector<int> offset;	// neighbours of node i are adj[offset[i]] .. adj[offset[i + 1] - 1]
+	std::vector<int> adj;
+	int size() const { return node.size(); }
+	int begin(int i) const { return offset[i]; }
+	int end(int i) const { return offset[i + 1]; }
+	// Adds the missing reverse edges and drops repeated ones, so j is a
+	// neighbour of i exactly when i is one of j. The labelling and the
+	// smoothing then do not depend on the scan order.
+	void Symmetrize() {
+		int n = size();
+		std::vector<std::vector<int> > nb(n);
+		for (int i = 0; i < n; i ++)
+			for (int k = begin(i); k < end(i); k ++) {
+				nb[i].push_back(adj[k]);
+				nb[adj[k]].push_back(i);
+			}
+		offset.assign(1, 0);
+		adj.clear();
+		for (int i = 0; i < n; i ++) {
+			std::sort(nb[i].begin(), nb[i].end());
+			nb[i].erase(std::unique(nb[i].begin(), nb[i].end()), nb[i].end());
+			for (size_t k = 0; k < nb[i].size(); k ++)
+				if (nb[i][k] != i)
+					adj.push_back(nb[i][k]);
+			offset.push_back(adj.size());
+		}
+	}
+};
+#endif
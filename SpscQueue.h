@@ -0,0 +1,107 @@
+#ifndef SpscQueue_h
+#define SpscQueue_h
+// Bounded lock-free ring between one producer and one consumer thread.
+// Push() and Pop() wait when the ring is full or empty, the waits and the
+// depth seen at every push tell which side holds the other back.
+#include <atomic>
+#include <chrono>
+#include <thread>
+#include <vector>
+
+template <class T>
+class SpscQueue {
+	public:
+		explicit SpscQueue(int capacity)
+		: m_ring(capacity + 1),
+		m_head(0),
+		m_tail(0),
+		m_nPush(0),
+		m_depthSum(0),
+		m_maxDepth(0),
+		m_nFull(0),
+		m_nEmpty(0)
+		{
+		}
+
+		bool TryPush(const T& v) {
+			size_t t = m_tail.load(std::memory_order_relaxed);
+			size_t n = next(t);
+			if (n == m_head.load(std::memory_order_acquire))
+				return false;
+			m_ring[t] = v;
+			m_tail.store(n, std::memory_order_release);
+			int depth = Size();
+			m_nPush ++;
+			m_depthSum += depth;
+			if (depth > m_maxDepth)
+				m_maxDepth = depth;
+			return true;
+		}
+
+		bool TryPop(T& v) {
+			size_t h = m_head.load(std::memory_order_relaxed);
+			if (h == m_tail.load(std::memory_order_acquire))
+				return false;
+			v = m_ring[h];
+			m_head.store(next(h), std::memory_order_release);
+			return true;
+		}
+
+		// idle() is called while the ring is full, the producer can serve
+		// its other duties meanwhile
+		template <class F>
+		void Push(const T& v, F idle) {
+			if (TryPush(v))
+				return;
+			m_nFull ++;
+			for (int n = 0; !TryPush(v); n ++) {
+				idle();
+				Wait(n);
+			}
+		}
+
+		T Pop() {
+			T v;
+			if (TryPop(v))
+				return v;
+			m_nEmpty ++;
+			for (int n = 0; !TryPop(v); n ++)
+				Wait(n);
+			return v;
+		}
+
+		int Size() const {
+			size_t h = m_head.load(std::memory_order_acquire);
+			size_t t = m_tail.load(std::memory_order_acquire);
+			return (t + m_ring.size() - h) % m_ring.size();
+		}
+		int Capacity() const { return m_ring.size() - 1; }
+		// Producer side
+		long nPush() const { return m_nPush; }
+		double MeanDepth() const { return m_nPush ? (double)m_depthSum / m_nPush : 0; }
+		int MaxDepth() const { return m_maxDepth; }
+		long nFull() const { return m_nFull; }
+		// Consumer side
+		long nEmpty() const { return m_nEmpty; }
+
+	private:
+		size_t next(size_t i) const { return i + 1 == m_ring.size() ? 0 : i + 1; }
+		// Spin briefly, then sleep so an idle side does not hold a core
+		static void Wait(int n) {
+			if (n < 64)
+				std::this_thread::yield();
+			else
+				std::this_thread::sleep_for(std::chrono::microseconds(50));
+		}
+
+		std::vector<T> m_ring;
+		std::atomic<size_t> m_head;
+		std::atomic<size_t> m_tail;
+		long m_nPush;
+		long m_depthSum;
+		int m_maxDepth;
+		long m_nFull;
+		long m_nEmpty;
+};
+
+#endif
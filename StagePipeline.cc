@@ -0,0 +1,215 @@
+#include "StagePipeline.h"
+#include <algorithm>
+#include <chrono>
+
+StagePipeline::StagePipeline()
+: m_nAlloc(0),
+m_nLive(0),
+m_peakLive(0)
+{
+}
+
+StagePipeline::~StagePipeline() {
+	Clear();
+	std::map<std::pair<int, int>, std::vector<TH2D*> >::iterator it = m_free.begin();
+	for (; it != m_free.end(); it ++)
+		for (size_t i = 0; i < it->second.size(); i ++)
+			delete it->second[i];
+}
+
+void StagePipeline::AddStage(const std::string& name, const std::vector<std::string>& in, const std::vector<std::string>& out, Action act) {
+	Stage st;
+	st.name = name;
+	st.in = in;
+	st.out = out;
+	st.act = act;
+	st.needed = false;
+	st.skip = false;
+	st.time = 0;
+	m_stages.push_back(st);
+}
+
+bool StagePipeline::Plan(const std::vector<std::string>& req) {
+	// Producer of every name, stages are run in declaration order so a
+	// producer has to be declared before its consumers
+	std::map<std::string, int> producer;
+	for (size_t i = 0; i < m_stages.size(); i ++) {
+		m_stages[i].needed = false;
+		m_stages[i].dying.clear();
+		for (size_t k = 0; k < m_stages[i].out.size(); k ++) {
+			if (producer.count(m_stages[i].out[k])) {
+				m_error = m_stages[i].out[k] + " is produced by more than one stage";
+				return false;
+			}
+			producer[m_stages[i].out[k]] = i;
+		}
+	}
+
+	std::vector<int> work;
+	for (size_t k = 0; k < req.size(); k ++) {
+		if (!producer.count(req[k])) {
+			m_error = "no stage produces " + req[k];
+			return false;
+		}
+		work.push_back(producer[req[k]]);
+	}
+	while (!work.empty()) {
+		int i = work.back();
+		work.pop_back();
+		if (m_stages[i].needed)
+			continue;
+		m_stages[i].needed = true;
+		for (size_t k = 0; k < m_stages[i].in.size(); k ++) {
+			const std::string& name = m_stages[i].in[k];
+			if (!producer.count(name)) {
+				m_error = "no stage produces " + name + ", needed by " + m_stages[i].name;
+				return false;
+			}
+			if (producer[name] >= (int)i) {
+				m_error = name + " is produced after its consumer " + m_stages[i].name;
+				return false;
+			}
+			work.push_back(producer[name]);
+		}
+	}
+
+	// Liveness, a buffer dies after the last planned stage touching it
+	std::map<std::string, int> last;
+	for (size_t i = 0; i < m_stages.size(); i ++) {
+		if (!m_stages[i].needed)
+			continue;
+		for (size_t k = 0; k < m_stages[i].in.size(); k ++)
+			last[m_stages[i].in[k]] = i;
+		for (size_t k = 0; k < m_stages[i].out.size(); k ++)
+			last[m_stages[i].out[k]] = i;
+	}
+	m_keep = req;
+	std::map<std::string, int>::iterator it = last.begin();
+	for (; it != last.end(); it ++)
+		if (std::find(m_keep.begin(), m_keep.end(), it->first) == m_keep.end())
+			m_stages[it->second].dying.push_back(it->first);
+	m_error.clear();
+	return true;
+}
+
+bool StagePipeline::Run() {
+	for (size_t i = 0; i < m_stages.size(); i ++)
+		m_stages[i].time = 0;
+	for (size_t i = 0; i < m_stages.size(); i ++) {
+		Stage& st = m_stages[i];
+		if (!st.needed)
+			continue;
+		if (!st.skip) {
+			std::chrono::steady_clock::time_point t0 = std::chrono::steady_clock::now();
+			bool ok = st.act();
+			st.time = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - t0).count();
+			if (!ok) {
+				m_error = st.name;
+				return false;
+			}
+			if (m_watch) {
+				for (size_t k = 0; k < st.in.size() + st.out.size(); k ++) {
+					const std::string& name = k < st.in.size() ? st.in[k] : st.out[k - st.in.size()];
+					if (TH2D* h = Get(name))
+						m_watch(st.name, name, h);
+				}
+			}
+		}
+		for (size_t k = 0; k < st.dying.size(); k ++) {
+			std::map<std::string, TH2D*>::iterator it = m_live.find(st.dying[k]);
+			if (it == m_live.end())
+				continue;
+			Release(it->second);
+			m_live.erase(it);
+		}
+	}
+	return true;
+}
+
+bool StagePipeline::Needed(const std::string& name) const {
+	for (size_t i = 0; i < m_stages.size(); i ++) {
+		if (!m_stages[i].needed)
+			continue;
+		if (std::find(m_stages[i].out.begin(), m_stages[i].out.end(), name) != m_stages[i].out.end())
+			return true;
+	}
+	return false;
+}
+
+bool StagePipeline::Produces(const std::string& stage, const std::string& name) const {
+	for (size_t i = 0; i < m_stages.size(); i ++)
+		if (m_stages[i].name == stage)
+			return std::find(m_stages[i].out.begin(), m_stages[i].out.end(), name) != m_stages[i].out.end();
+	return false;
+}
+
+void StagePipeline::Skip(const std::string& name) {
+	for (size_t i = 0; i < m_stages.size(); i ++)
+		if (m_stages[i].name == name)
+			m_stages[i].skip = true;
+}
+
+std::vector<std::string> StagePipeline::Planned() const {
+	std::vector<std::string> ret;
+	for (size_t i = 0; i < m_stages.size(); i ++)
+		if (m_stages[i].needed)
+			ret.push_back(m_stages[i].name);
+	return ret;
+}
+
+TH2D* StagePipeline::Acquire(const char* name, int nx, double x0, double x1, int ny, double y0, double y1) {
+	// Buffers of one shape always share the axis ranges in this package
+	std::vector<TH2D*>& pool = m_free[std::make_pair(nx, ny)];
+	TH2D* h;
+	if (pool.empty()) {
+		h = new TH2D(name, "", nx, x0, x1, ny, y0, y1);
+		h->SetDirectory(0);
+		m_nAlloc ++;
+	}
+	else {
+		h = pool.back();
+		pool.pop_back();
+	}
+	m_nLive ++;
+	if (m_nLive > m_peakLive)
+		m_peakLive = m_nLive;
+	return h;
+}
+
+void StagePipeline::Put(const std::string& name, TH2D* h) {
+	TH2D*& slot = m_live[name];
+	if (slot && slot != h)
+		Release(slot);
+	slot = h;
+}
+
+TH2D* StagePipeline::Get(const std::string& name) const {
+	std::map<std::string, TH2D*>::const_iterator it = m_live.find(name);
+	return it == m_live.end() ? NULL : it->second;
+}
+
+void StagePipeline::Move(const std::string& from, const std::string& to) {
+	std::map<std::string, TH2D*>::iterator it = m_live.find(from);
+	if (it == m_live.end())
+		return;
+	TH2D* h = it->second;
+	m_live.erase(it);
+	Put(to, h);
+}
+
+void StagePipeline::Release(TH2D* h) {
+	if (!h)
+		return;
+	h->Reset();
+	m_free[std::make_pair(h->GetNbinsX(), h->GetNbinsY())].push_back(h);
+	m_nLive --;
+}
+
+void StagePipeline::Clear() {
+	for (size_t i = 0; i < m_stages.size(); i ++)
+		m_stages[i].skip = false;
+	std::map<std::string, TH2D*>::iterator it = m_live.begin();
+	for (; it != m_live.end(); it ++)
+		Release(it->second);
+	m_live.clear();
+}
@@ -0,0 +1,67 @@
+#ifndef StagePipeline_h
+#define StagePipeline_h
+// Reconstruction stages declared with named inputs and outputs. Only the
+// stages the requested outputs depend on are run, and every map buffer
+// goes back to a free pool right after its last consumer.
+#include "TH2D.h"
+#include <functional>
+#include <string>
+#include <vector>
+#include <map>
+
+class StagePipeline {
+	public:
+		typedef std::function<bool()> Action;
+		// Stage name, map name, map
+		typedef std::function<void(const std::string&, const std::string&, TH2D*)> Watch;
+		StagePipeline();
+		~StagePipeline();
+		void AddStage(const std::string&, const std::vector<std::string>&, const std::vector<std::string>&, Action);
+		bool Plan(const std::vector<std::string>&);
+		bool Run();
+		// Leave a planned stage out of the current Run(), until Clear()
+		void Skip(const std::string&);
+		// Called after every stage run with each live map it read or
+		// wrote, before the dead ones go back to the pool
+		void SetWatch(Watch w) { m_watch = w; }
+		bool Needed(const std::string&) const;
+		// Stage name, output name
+		bool Produces(const std::string&, const std::string&) const;
+		const std::string& Error() const { return m_error; }
+		std::vector<std::string> Planned() const;
+		// Wall time of each declared stage in the last Run(), ms, 0 if it
+		// did not run
+		int nStages() const { return m_stages.size(); }
+		const std::string& StageName(int i) const { return m_stages[i].name; }
+		double StageTime(int i) const { return m_stages[i].time; }
+		// Map buffers
+		TH2D* Acquire(const char*, int, double, double, int, double, double);
+		void Put(const std::string&, TH2D*);
+		TH2D* Get(const std::string&) const;
+		void Move(const std::string&, const std::string&);
+		void Release(TH2D*);
+		void Clear();
+		int nAllocated() const { return m_nAlloc; }
+		int PeakLive() const { return m_peakLive; }
+	private:
+		struct Stage {
+			std::string name;
+			std::vector<std::string> in;
+			std::vector<std::string> out;
+			Action act;
+			bool needed;
+			bool skip;
+			double time;
+			std::vector<std::string> dying;
+		};
+		std::vector<Stage> m_stages;
+		std::vector<std::string> m_keep;
+		std::map<std::string, TH2D*> m_live;
+		std::map<std::pair<int, int>, std::vector<TH2D*> > m_free;
+		std::string m_error;
+		Watch m_watch;
+		int m_nAlloc;
+		int m_nLive;
+		int m_peakLive;
+};
+#endif
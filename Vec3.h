@@ -0,0 +1,89 @@
+#ifndef Vec3_h
+#define Vec3_h
+// Plain 3- and 2-vectors for the internal geometry. They follow the
+// TVector3 / TVector2 interface and arithmetic, including * as the dot
+// product, but carry no TObject base, so they stay three (two) packed
+// doubles that inline fully. TVector3 is only met at the event data and
+// output boundary, through From() and Root().
+#include "TVector3.h"
+#include <cmath>
+#include <type_traits>
+
+struct Vec3 {
+	double x, y, z;
+
+	constexpr Vec3() : x(0), y(0), z(0) {}
+	constexpr Vec3(double x, double y, double z) : x(x), y(y), z(z) {}
+	static Vec3 From(const TVector3& v) { return Vec3(v.X(), v.Y(), v.Z()); }
+	TVector3 Root() const { return TVector3(x, y, z); }
+
+	constexpr double X() const { return x; }
+	constexpr double Y() const { return y; }
+	constexpr double Z() const { return z; }
+	constexpr double Mag2() const { return x * x + y * y + z * z; }
+	double Mag() const { return std::sqrt(Mag2()); }
+	double Perp() const { return std::sqrt(x * x + y * y); }
+	double Theta() const { return std::atan2(Perp(), z); }
+	double Phi() const { return std::atan2(y, x); }
+	constexpr double Dot(const Vec3& o) const { return x * o.x + y * o.y + z * o.z; }
+	constexpr Vec3 Cross(const Vec3& o) const { return Vec3(y * o.z - z * o.y, z * o.x - x * o.z, x * o.y - y * o.x); }
+	Vec3 Unit() const {
+		double m2 = Mag2();
+		double s = m2 > 0 ? 1 / std::sqrt(m2) : 1;
+		return Vec3(x * s, y * s, z * s);
+	}
+	double Angle(const Vec3& o) const {
+		double m2 = Mag2() * o.Mag2();
+		if (m2 <= 0)
+			return 0;
+		double c = Dot(o) / std::sqrt(m2);
+		return std::acos(c > 1 ? 1 : (c < - 1 ? - 1 : c));
+	}
+	void SetMagThetaPhi(double mag, double theta, double phi) {
+		double m = std::fabs(mag);
+		x = m * std::sin(theta) * std::cos(phi);
+		y = m * std::sin(theta) * std::sin(phi);
+		z = m * std::cos(theta);
+	}
+
+	// Rotation by angle around axis, the matrix of TRotation::Rotate()
+	void Rotate(double angle, const Vec3& axis) {
+		double l = axis.Mag();
+		if (angle == 0 || l == 0)
+			return;
+		double s = std::sin(angle);
+		double c = std::cos(angle);
+		double dx = axis.x / l;
+		double dy = axis.y / l;
+		double dz = axis.z / l;
+		*this = Vec3((c + (1 - c) * dx * dx) * x + ((1 - c) * dx * dy - s * dz) * y + ((1 - c) * dx * dz + s * dy) * z,
+					 ((1 - c) * dy * dx + s * dz) * x + (c + (1 - c) * dy * dy) * y + ((1 - c) * dy * dz - s * dx) * z,
+					 ((1 - c) * dz * dx - s * dy) * x + ((1 - c) * dz * dy + s * dx) * y + (c + (1 - c) * dz * dz) * z);
+	}
+
+	constexpr Vec3 operator - () const { return Vec3(- x, - y, - z); }
+	Vec3& operator += (const Vec3& o) { x += o.x; y += o.y; z += o.z; return *this; }
+	Vec3& operator -= (const Vec3& o) { x -= o.x; y -= o.y; z -= o.z; return *this; }
+	Vec3& operator *= (double a) { x *= a; y *= a; z *= a; return *this; }
+};
+
+constexpr Vec3 operator + (const Vec3& a, const Vec3& b) { return Vec3(a.x + b.x, a.y + b.y, a.z + b.z); }
+constexpr Vec3 operator - (const Vec3& a, const Vec3& b) { return Vec3(a.x - b.x, a.y - b.y, a.z - b.z); }
+constexpr double operator * (const Vec3& a, const Vec3& b) { return a.Dot(b); }
+constexpr Vec3 operator * (double a, const Vec3& v) { return Vec3(a * v.x, a * v.y, a * v.z); }
+constexpr Vec3 operator * (const Vec3& v, double a) { return Vec3(a * v.x, a * v.y, a * v.z); }
+
+struct Vec2 {
+	double x, y;
+
+	constexpr Vec2() : x(0), y(0) {}
+	constexpr Vec2(double x, double y) : x(x), y(y) {}
+	constexpr double X() const { return x; }
+	constexpr double Y() const { return y; }
+	void Set(double a, double b) { x = a; y = b; }
+};
+
+static_assert(std::is_trivially_copyable<Vec3>::value && sizeof(Vec3) == 3 * sizeof(double), "Vec3 has to stay packed doubles");
+static_assert(std::is_trivially_copyable<Vec2>::value && sizeof(Vec2) == 2 * sizeof(double), "Vec2 has to stay packed doubles");
+
+#endif
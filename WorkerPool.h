@@ -0,0 +1,89 @@
+#ifndef WorkerPool_h
+#define WorkerPool_h
+// Threads started once and handed one job per Run(). The caller takes
+// part as thread 0, so Start(n) keeps n - 1 threads waiting between runs.
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+class WorkerPool {
+	public:
+		WorkerPool()
+		: m_n(1),
+		m_gen(0),
+		m_pending(0),
+		m_stop(false)
+		{
+		}
+		~WorkerPool() { Stop(); }
+
+		void Start(int n) {
+			Stop();
+			m_n = n < 1 ? 1 : n;
+			m_stop = false;
+			for (int t = 1; t < m_n; t ++)
+				m_threads.push_back(std::thread(&WorkerPool::Loop, this, t, m_gen));
+		}
+
+		void Stop() {
+			{
+				std::lock_guard<std::mutex> lock(m_mutex);
+				m_stop = true;
+			}
+			m_wake.notify_all();
+			for (size_t t = 0; t < m_threads.size(); t ++)
+				m_threads[t].join();
+			m_threads.clear();
+			m_n = 1;
+		}
+
+		int size() const { return m_n; }
+
+		// job(t) for t = 0 .. size() - 1, back when every thread is done
+		void Run(const std::function<void(int)>& job) {
+			{
+				std::lock_guard<std::mutex> lock(m_mutex);
+				m_job = job;
+				m_pending = m_n - 1;
+				m_gen ++;
+			}
+			m_wake.notify_all();
+			job(0);
+			std::unique_lock<std::mutex> lock(m_mutex);
+			m_done.wait(lock, [this]() { return m_pending == 0; });
+		}
+
+	private:
+		// seen is the last job run, a restarted pool skips the old ones
+		void Loop(int t, long seen) {
+			for (;;) {
+				std::function<void(int)> job;
+				{
+					std::unique_lock<std::mutex> lock(m_mutex);
+					m_wake.wait(lock, [&]() { return m_stop || m_gen != seen; });
+					if (m_stop)
+						return;
+					seen = m_gen;
+					job = m_job;
+				}
+				job(t);
+				std::lock_guard<std::mutex> lock(m_mutex);
+				if (-- m_pending == 0)
+					m_done.notify_one();
+			}
+		}
+
+		int m_n;
+		std::vector<std::thread> m_threads;
+		std::mutex m_mutex;
+		std::condition_variable m_wake;
+		std::condition_variable m_done;
+		std::function<void(int)> m_job;
+		long m_gen;
+		int m_pending;
+		bool m_stop;
+};
+
+#endif
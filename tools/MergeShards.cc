@@ -0,0 +1,92 @@
+// Merges the shard files of FhtAna batch jobs (the Shard property):
+//     MergeShards <output> <shard> [<shard> ...]
+// Trees (rec, sweep, maps, jobs) are appended shard by shard with basket copies,
+// histograms (counters and timing) are summed, so only one shard is open
+// at a time and no tree is read into memory. A shard whose rec tree does
+// not match the first one is left out. Built against ROOT alone:
+//     g++ -O2 MergeShards.cc $(root-config --cflags --libs) -o MergeShards
+#include "TFile.h"
+#include "TTree.h"
+#include "TH1.h"
+#include "TKey.h"
+#include "TList.h"
+#include "TObjArray.h"
+#include <iostream>
+#include <map>
+#include <set>
+#include <string>
+
+int main(int argc, char** argv) {
+	if (argc < 3) {
+		std::cerr << "Usage: " << argv[0] << " <output> <shard> [<shard> ...]" << std::endl;
+		return 1;
+	}
+	TFile* out = TFile::Open(argv[1], "RECREATE");
+	if (!out || out->IsZombie()) {
+		std::cerr << "Cannot create " << argv[1] << std::endl;
+		return 1;
+	}
+	std::map<std::string, TTree*> trees;
+	std::map<std::string, TH1*> hists;
+	int nRecBranch = -1;
+	int nMerged = 0;
+	int status = 0;
+	for (int i = 2; i < argc; i ++) {
+		TFile* in = TFile::Open(argv[i]);
+		if (!in || in->IsZombie()) {
+			std::cerr << "Cannot open " << argv[i] << ", skipped" << std::endl;
+			status = 1;
+			delete in;
+			continue;
+		}
+		TTree* rec = dynamic_cast<TTree*>(in->Get("rec"));
+		int nBranch = rec ? rec->GetListOfBranches()->GetEntries() : -1;
+		if (!rec || (nRecBranch >= 0 && nBranch != nRecBranch)) {
+			std::cerr << argv[i] << " is not a shard of the same layout, skipped" << std::endl;
+			status = 1;
+			in->Close();
+			delete in;
+			continue;
+		}
+		nRecBranch = nBranch;
+		// Keys come highest cycle first
+		std::set<std::string> seen;
+		TIter next(in->GetListOfKeys());
+		while (TKey* key = (TKey*)next()) {
+			std::string name = key->GetName();
+			if (!seen.insert(name).second)
+				continue;
+			TObject* obj = key->ReadObj();
+			if (TTree* t = dynamic_cast<TTree*>(obj)) {
+				out->cd();
+				TTree*& o = trees[name];
+				if (!o)
+					o = t->CloneTree(0);
+				o->CopyEntries(t, -1, "fast");
+			}
+			else if (TH1* h = dynamic_cast<TH1*>(obj)) {
+				TH1*& o = hists[name];
+				if (!o) {
+					o = (TH1*)h->Clone();
+					o->SetDirectory(0);
+				}
+				else
+					o->Add(h);
+				delete h;
+			}
+			else
+				delete obj;
+		}
+		in->Close();
+		delete in;
+		nMerged ++;
+	}
+	out->cd();
+	for (std::map<std::string, TTree*>::iterator it = trees.begin(); it != trees.end(); it ++)
+		it->second->Write();
+	for (std::map<std::string, TH1*>::iterator it = hists.begin(); it != hists.end(); it ++)
+		it->second->Write();
+	out->Close();
+	std::cout << "Shards merged: " << nMerged << " of " << argc - 2 << std::endl;
+	return status;
+}
@@ -0,0 +1,74 @@
+// Draws the maps of a FhtAna snapshot file (see MapSnapshot.h), away from
+// the reconstruction job:
+//     RenderSnapshot <snapshot file> <output directory> [pdf|png] [event]
+// pdf gives one file per event with a page per map, png one picture per
+// map. Built against ROOT alone:
+//     g++ -O2 -I.. RenderSnapshot.cc $(root-config --cflags --libs) -o RenderSnapshot
+#include "MapSnapshot.h"
+#include "TH2D.h"
+#include "TCanvas.h"
+#include "TStyle.h"
+#include "TString.h"
+#include "TROOT.h"
+#include <iostream>
+#include <cstdlib>
+
+int main(int argc, char** argv) {
+	if (argc < 3) {
+		std::cerr << "Usage: " << argv[0] << " <snapshot file> <output directory> [pdf|png] [event]" << std::endl;
+		return 1;
+	}
+	TString outDir = argv[2];
+	bool png = argc > 3 && TString(argv[3]) == "png";
+	bool oneEvent = argc > 4;
+	int only = oneEvent ? atoi(argv[4]) : 0;
+
+	MapSnapshotReader in;
+	if (!in.Open(argv[1])) {
+		std::cerr << "Not a snapshot file: " << argv[1] << std::endl;
+		return 1;
+	}
+	gROOT->SetBatch(true);
+	gStyle->SetOptStat(0000);
+	gStyle->SetPalette(1);
+	TCanvas c("Snapshot", "", 800, 800);
+	c.SetRightMargin(0.15);
+	c.SetBottomMargin(0.15);
+	c.SetLeftMargin(0.15);
+	c.SetTopMargin(0.15);
+
+	MapRecord r;
+	TString pdf;
+	int nMap = 0;
+	while (in.Next(r)) {
+		if (oneEvent && r.event != only)
+			continue;
+		TString path = outDir + "/" + TString::Format("snap_%d", r.event);
+		if (!png && path + ".pdf" != pdf) {
+			if (pdf.Length())
+				c.Print(pdf + "]");
+			pdf = path + ".pdf";
+			c.Print(pdf + "[");
+		}
+		TH2D h(TString::Format("%s_%s", r.stage.c_str(), r.name.c_str()),
+			   TString::Format("%s after %s, event %d", r.name.c_str(), r.stage.c_str(), r.event),
+			   r.nx, r.xmin, r.xmax, r.ny, r.ymin, r.ymax);
+		h.SetDirectory(0);
+		double* a = h.GetArray();
+		for (size_t b = 0; b < r.bins.size(); b ++)
+			a[b] = r.bins[b];
+		h.GetXaxis()->SetTitle("Theta / Radian");
+		h.GetYaxis()->SetTitle("Phi / Radian");
+		c.cd();
+		h.Draw("colz");
+		if (png)
+			c.Print(path + "_" + r.stage.c_str() + "_" + r.name.c_str() + ".png");
+		else
+			c.Print(pdf);
+		nMap ++;
+	}
+	if (pdf.Length())
+		c.Print(pdf + "]");
+	std::cout << "Maps drawn: " << nMap << std::endl;
+	return 0;
+}